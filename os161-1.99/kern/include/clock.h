@@ -38,6 +38,13 @@
  * hardclock() is called on every CPU HZ times a second, possibly only
  * when the CPU is not idle, for scheduling.
  *
+ * hardclock_nextevent() tells a timer driver that can reprogram the
+ * tick how many hardclocks from now the current CPU next needs one;
+ * 0 means none until it gets some other interrupt. A driver that
+ * skips ticks this way reports them with hardclock_skip() so the
+ * hardclock count still tracks time. The "tickless" tunable turns
+ * this off (every tick is needed and does the full work).
+ *
  * timerclock() is called on one CPU once a second to allow simple
  * timed operations. (This is a fairly simpleminded interface.)
  *
@@ -59,8 +66,13 @@
 void hardclock_bootstrap(void);
 
 void hardclock(void);
+unsigned hardclock_nextevent(void);
+void hardclock_skip(unsigned nclocks);
+void hardclock_printstats(void);
 void timerclock(void);
 
+extern unsigned hardclock_tickless;
+
 void gettime(time_t *seconds, uint32_t *nanoseconds);
 
 void getinterval(time_t secs1, uint32_t nsecs,
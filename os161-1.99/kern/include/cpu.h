@@ -35,6 +35,52 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+struct addrspace;
+struct proc;
+
+/*
+ * Wakeup inbox.
+ *
+ * Threads woken up by another cpu are posted to the target cpu's
+ * inbox instead of being put on its run queue directly, so remote
+ * wakers never touch c_runqueue_lock. Each cpu has one ring per
+ * possible source cpu. Only the source cpu, with interrupts off, ever
+ * advances ib_tail, and only the owning cpu ever advances ib_head, so
+ * no locking or atomic operations are needed. (This relies on the
+ * sequentially consistent memory of System/161; real hardware would
+ * need a store barrier between filling a slot and bumping ib_tail.)
+ */
+#define INBOX_MAXCPUS	32	/* Also at most CPUMASK_BITS */
+#define INBOX_SLOTS	8
+
+struct cpu_inbox {
+	struct thread *volatile ib_ring[INBOX_SLOTS];
+	volatile unsigned ib_head;	/* Next slot to drain */
+	volatile unsigned ib_tail;	/* Next slot to fill */
+};
+
+/*
+ * Scheduler statistics. Each cpu updates only its own, with
+ * interrupts off, so they need no locking; other cpus reading them
+ * may see slightly stale values, which is fine for statistics.
+ *
+ * The wait histogram counts how long threads sat runnable before
+ * they ran, in log2 microseconds: bucket 0 is under 1 us, bucket i
+ * is [2^(i-1), 2^i) us, and the last bucket is everything longer.
+ */
+#define SCHEDSTAT_BUCKETS 20
+
+struct schedstat {
+	unsigned ss_switches;		/* Switches to a different thread */
+	unsigned ss_sleeps;		/* Switches because the thread slept */
+	unsigned ss_wakeups;		/* Threads made runnable from here */
+	unsigned ss_remotewakeups;	/* ...that went to another cpu */
+	unsigned ss_idles;		/* Calls to cpu_idle */
+	unsigned ss_idleusecs;		/* Microseconds spent idle */
+	unsigned ss_steals;		/* Threads stolen from other cpus */
+	unsigned ss_migrations;		/* Threads pushed to other cpus */
+	unsigned ss_waithist[SCHEDSTAT_BUCKETS]; /* Run queue latency */
+};
 
 /*
  * Per-cpu structure
@@ -60,15 +106,51 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_schedules;		/* Counter of schedule() calls */
+	unsigned c_idleclocks;		/* hardclocks that found us idle */
+	unsigned c_noyieldclocks;	/* hardclocks with nothing to yield to */
+	unsigned c_skippedclocks;	/* hardclocks the timer never took */
+	struct threadlist c_threadcache; /* Dead threads kept for reuse */
+	struct addrspace *c_lastas;	/* Address space loaded in the MMU */
+	unsigned c_lastasgen;		/* as_generation when it was loaded */
+	unsigned c_asreloads;		/* Address space loads done */
+	unsigned c_aselided;		/* Address space loads skipped */
+	struct schedstat c_stats;	/* Scheduler statistics */
+	unsigned c_rcu_gp;		/* Last RCU grace period we passed */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct runqueue c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_edfqueue;	/* Runnable EDF threads, unsorted */
+	struct threadlist c_gangstaged;	/* Gang threads not yet published */
+	unsigned c_load;		/* Load; see LOAD_SCALE */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Share of this cpu reserved by EDF threads, in 1/EDF_UTILSCALE.
+	 * Protected by the EDF admission lock in thread.c.
+	 */
+	unsigned c_edfutil;
+
+	/*
+	 * Accessed by other cpus without locking; see above.
+	 *
+	 * c_inbox_pending is set by whichever waker finds it clear
+	 * (that waker also sends IPI_UNIDLE) and cleared by this cpu
+	 * before it drains the inbox.
+	 */
+	volatile bool c_inbox_pending;	/* True if the inbox may be nonempty */
+	struct cpu_inbox c_inbox[INBOX_MAXCPUS];
+
+	/*
+	 * Written only by this cpu, in thread_switch. Other cpus only
+	 * compare it against other pointers; see thread_gang_kick.
+	 */
+	struct proc *volatile c_gangproc; /* Gang process running here */
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
@@ -109,6 +191,16 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Return the cpu with software number NUM, or NULL if there isn't one.
+ */
+struct cpu *cpu_get(unsigned num);
+
+/*
+ * Return the number of cpus.
+ */
+unsigned cpu_count(void);
+
 /*
  * Return a string describing the CPU type.
  */
@@ -162,6 +254,7 @@ void cpu_halt(void);
 #define IPI_OFFLINE		1	/* CPU is requested to go offline */
 #define IPI_UNIDLE		2	/* Runnable threads are available */
 #define IPI_TLBSHOOTDOWN	3	/* MMU mapping(s) need invalidation */
+#define IPI_GANG		4	/* A new gang slot has started */
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
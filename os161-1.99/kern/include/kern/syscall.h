@@ -196,6 +196,9 @@
 #define SYS_sync         118
 #define SYS_reboot       119
 //#define SYS___sysctl   120
+#define SYS_setweight    121
+#define SYS_setaffinity  122
+#define SYS_futex        123
 
 /*CALLEND*/
 
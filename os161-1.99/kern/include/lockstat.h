@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+/*
+ * Lock contention profiling ("lockstat").
+ *
+ * While it's on, spinlock_acquire, lock_acquire, and P record, for
+ * each lock, how many times it was taken, how many of those had to
+ * wait, the total time spent waiting, and (for spinlocks and locks)
+ * the longest time it was held. Sleep locks and semaphores are
+ * counted together by name, so for instance all vnode locks show up
+ * as one line; spinlocks have no names and are counted one by one.
+ *
+ * While it's off, the only cost on the lock paths is testing
+ * lockstat_enabled. It's turned on and off, and the results printed,
+ * with the "lockstat" menu command.
+ *
+ * Times are in microseconds.
+ */
+
+/* Kinds of lock. */
+#define LOCKSTAT_SPIN	0	/* struct spinlock, keyed by address */
+#define LOCKSTAT_LOCK	1	/* struct lock, keyed by name */
+#define LOCKSTAT_SEM	2	/* struct semaphore, keyed by name */
+
+/* Distinct locks tracked per cpu; any beyond that are dropped. */
+#define LOCKSTAT_SLOTS	256
+
+/* Longest name kept; longer ones are truncated. */
+#define LOCKSTAT_NAMELEN 20
+
+extern volatile bool lockstat_enabled;
+
+/*
+ * Hooks for the lock code, only to be called when lockstat_enabled
+ * is set. LK is the lock and NAME its name (NULL for spinlocks).
+ *
+ * lockstat_now		Current time, for WAITSTART. Never 0.
+ * lockstat_acquired	The lock was just taken; CONTENDED says whether
+ *			we had to wait for it, starting at WAITSTART.
+ *			Returns the time, to pass to lockstat_released.
+ * lockstat_released	The lock, taken at ACQTIME (0 if unknown), is
+ *			being let go.
+ */
+uint32_t lockstat_now(void);
+uint32_t lockstat_acquired(int kind, const void *lk, const char *name,
+			   bool contended, uint32_t waitstart);
+void lockstat_released(int kind, const void *lk, const char *name,
+		       uint32_t acqtime);
+
+/*
+ * Turn profiling on or off. Turning it on the first time allocates
+ * the tables, and may fail with ENOMEM.
+ */
+int lockstat_enable(bool on);
+
+/*
+ * Print the TOPN most contended locks since the last reset, then
+ * reset if RESET is true.
+ */
+void lockstat_print(unsigned topn, bool reset);
+
+
+#endif /* _LOCKSTAT_H_ */
@@ -45,6 +45,19 @@ struct vnode;
 struct semaphore;
 #endif // UW
 
+/*
+ * Proportional-share scheduling (SCHED_STRIDE; see thread.h).
+ *
+ * A process with N tickets advances its pass by STRIDE1/N for every
+ * scheduler slice its threads are charged, so over time each process
+ * gets cpu in proportion to its tickets. Passes wrap, so compare them
+ * with STRIDE_BEFORE.
+ */
+#define STRIDE1			(1U << 16)
+#define PROC_DEFAULT_TICKETS	100
+#define PROC_MAXTICKETS		10000
+#define STRIDE_BEFORE(a, b)	((int)((a) - (b)) < 0)
+
 #if OPT_A2
 #define PSIZE 1000
 struct proc* pids[PSIZE];
@@ -68,11 +81,26 @@ struct proc {
     /* VFS */
     struct vnode *p_cwd;        /* current working directory */
 
+    /* Scheduling; protected by p_lock */
+    unsigned p_tickets;         /* share of the cpu, in tickets */
+    unsigned p_stride;          /* STRIDE1 / p_tickets */
+    unsigned p_pass;            /* virtual time consumed so far */
+    unsigned p_slices;          /* scheduler slices charged, ever */
+    cpumask_t p_affinity;       /* CPUs new threads may run on */
+
+    /* Gang scheduling; protected by the gang lock in thread.c */
+    bool p_gang;                /* in gang mode */
+    struct threadlist p_gangready; /* runnable threads, in gang mode */
+
     // added by jon-bassi
 #if OPT_A2
     int p_exitcode;
     struct semaphore *sem_running;
-    struct semaphore *sem_waiting;
+    /* waitpids using us, and whether proc_destroy waits for them;
+       protected by p_lock */
+    unsigned p_waiters;
+    bool p_reaping;
+    struct semaphore *sem_nowaiters;  /* V'd by the last waitpid */
 #endif
 
 
@@ -106,7 +134,10 @@ void proc_bootstrap(void);
 /* Create a fresh process for use by runprogram(). */
 struct proc *proc_create_runprogram(const char *name);
 
-/* Destroy a process. */
+/* Create a process for kernel threads. Never destroyed. */
+struct proc *proc_create_kernel(const char *name);
+
+/* Destroy a process. Waits for an RCU grace period, so it can sleep. */
 void proc_destroy(struct proc *proc);
 
 /* Attach a thread to a process. Must not already have a process. */
@@ -115,11 +146,44 @@ int proc_addthread(struct proc *proc, struct thread *t);
 /* Detach a thread from its process. */
 void proc_remthread(struct thread *t);
 
+/* Set the number of scheduling tickets a process has. */
+int proc_setweight(struct proc *proc, unsigned tickets);
+
+/* Print configured vs. achieved cpu share of every process. */
+void proc_printshares(void);
+
+/* Restrict a process and all its threads to a set of cpus. */
+int proc_setaffinity(struct proc *proc, cpumask_t mask);
+
+/* Turn gang scheduling on or off for a process. */
+int proc_setgang(struct proc *proc, bool on);
+
+/*
+ * Look up a process by pid; NULL if there isn't one. Not refcounted:
+ * call it inside rcu_read_lock, and the process stays valid until
+ * rcu_read_unlock. (proc_destroy takes a process out of the table and
+ * waits for a grace period before freeing it.)
+ */
+struct proc *proc_lookup(pid_t pid);
+
 /* Fetch the address space of the current process. */
 struct addrspace *curproc_getas(void);
 
+/*
+ * Change the address space of a process, and return the old one.
+ * Always use this (or curproc_setas) to change p_addrspace; see
+ * curproc_activateas.
+ */
+struct addrspace *proc_setas(struct proc *, struct addrspace *);
+
 /* Change the address space of the current process, and return the old one. */
 struct addrspace *curproc_setas(struct addrspace *);
 
+/* Load the current process's address space into the MMU if it isn't already. */
+void curproc_activateas(void);
+
+/* Total address space loads done and skipped by curproc_activateas. */
+void curproc_asstats(unsigned *reloads, unsigned *elided);
+
 
 #endif /* _PROC_H_ */
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _RCU_H_
+#define _RCU_H_
+
+/*
+ * Read-copy-update.
+ *
+ * For tables that are read far more often than they're changed.
+ * Readers bracket their lookups with rcu_read_lock and
+ * rcu_read_unlock, which only bump a counter in the current thread:
+ * no locks, no atomic operations, no spl. A writer changes a pointer
+ * readers might be following (under whatever lock writers use among
+ * themselves), and must then not free the old object until every
+ * reader that might have seen it is done; call_rcu arranges for a
+ * function to be called once that's so, and synchronize_rcu waits
+ * for it.
+ *
+ * This works because readers may not sleep or yield, and aren't
+ * preempted: thread_switch puts off a timer preemption of a reader
+ * until a later tick. So once every cpu that was busy when the grace
+ * period started has switched threads, or taken a hardclock outside a
+ * reader (a "quiescent state"), nobody can still be reading the old
+ * object. Idle cpus aren't running readers and aren't waited for.
+ *
+ * Readers and writers are in program order with respect to each
+ * other on System/161, so a writer publishes an object just by
+ * storing a pointer to it once it's filled in; real hardware would
+ * need barriers there and when readers fetch the pointer.
+ *
+ * call_rcu functions are run from the timer interrupt, so they must
+ * not sleep; kfree and V are fine. They may run on any cpu.
+ */
+
+#include <current.h>
+#include <thread.h>
+
+#ifndef RCU_INLINE
+#define RCU_INLINE INLINE
+#endif
+
+/*
+ * A pending call_rcu, usually embedded in the object to be freed.
+ * Private to the RCU code.
+ */
+struct rcu_head {
+	struct rcu_head *rh_next;
+	void (*rh_func)(void *);
+	void *rh_arg;
+};
+
+/* Start and end a read-side critical section. These nest. */
+RCU_INLINE void rcu_read_lock(void);
+RCU_INLINE void rcu_read_unlock(void);
+
+/*
+ * Call FUNC(ARG) after a grace period, that is, once every read-side
+ * critical section in progress now has ended. HEAD is used to keep
+ * track of the call until then. May be called from anywhere,
+ * including inside a read-side critical section.
+ */
+void call_rcu(struct rcu_head *head, void (*func)(void *), void *arg);
+
+/*
+ * Wait for a grace period. Not from an interrupt handler or inside a
+ * read-side critical section.
+ */
+void synchronize_rcu(void);
+
+/*
+ * Hooks for the clock code. rcu_tick is called from hardclock, on
+ * every cpu, idle or not; rcu_pending says whether anything is
+ * waiting for it, so an idle cpu in tickless mode knows to keep
+ * taking ticks.
+ */
+void rcu_tick(void);
+bool rcu_pending(void);
+
+
+RCU_INLINE
+void
+rcu_read_lock(void)
+{
+	curthread->t_rcu_nesting++;
+}
+
+RCU_INLINE
+void
+rcu_read_unlock(void)
+{
+	curthread->t_rcu_nesting--;
+}
+
+
+#endif /* _RCU_H_ */
@@ -50,19 +50,32 @@
  *
  * Note that spinlocks are held by CPUs, not by threads.
  *
+ * These are ticket locks: each cpu that wants the lock takes the next
+ * number from lk_next and waits until lk_serving comes around to it,
+ * so cpus get the lock in the order they asked for it and none can be
+ * starved by the others. The machine's test-and-set word, lk_lock,
+ * only guards handing out tickets, which takes a few instructions;
+ * waiters spin just reading lk_serving, which only changes once per
+ * release.
+ *
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
  */
 struct spinlock {
-	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
+	volatile spinlock_data_t lk_lock; /* Guards taking a ticket. */
+	volatile spinlock_data_t lk_next; /* Next ticket to hand out. */
+	volatile spinlock_data_t lk_serving; /* Ticket that holds the lock. */
 	struct cpu *lk_holder;		/* CPU holding this lock. */
+	uint32_t lk_acqtime;		/* When taken, for lockstat. */
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER	\
+	{ SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER, \
+	  SPINLOCK_DATA_INITIALIZER, NULL, 0 }
 
 /*
  * Spinlock functions.
@@ -71,6 +84,9 @@ struct spinlock {
  * cleanup	Opposite of init. Lock must be unlocked.
  *
  * acquire	Get the lock, spinning as necessary. Also disables interrupts.
+ * tryacquire	Get the lock only if it is free right now. Returns true
+ *		(with interrupts disabled, as for acquire) on success and
+ *		false, leaving interrupts alone, otherwise.
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
@@ -80,6 +96,7 @@ void spinlock_init(struct spinlock *lk);
 void spinlock_cleanup(struct spinlock *lk);
 
 void spinlock_acquire(struct spinlock *lk);
+bool spinlock_tryacquire(struct spinlock *lk);
 void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
@@ -36,6 +36,7 @@
 
 
 #include <spinlock.h>
+#include <thread.h>	/* for SCHED_NLEVELS */
 #include <opt-A2.h>
 
 /*
@@ -65,6 +66,17 @@ void P(struct semaphore *);
 
 void V(struct semaphore *);
 
+/*
+ * FIFO semaphores. When set, V passes the count straight to the
+ * longest-waiting sleeper instead of waking it to compete for the
+ * count, so sleepers get through in the order they arrived and never
+ * wake up just to go back to sleep. Semaphore handoff does the same
+ * and also switches to the sleeper at once. Both are off by default;
+ * they can be changed with the "tune" menu command.
+ */
+extern unsigned sem_fifo;
+extern unsigned sem_handoff;
+
 
 /*
  * Simple lock for mutual exclusion.
@@ -82,6 +94,17 @@ struct lock {
     struct spinlock lk_lock;
     volatile int lk_value;
     struct thread* lk_curthread;
+
+    /*
+     * Priority inheritance bookkeeping, protected by the inheritance
+     * spinlock in synch.c: how many waiters there are at each
+     * priority level, and the link in the holder's t_heldlocks list.
+     */
+    unsigned lk_waiters[SCHED_NLEVELS];
+    struct lock *lk_nextheld;
+
+    /* When the holder got it, for lockstat; see lockstat.h. */
+    uint32_t lk_acqtime;
 #else
     char *lk_name;
     // add what you need here
@@ -110,6 +133,32 @@ bool lock_do_i_hold(struct lock *);
 
 void lock_destroy(struct lock *);
 
+/*
+ * Priority inheritance. When set (the default), a thread that blocks
+ * in lock_acquire lends its priority to the holder, and on down the
+ * chain if the holder is itself blocked on another lock. Can be
+ * changed with the "tune" menu command.
+ */
+extern unsigned lock_inherit_priority;
+
+/*
+ * Lock handoff. When set, lock_release gives the lock straight to the
+ * first waiter and switches to it (see thread_yield_to) rather than
+ * waking it to compete for the lock. Off by default; can be changed
+ * with the "tune" menu command.
+ */
+extern unsigned lock_handoff;
+
+/*
+ * Adaptive locking. If nonzero, lock_acquire on a held lock spins, up
+ * to this many times around, for as long as the holder is running on
+ * another cpu, and sleeps only if the holder stops running or the
+ * spins run out. Short critical sections then cost no context
+ * switches. 0 (the default) always sleeps; can be changed with the
+ * "tune" menu command.
+ */
+extern unsigned lock_spin;
+
 
 /*
  * Condition variable.
@@ -157,6 +206,169 @@ void cv_signal(struct cv *cv, struct lock *lock);
 
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
+/*
+ * Wait morphing. When set, cv_signal and cv_broadcast move waiters
+ * straight onto the lock's wait queue rather than waking them, so
+ * they wake only once the lock can be theirs. Off by default; can be
+ * changed with the "tune" menu command.
+ */
+extern unsigned cv_waitmorph;
+
+
+/*
+ * Reader-writer lock.
+ *
+ * Any number of threads may hold the lock shared (for reading), or one
+ * thread may hold it exclusive (for writing). Writers are preferred:
+ * once a writer is waiting, new readers wait behind it, so a steady
+ * stream of readers can't starve writers out. Readers must therefore
+ * not take the lock shared again while already holding it, or they
+ * can deadlock against a waiting writer.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+
+struct rwlock {
+    char *rwlk_name;
+    struct wchan *rwlk_readwchan;	/* Readers waiting */
+    struct wchan *rwlk_writewchan;	/* Writers waiting */
+    struct wchan *rwlk_upgradewchan;	/* Upgrader waiting */
+    struct spinlock rwlk_lock;		/* Protects the rest */
+    unsigned rwlk_readers;		/* Threads holding it shared */
+    unsigned rwlk_writerswaiting;	/* Threads in acquire_write */
+    struct thread *rwlk_writer;		/* Thread holding it exclusive */
+    struct thread *rwlk_upgrader;	/* Reader trying to upgrade */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock shared; wait while it's held
+ *                           exclusive or any writer is waiting.
+ *    rwlock_release_read  - Give up a shared hold.
+ *    rwlock_acquire_write - Get the lock exclusive.
+ *    rwlock_release_write - Give up an exclusive hold.
+ *    rwlock_upgrade       - Turn our shared hold into an exclusive
+ *                           one, waiting for the other readers to
+ *                           leave. Only one reader can be upgrading
+ *                           at a time, since two would each wait for
+ *                           the other; if another already is, this
+ *                           fails and returns false, and the caller
+ *                           still holds the lock shared. (It should
+ *                           then release it and use acquire_write,
+ *                           and recheck whatever it read.)
+ *    rwlock_downgrade     - Turn our exclusive hold into a shared one,
+ *                           without letting any writer in between.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                           the lock exclusive.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_upgrade(struct rwlock *);
+void rwlock_downgrade(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
+/*
+ * Latch: a one-shot countdown. It starts at some count; each
+ * latch_countdown takes one off, and once it reaches zero everybody
+ * in latch_wait (then or later) goes on. It can't be reset, so make
+ * a new one for each use.
+ *
+ * This is for waiting until N other threads have finished something,
+ * which otherwise takes a semaphore and N calls to P, and N trips
+ * through the scheduler for the waiter. Here the waiter is woken once.
+ *
+ * Operations:
+ *    latch_countdown - Take one off the count, and if that makes it
+ *                      zero, wake up the waiters. Doesn't block, so
+ *                      it can be called from an interrupt handler.
+ *                      Counting down past zero is an error.
+ *    latch_wait      - Wait until the count is zero.
+ *
+ * Don't destroy a latch until the waiters and the threads counting
+ * it down are all done with it.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct latch {
+    char *lt_name;
+    struct wchan *lt_wchan;
+    struct spinlock lt_lock;
+    volatile unsigned lt_count;
+};
+
+struct latch *latch_create(const char *name, unsigned count);
+void latch_destroy(struct latch *);
+
+void latch_countdown(struct latch *);
+void latch_wait(struct latch *);
+
+
+/*
+ * Barrier: a meeting point for a fixed number of threads. Each of
+ * them calls barrier_wait, and none goes on until all have arrived;
+ * then all are let go at once, with one wakeup each, and the barrier
+ * is ready for the next round. A generation number tells the rounds
+ * apart, so a thread that races ahead into the next round can't be
+ * mistaken for a late arrival in the last one.
+ *
+ * Operations:
+ *    barrier_wait - Wait until the other N-1 threads get here too.
+ *                   Returns true in exactly one of them (the last
+ *                   to arrive) each round, and false in the rest, in
+ *                   case something needs doing once per round.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct barrier {
+    char *bar_name;
+    struct wchan *bar_wchan;
+    struct spinlock bar_lock;
+    unsigned bar_count;			/* Threads per round */
+    unsigned bar_arrived;		/* Arrived so far this round */
+    volatile unsigned bar_generation;	/* Round number */
+};
+
+struct barrier *barrier_create(const char *name, unsigned count);
+void barrier_destroy(struct barrier *);
+
+bool barrier_wait(struct barrier *);
+
+
+/*
+ * Futexes: sleeping and waking on an int in memory, for the futex()
+ * system call (see <kern/futex.h>).
+ *
+ * An address is named by the address space it's in and its virtual
+ * address there; AS NULL means a kernel address, for use inside the
+ * kernel. Otherwise AS must be the current address space.
+ *
+ * Operations:
+ *    futex_bootstrap - Set up the futex table. Call once at boot.
+ *    futex_wait      - If the int at ADDR holds VAL, sleep until woken
+ *                      by futex_wake on the same address, and return
+ *                      0. Otherwise return EAGAIN at once. Fails with
+ *                      EINVAL if ADDR isn't int-aligned, or EFAULT if
+ *                      it can't be read.
+ *    futex_wake      - Wake up to N threads sleeping in futex_wait on
+ *                      ADDR, oldest first. Returns how many it woke.
+ *
+ * Change the int before calling futex_wake; a futex_wait that starts
+ * after that sees the new value and doesn't sleep.
+ */
+struct addrspace;
+void futex_bootstrap(void);
+int futex_wait(struct addrspace *as, vaddr_t addr, int val);
+unsigned futex_wake(struct addrspace *as, vaddr_t addr, unsigned n);
+
 
 #endif /* _SYNCH_H_ */
 
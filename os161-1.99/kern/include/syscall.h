@@ -71,6 +71,9 @@ int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
 void sys__exit(int exitcode);
 int sys_getpid(pid_t *retval);
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
+int sys_setweight(pid_t pid, unsigned tickets);
+int sys_setaffinity(pid_t pid, uint32_t mask);
+int sys_futex(userptr_t addr, int op, int val, int *retval);
 
 #endif // UW
 
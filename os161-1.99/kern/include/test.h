@@ -59,6 +59,30 @@ int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int pitest(int, char **);
+int rwtest(int, char **);
+int sembench(int, char **);
+int futextest(int, char **);
+int barriertest(int, char **);
+
+/*
+ * Helpers for the thread tests and scheduler benchmarks: microseconds
+ * from SECS1.NSECS1 to SECS2.NSECS2, or to now; and a busy loop of N
+ * iterations, to stand in for work.
+ */
+uint32_t usecs_between(time_t secs1, uint32_t nsecs1,
+		       time_t secs2, uint32_t nsecs2);
+uint32_t usecs_since(time_t secs, uint32_t nsecs);
+void busy_loop(unsigned n);
+
+/* scheduler benchmarks */
+int schedlatency(int, char **);
+int edftest(int, char **);
+int forkbench(int, char **);
+int gangbench(int, char **);
+int lockbench(int, char **);
+int spinbench(int, char **);
+int cvbench(int, char **);
 
 #ifdef UW
 /* Another thread and synchronization test */
@@ -42,6 +42,7 @@
 #include "opt-A2.h"
 
 struct cpu;
+struct lock;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -50,6 +51,9 @@ struct cpu;
 /* Size of kernel stacks; must be power of 2 */
 #define STACK_SIZE 4096
 
+/* Thread names shorter than this don't need to be allocated */
+#define THREAD_NAMEBUF 16
+
 /* Mask for extracting the stack base address of a kernel stack pointer */
 #define STACK_MASK  (~(vaddr_t)(STACK_SIZE-1))
 
@@ -57,6 +61,96 @@ struct cpu;
 #define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
 
 
+/*
+ * Scheduling policies. The policy can be changed at runtime with the
+ * "sched" menu command.
+ *
+ * SCHED_RR is plain round-robin off each cpu's run queue.
+ *
+ * SCHED_MLFQ is a multi-level feedback queue: each run queue is kept
+ * sorted by t_priority (0 is the most urgent level) and is FIFO
+ * within a level. Threads start at the top level, are demoted when
+ * they use up their allotment at a level, move up a level when they
+ * sleep on a wait channel, and are periodically reset to the top
+ * level so nothing starves.
+ *
+ * SCHED_STRIDE is proportional-share (stride) scheduling between
+ * processes: each process has a number of tickets (see proc.h), and
+ * each cpu runs the thread whose process has the lowest pass, that
+ * is, has had the least cpu time for its tickets. Passes are global,
+ * so shares hold across all cpus, not just within one run queue.
+ */
+#define SCHED_RR	0
+#define SCHED_MLFQ	1
+#define SCHED_STRIDE	2
+#define SCHED_NPOLICIES	3
+
+/* Number of MLFQ levels, and the top (most urgent) and bottom ones. */
+#define SCHED_NLEVELS	4
+#define SCHED_TOPPRI	0
+#define SCHED_BOTPRI	(SCHED_NLEVELS-1)
+
+/* Current scheduling policy, and the names of all policies. */
+extern int sched_policy;
+extern const char *const sched_policynames[SCHED_NPOLICIES];
+
+/* Effective priority of a thread, counting anything donated to it. */
+#define THREAD_PRIORITY(t) \
+	((t)->t_inherited < (t)->t_priority ? \
+	 (t)->t_inherited : (t)->t_priority)
+
+/*
+ * Migration tuning knobs; see thread_consider_migration. These can be
+ * changed with the "tune" menu command.
+ *
+ * Run lengths and migration costs are kept in 1/RUNAVG_SCALE
+ * hardclocks.
+ */
+#define RUNAVG_SCALE	16
+extern unsigned sched_migrate_coldticks;
+extern unsigned sched_migrate_maxcost;
+
+/*
+ * Load tracking, which migration balances on. A load is an
+ * exponentially decayed average of a number of runnable threads (for
+ * a thread, of whether it was runnable), in 1/LOAD_SCALE threads, with
+ * a half-life of LOAD_HALFLIFE hardclocks.
+ */
+#define LOAD_SCALE	1024
+#define LOAD_HALFLIFE	32
+
+/*
+ * Most dead threads (with their stacks) each cpu keeps for reuse by
+ * thread_fork. 0 turns the cache off. Can be changed with "tune".
+ */
+extern unsigned thread_cache_max;
+
+/*
+ * Whether to time run queue waits and idle periods for the scheduler
+ * statistics (see thread_printstats). Costs two gettime() calls per
+ * wakeup. Can be changed with "tune".
+ */
+extern unsigned schedstat_timing;
+
+/*
+ * Gang scheduling; see thread_setgang. At most GANG_MAXPROCS
+ * processes can be in gang mode at once. Each gets a slot of
+ * sched_gang_slice hardclocks in turn, and then everyone else gets
+ * one. The slot length can be changed with "tune".
+ */
+#define GANG_MAXPROCS	8
+extern unsigned sched_gang_slice;
+
+/*
+ * CPU affinity: a set of cpus, by software number, that a thread may
+ * run on. There can't be more cpus than bits; cpu_create checks.
+ */
+typedef uint32_t cpumask_t;
+#define CPUMASK_BITS		32
+#define CPUMASK_ALL		(~(cpumask_t)0)
+#define CPUMASK_BIT(n)		((cpumask_t)1 << (n))
+#define CPUMASK_HAS(m, n)	(((m) & CPUMASK_BIT(n)) != 0)
+
 /* States a thread can be in. */
 typedef enum {
 	S_RUN,		/* running */
@@ -80,10 +174,73 @@ struct thread {
 	 */
 	struct thread_machdep t_machdep; /* Any machine-dependent goo */
 	struct threadlistnode t_listnode; /* Link for run/sleep/zombie lists */
+	unsigned t_runlevel;		/* Run queue level, while queued */
 	void *t_stack;			/* Kernel-level stack */
+	char t_namebuf[THREAD_NAMEBUF];	/* Storage for a short t_name */
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	cpumask_t t_affinity;		/* CPUs thread may run on */
+
+	/*
+	 * Scheduler fields. Protected by the run queue lock of t_cpu
+	 * while the thread is on a run queue; otherwise only touched
+	 * by the thread itself (or its cpu's timer interrupt).
+	 */
+	int t_priority;			/* MLFQ level; 0 is most urgent */
+	unsigned t_slices;		/* Slices charged at this level */
+
+	/*
+	 * Priority inheritance; see synch.c. Protected by the
+	 * inheritance spinlock there. t_inherited is SCHED_NLEVELS if
+	 * nothing has been donated.
+	 */
+	int t_inherited;		/* Best priority donated to us */
+	int t_waitpri;			/* Priority we're counted at in t_blockedon */
+	struct lock *t_blockedon;	/* Lock we're waiting for, if any */
+	struct lock *t_heldlocks;	/* Locks we hold (via lk_nextheld) */
+
+	/*
+	 * Set, under the object's own spinlock, by whoever hands this
+	 * thread something directly while it sleeps (see V), so it can
+	 * tell when it wakes up.
+	 */
+	void *t_handoff;		/* Object handed to us, if any */
+
+	/* RCU read-side critical sections we're in; see rcu.h. */
+	unsigned t_rcu_nesting;
+
+	/*
+	 * Run history, for migration decisions. Hardclock counts are
+	 * those of t_lastcpu; they're only compared with each other.
+	 */
+	struct cpu *t_lastcpu;		/* CPU thread last ran on */
+	unsigned t_runstart;		/* Hardclock it last started running */
+	unsigned t_lastran;		/* Hardclock it last stopped running */
+	unsigned t_runavg;		/* Decayed average run length */
+
+	/*
+	 * Load tracking; see thread_load. t_loadstamp counts hardclocks
+	 * of t_loadcpu, which needn't be t_cpu.
+	 */
+	unsigned t_load;		/* Load as of t_loadstamp */
+	struct cpu *t_loadcpu;		/* Cpu whose clock t_loadstamp is */
+	unsigned t_loadstamp;		/* When t_load was brought up to date */
+	uint64_t t_readytime;		/* Microsecond it became runnable */
+
+	/*
+	 * EDF class; see thread_fork_edf. t_edf_period is 0 for
+	 * ordinary threads. Times are hardclocks of t_cpu, which never
+	 * changes for an EDF thread. Protected like the scheduler
+	 * fields.
+	 */
+	unsigned t_edf_period;		/* Length of each period */
+	unsigned t_edf_budget;		/* Cpu allowed per period */
+	unsigned t_edf_release;		/* Start of the current period */
+	unsigned t_edf_deadline;	/* End of the current period */
+	unsigned t_edf_used;		/* Cpu used so far this period */
+	bool t_edf_done;		/* Job for this period finished */
+	unsigned t_edf_misses;		/* Periods that ended unfinished */
 
 	/*
 	 * Interrupt state fields.
@@ -148,6 +305,69 @@ int thread_fork(const char *name, struct proc *proc,
                 void (*func)(void *, unsigned long),
                 void *data1, unsigned long data2);
 
+/*
+ * Like thread_fork, but the new thread may only run on the cpus in
+ * MASK instead of those its process allows, and starts on one of
+ * them. Use this rather than having the new thread call
+ * thread_setaffinity on itself when it matters where it runs from
+ * the start: a running thread can't move until its cpu has something
+ * else to run. Fails with EINVAL if MASK contains no cpu that exists.
+ */
+int thread_fork_affinity(const char *name, struct proc *proc,
+                         cpumask_t mask,
+                         void (*func)(void *, unsigned long),
+                         void *data1, unsigned long data2);
+
+/*
+ * Like thread_fork, but the new thread is in the earliest-deadline-
+ * first class: every PERIOD hardclocks it is entitled to BUDGET
+ * hardclocks of cpu, ahead of every ordinary thread, by the end of
+ * the period. It should do one period's work and then call
+ * thread_edf_wait(), in a loop.
+ *
+ * EDF threads are bound to one cpu, chosen when they're created. If
+ * no cpu has BUDGET/PERIOD of its capacity left unreserved by other
+ * EDF threads, fails with EBUSY.
+ */
+int thread_fork_edf(const char *name, struct proc *proc,
+                    unsigned period, unsigned budget,
+                    void (*func)(void *, unsigned long),
+                    void *data1, unsigned long data2);
+
+/*
+ * Called by an EDF thread when it has finished its work for the
+ * current period; sleeps until the next one starts.
+ */
+void thread_edf_wait(void);
+
+/*
+ * Restrict a thread to the cpus in MASK. It moves off a cpu it's no
+ * longer allowed on the next time that cpu considers migration, or
+ * when an allowed cpu steals it, either of which needs it to be
+ * waiting on a run queue; so this doesn't move the calling thread
+ * right away (see thread_fork_affinity). Fails with EINVAL if MASK contains
+ * no cpu that exists. EDF threads stay on the cpu they were admitted
+ * to.
+ */
+int thread_setaffinity(struct thread *t, cpumask_t mask);
+
+/* Check that MASK contains at least one cpu; EINVAL if not. */
+int thread_checkaffinity(cpumask_t mask);
+
+/*
+ * Check whether T is running on some cpu right now. This is a peek
+ * without locking, so it's only a hint; T is only compared against,
+ * never dereferenced, so it may be a thread that has since exited.
+ */
+bool thread_oncpu(const struct thread *t);
+
+/*
+ * Put a process in gang mode, so that its runnable threads are run
+ * all at the same time, or take it out. Fails with EBUSY if
+ * GANG_MAXPROCS processes are in gang mode already.
+ */
+int thread_setgang(struct proc *proc, bool on);
+
 /*
  * Cause the current thread to exit.
  * Interrupts need not be disabled.
@@ -161,16 +381,71 @@ void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Cause the current thread to yield to TARGET, which runs next on
+ * this cpu; the current thread stays runnable. TARGET must not be on
+ * any run queue: normally it was just taken off a wait channel with
+ * wchan_takeone. If it can't run here or we can't switch right now,
+ * it's made runnable the ordinary way instead.
+ */
+void thread_yield_to(struct thread *target);
+
+/*
+ * Wake up TARGET, which was taken off a wait channel with
+ * wchan_takeone, without switching to it.
+ */
+void thread_wakeup(struct thread *target);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
+/*
+ * Charge the current thread's EDF budget, if it has one. Returns true
+ * if the current thread should be preempted for an EDF thread. Called
+ * from the timer interrupt.
+ */
+bool thread_edf_tick(void);
+
+/*
+ * Advance the gang slots, on cpu 0. Returns true if the current
+ * thread should give way to a gang (or another gang thread). Called
+ * from the timer interrupt on every cpu, idle or not.
+ */
+bool thread_gang_tick(void);
+
+/* True if any process is in gang mode. */
+bool thread_gang_active(void);
+
+/*
+ * Bring the current cpu's load up to date for NCLOCKS hardclocks
+ * (more than one if the timer skipped some), during which the number
+ * of threads runnable here didn't change. Called from the timer
+ * interrupt.
+ */
+void thread_load_tick(unsigned nclocks);
+
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
  * timer interrupt.
  */
 void thread_consider_migration(void);
 
+/* Print the load of each cpu and of the threads running on them. */
+void thread_printload(void);
+
+/*
+ * Move a thread that may be on a run queue to the right place for its
+ * current effective priority. Used by priority inheritance.
+ */
+void thread_reposition(struct thread *t);
+
+/*
+ * Print the per-cpu scheduler statistics accumulated since the last
+ * reset, and if RESET is true start a new interval.
+ */
+void thread_printstats(bool reset);
+
 
 #endif /* _THREAD_H_ */
@@ -97,5 +97,59 @@ void threadlist_remove(struct threadlist *tl, struct thread *t);
 	     (itervar)->t_listnode.tln_prev != NULL; \
 	     (itervar) = (itervar)->t_listnode.tln_prev->tln_self)
 
+/*
+ * Multilevel run queue: a threadlist for each priority level, 0 being
+ * the best, plus a bitmap of the levels that aren't empty. Adding a
+ * thread, taking the best one, and stepping from one level to the
+ * next are all constant time, however many threads are waiting. With
+ * only level 0 in use it's a plain FIFO.
+ *
+ * The level a queued thread is on is kept in its t_runlevel, which is
+ * only meaningful while it's on a run queue.
+ */
+
+#define RUNQUEUE_LEVELS 32	/* One per bit of rq_nonempty */
+
+struct runqueue {
+	struct threadlist rq_levels[RUNQUEUE_LEVELS];
+	uint32_t rq_nonempty;	/* Bit N set if rq_levels[N] isn't empty */
+	unsigned rq_count;	/* Threads on all levels */
+};
+
+/* Initialize and clean up a run queue. Must be empty at cleanup. */
+void runqueue_init(struct runqueue *rq);
+void runqueue_cleanup(struct runqueue *rq);
+
+/* Check if it's empty */
+bool runqueue_isempty(struct runqueue *rq);
+
+/* Add at the tail of a level; take the head of the best level. */
+void runqueue_add(struct runqueue *rq, struct thread *t, unsigned level);
+struct thread *runqueue_remhead(struct runqueue *rq);
+
+/* Remove from anywhere. */
+void runqueue_remove(struct runqueue *rq, struct thread *t);
+
+/*
+ * Walking, best level first and in FIFO order within a level (or the
+ * reverse). These return NULL at the end. It's safe to remove the
+ * current thread once the next one has been fetched.
+ */
+struct thread *runqueue_first(struct runqueue *rq);
+struct thread *runqueue_last(struct runqueue *rq);
+struct thread *runqueue_next(struct runqueue *rq, struct thread *t);
+struct thread *runqueue_prev(struct runqueue *rq, struct thread *t);
+
+/* Iteration; itervar should previously be declared as (struct thread *) */
+#define RUNQUEUE_FORALL(itervar, rq) \
+	for ((itervar) = runqueue_first(&(rq)); \
+	     (itervar) != NULL; \
+	     (itervar) = runqueue_next(&(rq), (itervar)))
+
+#define RUNQUEUE_FORALL_REV(itervar, rq) \
+	for ((itervar) = runqueue_last(&(rq)); \
+	     (itervar) != NULL; \
+	     (itervar) = runqueue_prev(&(rq), (itervar)))
+
 
 #endif /* _THREADLIST_H_ */
@@ -36,6 +36,7 @@
 
 
 struct wchan; /* Opaque */
+struct thread; /* from <thread.h> */
 
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
@@ -81,5 +82,27 @@ void wchan_sleep(struct wchan *wc);
 void wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
 
+/*
+ * Wake up TARGET, which must be sleeping on WC, or be committed to:
+ * it must have locked WC to go to sleep on it. The queue should not
+ * already be locked.
+ */
+void wchan_wakethread(struct wchan *wc, struct thread *target);
+
+/*
+ * Take the first thread off a wait channel without waking it, so as
+ * to hand something to it directly. The caller must then pass it to
+ * thread_yield_to or thread_wakeup, which wake it. The queue should
+ * not already be locked. Returns NULL if nobody is sleeping.
+ */
+struct thread *wchan_takeone(struct wchan *wc);
+
+/*
+ * Put a thread taken off a wait channel with wchan_takeone onto WC
+ * instead, without waking it; it then sleeps on WC as if it had gone
+ * to sleep there. The queue should not already be locked.
+ */
+void wchan_enqueue(struct wchan *wc, struct thread *target);
+
 
 #endif /* _WCHAN_H_ */
@@ -43,12 +43,16 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <spl.h>
+#include <cpu.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
 #include <vnode.h>
 #include <vfs.h>
 #include <synch.h>
+#include <rcu.h>
 #include <kern/fcntl.h>  
 #include "opt-A2.h"
 
@@ -57,6 +61,13 @@
  */
 struct proc *kproc;
 
+/*
+ * Bumped every time any process's address space is changed (always
+ * through proc_setas); see curproc_activateas.
+ */
+static volatile unsigned as_generation;
+static struct spinlock as_genlock = SPINLOCK_INITIALIZER;
+
 /*
  * Mechanism for making the kernel menu thread sleep while processes are running
  */
@@ -113,7 +124,9 @@ proc_create(const char *name)
 	// added by jon-bassi
 #if OPT_A2
 	proc->sem_running = sem_create("sem_running", 1);
-	proc->sem_waiting = sem_create("sem_waiting processes", 0);
+	proc->p_waiters = 0;
+	proc->p_reaping = false;
+	proc->sem_nowaiters = sem_create("sem_nowaiters", 0);
 #endif
 
 	/* VM fields */
@@ -122,6 +135,15 @@ proc_create(const char *name)
 	/* VFS fields */
 	proc->p_cwd = NULL;
 
+	/* Scheduling fields */
+	proc->p_tickets = PROC_DEFAULT_TICKETS;
+	proc->p_stride = STRIDE1 / PROC_DEFAULT_TICKETS;
+	proc->p_pass = 0;
+	proc->p_slices = 0;
+	proc->p_affinity = CPUMASK_ALL;
+	proc->p_gang = false;
+	threadlist_init(&proc->p_gangready);
+
 #ifdef UW
 	proc->console = NULL;
 #endif // UW
@@ -138,6 +160,10 @@ proc_create(const char *name)
 void
 proc_destroy(struct proc *proc)
 {
+#if OPT_A2
+	bool waiters;
+#endif
+
 	/*
          * note: some parts of the process structure, such as the address space,
          *  are destroyed in sys_exit, before we get here
@@ -150,9 +176,34 @@ proc_destroy(struct proc *proc)
 	KASSERT(proc != NULL);
 	KASSERT(proc != kproc);
 
+#if OPT_A2
+	/*
+	 * Leave the process table (unless addProc has already given our
+	 * slot to someone else), and wait out a grace period, so that
+	 * no proc_lookup can still be looking at us; see proc.h. Every
+	 * waitpid that found us has counted itself in p_waiters by then,
+	 * inside its RCU reader, so then sleep until the last of those
+	 * is done.
+	 */
+	if (pids[proc->pid] == proc) {
+		pids[proc->pid] = NULL;
+	}
+	synchronize_rcu();
+	spinlock_acquire(&proc->p_lock);
+	proc->p_reaping = true;
+	waiters = proc->p_waiters > 0;
+	spinlock_release(&proc->p_lock);
+	if (waiters) {
+		P(proc->sem_nowaiters);
+	}
+#endif
+
+	/* Take it out of the gang scheduler's table. */
+	thread_setgang(proc, false);
+
 #if OPT_A2
 	sem_destroy(proc->sem_running);
-	sem_destroy(proc->sem_waiting);
+	sem_destroy(proc->sem_nowaiters);
 #endif
 
 	/*
@@ -183,7 +234,7 @@ proc_destroy(struct proc *proc)
 		struct addrspace *as;
 
 		as_deactivate();
-		as = curproc_setas(NULL);
+		as = proc_setas(proc, NULL);
 		as_destroy(as);
 	}
 #endif // UW
@@ -195,6 +246,7 @@ proc_destroy(struct proc *proc)
 #endif // UW
 
 	threadarray_cleanup(&proc->p_threads);
+	threadlist_cleanup(&proc->p_gangready);
 	spinlock_cleanup(&proc->p_lock);
 
 	kfree(proc->p_name);
@@ -293,6 +345,18 @@ proc_create_runprogram(const char *name)
 	spinlock_release(&curproc->p_lock);
 #endif // UW
 
+	/*
+	 * Scheduling fields: inherit the creator's tickets and cpu
+	 * affinity, and start at its pass so the new process neither
+	 * owes time nor has any banked.
+	 */
+	spinlock_acquire(&curproc->p_lock);
+	proc->p_tickets = curproc->p_tickets;
+	proc->p_stride = curproc->p_stride;
+	proc->p_pass = curproc->p_pass;
+	proc->p_affinity = curproc->p_affinity;
+	spinlock_release(&curproc->p_lock);
+
 #ifdef UW
 	/* increment the count of processes */
         /* we are assuming that all procs, including those created by fork(),
@@ -305,6 +369,21 @@ proc_create_runprogram(const char *name)
 	return proc;
 }
 
+/*
+ * Create a process for kernel threads that need scheduling apart from
+ * kproc's, such as test threads run in gang mode.
+ *
+ * It has no address space and no current directory. Unlike a
+ * runprogram process it isn't counted in proc_count, so the menu
+ * doesn't wait for it; for the same reason it must never be passed
+ * to proc_destroy. Create one and keep reusing it.
+ */
+struct proc *
+proc_create_kernel(const char *name)
+{
+	return proc_create(name);
+}
+
 /*
  * Add a thread to a process. Either the thread or the process might
  * or might not be current.
@@ -355,6 +434,152 @@ proc_remthread(struct thread *t)
 	panic("Thread (%p) has escaped from its process (%p)\n", t, proc);
 }
 
+/*
+ * Set the number of scheduling tickets a process has.
+ */
+int
+proc_setweight(struct proc *proc, unsigned tickets)
+{
+	if (tickets < 1 || tickets > PROC_MAXTICKETS) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&proc->p_lock);
+	proc->p_tickets = tickets;
+	proc->p_stride = STRIDE1 / tickets;
+	spinlock_release(&proc->p_lock);
+	return 0;
+}
+
+/*
+ * Restrict a process to the cpus in MASK. This applies to the threads
+ * it has now as well as any it creates later; see thread_setaffinity.
+ */
+int
+proc_setaffinity(struct proc *proc, cpumask_t mask)
+{
+	unsigned i, num;
+	int result;
+
+	result = thread_checkaffinity(mask);
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&proc->p_lock);
+	num = threadarray_num(&proc->p_threads);
+	for (i=0; i<num; i++) {
+		thread_setaffinity(threadarray_get(&proc->p_threads, i),
+				   mask);
+	}
+	proc->p_affinity = mask;
+	spinlock_release(&proc->p_lock);
+	return 0;
+}
+
+/*
+ * Put a process in gang mode or take it out; see thread_setgang. The
+ * kernel process can't be, or the menu and everything else in the
+ * kernel would wait for the gang slot.
+ */
+int
+proc_setgang(struct proc *proc, bool on)
+{
+	if (proc == kproc) {
+		return EINVAL;
+	}
+	return thread_setgang(proc, on);
+}
+
+#if OPT_A2
+#define PROC_NSLOTS	PSIZE
+#define PROC_SLOT(i)	(pids[i])
+#else
+#define PROC_NSLOTS	1
+#define PROC_SLOT(i)	(kproc)
+#endif
+
+/*
+ * Look up a process by pid.
+ */
+struct proc *
+proc_lookup(pid_t pid)
+{
+	if (pid < 0 || pid >= PROC_NSLOTS) {
+		return NULL;
+	}
+	return PROC_SLOT(pid);
+}
+
+/* One line of proc_printshares. */
+struct proc_share {
+	unsigned ps_slot;
+	char ps_name[17];
+	unsigned ps_tickets;
+	unsigned ps_slices;
+};
+
+/*
+ * Print, for every process, the share of the cpu it is configured for
+ * (its tickets as a fraction of everyone's tickets) next to the share
+ * it has actually had (its slices as a fraction of everyone's
+ * slices). Processes that have already exited aren't counted. The
+ * numbers are taken from each process without its lock, so they
+ * needn't add up exactly; this is only a debugging aid.
+ *
+ * The table is copied out inside an RCU reader, so that no process
+ * can be freed while we look at it, and printed afterward, because
+ * kprintf can sleep and readers mustn't.
+ */
+void
+proc_printshares(void)
+{
+	struct proc_share *shares;
+	struct proc *p;
+	unsigned i, n, tottickets, totslices;
+
+	shares = kmalloc(PROC_NSLOTS * sizeof(*shares));
+	if (shares == NULL) {
+		kprintf("proc_printshares: Out of memory\n");
+		return;
+	}
+
+	n = 0;
+	tottickets = totslices = 0;
+	rcu_read_lock();
+	for (i=0; i<PROC_NSLOTS; i++) {
+		p = PROC_SLOT(i);
+		if (p == NULL) {
+			continue;
+		}
+		shares[n].ps_slot = i;
+		snprintf(shares[n].ps_name, sizeof(shares[n].ps_name), "%s",
+			 p->p_name);
+		shares[n].ps_tickets = p->p_tickets;
+		shares[n].ps_slices = p->p_slices;
+		tottickets += shares[n].ps_tickets;
+		totslices += shares[n].ps_slices;
+		n++;
+	}
+	rcu_read_unlock();
+
+	if (tottickets == 0) {
+		kfree(shares);
+		return;
+	}
+
+	kprintf("%5s %-16s %7s %6s %8s %6s\n", "slot", "name",
+		"tickets", "want%", "slices", "got%");
+	for (i=0; i<n; i++) {
+		kprintf("%5u %-16s %7u %6u %8u %6u\n", shares[i].ps_slot,
+			shares[i].ps_name, shares[i].ps_tickets,
+			shares[i].ps_tickets * 100 / tottickets,
+			shares[i].ps_slices,
+			totslices ? shares[i].ps_slices * 100 / totslices : 0);
+	}
+	kfree(shares);
+}
+
 /*
  * Fetch the address space of the current process. Caution: it isn't
  * refcounted. If you implement multithreaded processes, make sure to
@@ -380,19 +605,88 @@ curproc_getas(void)
 }
 
 /*
- * Change the address space of the current process, and return the old
- * one.
+ * Change the address space of a process, and return the old one.
+ *
+ * This is the only place p_addrspace changes once a process is set
+ * up, so that as_generation moves whenever it does; see
+ * curproc_activateas.
  */
 struct addrspace *
-curproc_setas(struct addrspace *newas)
+proc_setas(struct proc *proc, struct addrspace *newas)
 {
 	struct addrspace *oldas;
-	struct proc *proc = curproc;
 
 	spinlock_acquire(&proc->p_lock);
 	oldas = proc->p_addrspace;
 	proc->p_addrspace = newas;
 	spinlock_release(&proc->p_lock);
+
+	spinlock_acquire(&as_genlock);
+	as_generation++;
+	spinlock_release(&as_genlock);
+
 	return oldas;
 }
 
+/*
+ * Change the address space of the current process, and return the old
+ * one.
+ */
+struct addrspace *
+curproc_setas(struct addrspace *newas)
+{
+	return proc_setas(curproc, newas);
+}
+
+/*
+ * Activate the current process's address space in the MMU, unless
+ * it's the one this cpu last loaded. as_activate flushes the whole
+ * TLB, so this saves a lot when switching between kernel threads,
+ * which have no address space (and don't disturb the user mappings
+ * in the TLB), or between threads of the same process.
+ *
+ * A pointer match alone isn't enough, because an address space can be
+ * destroyed and a new one allocated at the same address. A new one
+ * can't be used, though, until proc_setas installs it in some process,
+ * which bumps as_generation; so if that hasn't moved either, it's the
+ * same one.
+ */
+void
+curproc_activateas(void)
+{
+	struct addrspace *as;
+	unsigned gen;
+	int spl;
+
+	spl = splhigh();
+	gen = as_generation;
+	as = curproc_getas();
+	if (as == NULL ||
+	    (as == curcpu->c_lastas && gen == curcpu->c_lastasgen)) {
+		curcpu->c_aselided++;
+	}
+	else {
+		as_activate();
+		curcpu->c_lastas = as;
+		curcpu->c_lastasgen = gen;
+		curcpu->c_asreloads++;
+	}
+	splx(spl);
+}
+
+/*
+ * Add up the curproc_activateas counters of all cpus.
+ */
+void
+curproc_asstats(unsigned *reloads, unsigned *elided)
+{
+	struct cpu *c;
+	unsigned i;
+
+	*reloads = *elided = 0;
+	for (i=0; (c = cpu_get(i)) != NULL; i++) {
+		*reloads += c->c_asreloads;
+		*elided += c->c_aselided;
+	}
+}
+
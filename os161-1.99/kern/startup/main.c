@@ -110,6 +110,7 @@ boot(void)
 	proc_bootstrap();
 	thread_bootstrap();
 	hardclock_bootstrap();
+	futex_bootstrap();
 	vfs_bootstrap();
 
 	/* Probe and initialize devices. Interrupts should come on. */
@@ -38,6 +38,8 @@
 #include <thread.h>
 #include <proc.h>
 #include <synch.h>
+#include <lockstat.h>
+#include <rcu.h>
 #include <vfs.h>
 #include <sfs.h>
 #include <syscall.h>
@@ -121,6 +123,9 @@ cmd_progthread(void *ptr, unsigned long nargs)
 /*
  * Common code for cmd_prog and cmd_shell.
  *
+ * TICKETS and AFFINITY, if not 0, replace the scheduling tickets and
+ * cpu mask the new process would otherwise inherit from us.
+ *
  * Note that this does not wait for the subprogram to finish, but
  * returns immediately to the menu. This is usually not what you want,
  * so you should have it call your system-calls-assignment waitpid
@@ -132,7 +137,7 @@ cmd_progthread(void *ptr, unsigned long nargs)
  */
 static
 int
-common_prog(int nargs, char **args)
+common_prog(int nargs, char **args, unsigned tickets, cpumask_t affinity)
 {
 	struct proc *proc;
 	int result;
@@ -147,6 +152,20 @@ common_prog(int nargs, char **args)
 	if (proc == NULL) {
 		return ENOMEM;
 	}
+	if (tickets != 0) {
+		result = proc_setweight(proc, tickets);
+		if (result) {
+			proc_destroy(proc);
+			return result;
+		}
+	}
+	if (affinity != 0) {
+		result = proc_setaffinity(proc, affinity);
+		if (result) {
+			proc_destroy(proc);
+			return result;
+		}
+	}
 
 	result = thread_fork(args[0] /* thread name */,
 			proc /* new process */,
@@ -167,15 +186,83 @@ common_prog(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Parse a list of cpu numbers like "0,2,3" into a cpu mask.
+ */
+static
+int
+parse_cpulist(const char *str, cpumask_t *ret)
+{
+	cpumask_t mask = 0;
+	unsigned num;
+
+	while (*str != 0) {
+		if (*str < '0' || *str > '9') {
+			return EINVAL;
+		}
+		num = 0;
+		while (*str >= '0' && *str <= '9') {
+			num = num*10 + (*str - '0');
+			str++;
+		}
+		if (num >= CPUMASK_BITS) {
+			return EINVAL;
+		}
+		mask |= CPUMASK_BIT(num);
+		if (*str == ',') {
+			str++;
+		}
+		else if (*str != 0) {
+			return EINVAL;
+		}
+	}
+	if (mask == 0) {
+		return EINVAL;
+	}
+	*ret = mask;
+	return 0;
+}
+
 /*
  * Command for running an arbitrary userlevel program.
+ *
+ * With -w, the program's process gets that many scheduling tickets
+ * instead of inheriting the kernel's; see proc.h. With -c, it only
+ * runs on the cpus listed, instead of the ones the kernel is pinned
+ * to.
  */
 static
 int
 cmd_prog(int nargs, char **args)
 {
+	unsigned tickets = 0;
+	cpumask_t affinity = 0;
+
+	while (nargs >= 4 && args[1][0] == '-') {
+		if (!strcmp(args[1], "-w")) {
+			tickets = atoi(args[2]);
+			if (tickets < 1 || tickets > PROC_MAXTICKETS) {
+				kprintf("p: tickets must be between 1 "
+					"and %u\n", PROC_MAXTICKETS);
+				return EINVAL;
+			}
+		}
+		else if (!strcmp(args[1], "-c")) {
+			if (parse_cpulist(args[2], &affinity)) {
+				kprintf("p: bad cpu list %s\n", args[2]);
+				return EINVAL;
+			}
+		}
+		else {
+			break;
+		}
+		/* drop the option and its value */
+		args += 2;
+		nargs -= 2;
+	}
 	if (nargs < 2) {
-		kprintf("Usage: p program [arguments]\n");
+		kprintf("Usage: p [-w tickets] [-c cpu,...] "
+			"program [arguments]\n");
 		return EINVAL;
 	}
 
@@ -183,7 +270,7 @@ cmd_prog(int nargs, char **args)
 	args++;
 	nargs--;
 
-	return common_prog(nargs, args);
+	return common_prog(nargs, args, tickets, affinity);
 }
 
 /*
@@ -201,7 +288,7 @@ cmd_shell(int nargs, char **args)
 
 	args[0] = (char *)_PATH_SHELL;
 
-	return common_prog(nargs, args);
+	return common_prog(nargs, args, 0, 0);
 }
 
 /*
@@ -392,6 +479,295 @@ cmd_bootfs(int nargs, char **args)
 	return vfs_setbootfs(device);
 }
 
+/*
+ * Command for showing or changing the scheduling policy.
+ */
+static
+int
+cmd_sched(int nargs, char **args)
+{
+	int i;
+
+	i = 0;
+	if (nargs == 2) {
+		for (i=0; i<SCHED_NPOLICIES; i++) {
+			if (!strcmp(args[1], sched_policynames[i])) {
+				sched_policy = i;
+				break;
+			}
+		}
+	}
+	if (nargs > 2 || i == SCHED_NPOLICIES) {
+		kprintf("Usage: sched [rr|mlfq|stride]\n");
+		return EINVAL;
+	}
+
+	kprintf("Scheduling policy: %s\n", sched_policynames[sched_policy]);
+	return 0;
+}
+
+/*
+ * Command for restricting a process to a set of cpus. Pinning pid 0,
+ * the kernel, also pins the threads the kernel tests create.
+ */
+static
+int
+cmd_pin(int nargs, char **args)
+{
+	struct proc *proc;
+	cpumask_t mask;
+	int result;
+
+	if (nargs != 3) {
+		kprintf("Usage: pin pid cpu,...\n");
+		return EINVAL;
+	}
+	if (parse_cpulist(args[2], &mask)) {
+		kprintf("pin: bad cpu list %s\n", args[2]);
+		return EINVAL;
+	}
+
+	rcu_read_lock();
+	proc = proc_lookup(atoi(args[1]));
+	result = proc == NULL ? ESRCH : proc_setaffinity(proc, mask);
+	rcu_read_unlock();
+	if (result == ESRCH) {
+		kprintf("pin: no such process %s\n", args[1]);
+		return ESRCH;
+	}
+	if (result) {
+		kprintf("pin: %s\n", strerror(result));
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * Command for turning gang scheduling on or off for a process.
+ */
+static
+int
+cmd_gang(int nargs, char **args)
+{
+	struct proc *proc;
+	int result;
+
+	if (nargs != 3 || (strcmp(args[2], "on") && strcmp(args[2], "off"))) {
+		kprintf("Usage: gang pid on|off\n");
+		return EINVAL;
+	}
+	rcu_read_lock();
+	proc = proc_lookup(atoi(args[1]));
+	result = proc == NULL ? ESRCH :
+		proc_setgang(proc, !strcmp(args[2], "on"));
+	rcu_read_unlock();
+	if (result == ESRCH) {
+		kprintf("gang: no such process %s\n", args[1]);
+		return ESRCH;
+	}
+	if (result) {
+		kprintf("gang: %s\n", strerror(result));
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * Command for showing the load of each cpu, optionally COUNT times a
+ * second apart to watch migration even it out.
+ */
+static
+int
+cmd_load(int nargs, char **args)
+{
+	int i, count = 1;
+
+	if (nargs == 2) {
+		count = atoi(args[1]);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: load [count]\n");
+		return EINVAL;
+	}
+
+	for (i=0; i<count; i++) {
+		if (i > 0) {
+			clocksleep(1);
+			kprintf("\n");
+		}
+		thread_printload();
+	}
+	return 0;
+}
+
+/*
+ * Command for showing per-cpu hardclock counts.
+ */
+static
+int
+cmd_clocks(int nargs, char **args)
+{
+	(void)args;
+
+	if (nargs != 1) {
+		kprintf("Usage: clocks\n");
+		return EINVAL;
+	}
+
+	hardclock_printstats();
+	return 0;
+}
+
+/*
+ * Command for showing how the cpu has been shared between processes.
+ */
+static
+int
+cmd_shares(int nargs, char **args)
+{
+	(void)args;
+
+	if (nargs != 1) {
+		kprintf("Usage: shares\n");
+		return EINVAL;
+	}
+
+	proc_printshares();
+	return 0;
+}
+
+/*
+ * Command for showing the scheduler statistics collected since the
+ * last time this command was run, and starting over.
+ */
+static
+int
+cmd_schedstat(int nargs, char **args)
+{
+	(void)args;
+
+	if (nargs != 1) {
+		kprintf("Usage: schedstat\n");
+		return EINVAL;
+	}
+
+	thread_printstats(true);
+	return 0;
+}
+
+/*
+ * Command for lock contention profiling: turn it on or off, or show
+ * the most contended locks since the last time and start over.
+ */
+static
+int
+cmd_lockstat(int nargs, char **args)
+{
+	unsigned topn = 10;
+	int result;
+
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		result = lockstat_enable(true);
+		if (result) {
+			kprintf("lockstat: %s\n", strerror(result));
+			return result;
+		}
+		return 0;
+	}
+	if (nargs == 2 && !strcmp(args[1], "off")) {
+		return lockstat_enable(false);
+	}
+	if (nargs == 2) {
+		topn = atoi(args[1]);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: lockstat [on | off | count]\n");
+		return EINVAL;
+	}
+
+	if (!lockstat_enabled) {
+		kprintf("(lockstat is off)\n");
+	}
+	lockstat_print(topn, true);
+	return 0;
+}
+
+/*
+ * Command for showing or changing kernel tuning knobs.
+ */
+
+/* Table of tunables. */
+static const struct {
+	const char *name;
+	unsigned *valp;
+	unsigned min, max;		/* Allowed values */
+	const char *desc;
+} tunetable[] = {
+	{ "migrate_coldticks",	&sched_migrate_coldticks, 0, 1000,
+	  "hardclocks until a thread is cache-cold" },
+	{ "migrate_maxcost",	&sched_migrate_maxcost, 0, 1000 * RUNAVG_SCALE,
+	  "max migration cost, 1/16 hardclocks" },
+	{ "lock_inherit",	&lock_inherit_priority, 0, 1,
+	  "priority inheritance for locks (0/1)" },
+	{ "lock_handoff",	&lock_handoff, 0, 1,
+	  "hand released locks to the next waiter (0/1)" },
+	{ "lock_spin",		&lock_spin, 0, 1000000,
+	  "max spins on a running lock holder (0=off)" },
+	{ "cv_waitmorph",	&cv_waitmorph, 0, 1,
+	  "signalled CV waiters queue for the lock (0/1)" },
+	{ "sem_fifo",		&sem_fifo, 0, 1,
+	  "V gives its count to the oldest sleeper (0/1)" },
+	{ "sem_handoff",	&sem_handoff, 0, 1,
+	  "hand V's count to the next sleeper (0/1)" },
+	{ "tickless",		&hardclock_tickless, 0, 1,
+	  "tickless hardclocks (0/1)" },
+	{ "thread_cache",	&thread_cache_max, 0, 1024,
+	  "dead threads cached per cpu" },
+	{ "schedstat_timing",	&schedstat_timing, 0, 1,
+	  "time run queue waits for schedstat (0/1)" },
+	{ "gang_slice",		&sched_gang_slice, 1, 1000,
+	  "hardclocks per gang scheduling slot" },
+	{ NULL, NULL, 0, 0, NULL }
+};
+
+static
+int
+cmd_tune(int nargs, char **args)
+{
+	int i, val;
+
+	if (nargs == 1) {
+		for (i=0; tunetable[i].name; i++) {
+			kprintf("%-20s %8u  %s\n", tunetable[i].name,
+				*tunetable[i].valp, tunetable[i].desc);
+		}
+		return 0;
+	}
+	if (nargs != 3) {
+		kprintf("Usage: tune [name value]\n");
+		return EINVAL;
+	}
+
+	for (i=0; tunetable[i].name; i++) {
+		if (!strcmp(tunetable[i].name, args[1])) {
+			val = atoi(args[2]);
+			if (val < 0 || (unsigned)val < tunetable[i].min ||
+			    (unsigned)val > tunetable[i].max) {
+				kprintf("tune: %s must be between %u and %u\n",
+					tunetable[i].name, tunetable[i].min,
+					tunetable[i].max);
+				return EINVAL;
+			}
+			*tunetable[i].valp = val;
+			kprintf("%s = %u\n", tunetable[i].name,
+				*tunetable[i].valp);
+			return 0;
+		}
+	}
+	kprintf("Unknown tunable %s\n", args[1]);
+	return EINVAL;
+}
+
 static
 int
 cmd_kheapstats(int nargs, char **args)
@@ -443,6 +819,15 @@ static const char *opsmenu[] = {
 	"[cd]      Change directory          ",
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
+	"[sched]   Set scheduling policy     ",
+	"[tune]    Show/set tuning knobs     ",
+	"[shares]  Show cpu share per process",
+	"[clocks]  Show hardclock counters   ",
+	"[pin]     Pin a process to cpus     ",
+	"[gang]    Gang-schedule a process   ",
+	"[load]    Show cpu and thread loads ",
+	"[schedstat] Show/reset sched stats  ",
+	"[lockstat] Lock contention profile  ",
 	"[panic]   Intentional panic         ",
 	"[q]       Quit and shut down        ",
 	NULL
@@ -473,6 +858,18 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] Priority inversion    (1)     ",
+	"[sy5] Rwlock test           (1)     ",
+	"[sy6] Semaphore benchmark   (1)     ",
+	"[sy7] Futex test            (1)     ",
+	"[sy8] Barrier test          (1)     ",
+	"[sb1] Wakeup latency benchmark      ",
+	"[sb2] EDF deadline test             ",
+	"[sb3] Thread create/exit benchmark  ",
+	"[sb4] Gang scheduling lock benchmark",
+	"[sb5] Adaptive lock benchmark       ",
+	"[sb6] Spinlock contention benchmark ",
+	"[sb7] CV broadcast benchmark        ",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -552,6 +949,15 @@ static struct {
 	{ "cd",		cmd_chdir },
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
+	{ "sched",	cmd_sched },
+	{ "shares",	cmd_shares },
+	{ "clocks",	cmd_clocks },
+	{ "pin",	cmd_pin },
+	{ "gang",	cmd_gang },
+	{ "load",	cmd_load },
+	{ "schedstat",	cmd_schedstat },
+	{ "lockstat",	cmd_lockstat },
+	{ "tune",	cmd_tune },
 	{ "panic",	cmd_panic },
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
@@ -584,6 +990,20 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	pitest },
+	{ "sy5",	rwtest },
+	{ "sy6",	sembench },
+	{ "sy7",	futextest },
+	{ "sy8",	barriertest },
+
+	/* scheduler benchmarks */
+	{ "sb1",	schedlatency },
+	{ "sb2",	edftest },
+	{ "sb3",	forkbench },
+	{ "sb4",	gangbench },
+	{ "sb5",	lockbench },
+	{ "sb6",	spinbench },
+	{ "sb7",	cvbench },
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
@@ -2,6 +2,7 @@
 #include <kern/errno.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
+#include <kern/futex.h>
 #include <lib.h>
 #include <syscall.h>
 #include <current.h>
@@ -10,6 +11,7 @@
 #include <thread.h>
 #include <addrspace.h>
 #include <copyinout.h>
+#include <rcu.h>
 #include "opt-A2.h"
 
   /* this implementation of sys__exit does not do anything with the exit code */
@@ -27,12 +29,8 @@ void sys__exit(int exitcode) {
   exit_codes[curproc->pid] = exitcode;
   // increment the binary semaphore for the process
   V(curproc->sem_running);
-  // should now wait till all processes that are waitpid are notified
-  while((int)curproc->sem_waiting->sem_count != 0)
-  {
-    // wait
-  }
-  pids[curproc->pid] = NULL;
+  // proc_destroy takes us out of the process table and waits for
+  // every waitpid that found us there to be notified
 #else
   (void) exitcode
 #endif
@@ -106,19 +104,38 @@ sys_waitpid(pid_t pid,
     return(EINVAL);
   }
 #if OPT_A2
-  if (pids[pid] == NULL)
+  if (pid < 0 || pid >= PSIZE) {
+    return(ESRCH);
+  }
+  // look the process up without locking the table; counting
+  // ourselves in p_waiters inside the RCU reader keeps proc_destroy
+  // from freeing it until we're done
+  rcu_read_lock();
+  struct proc* reference_proc = proc_lookup(pid);
+  if (reference_proc != NULL) {
+    spinlock_acquire(&reference_proc->p_lock);
+    reference_proc->p_waiters++;
+    spinlock_release(&reference_proc->p_lock);
+  }
+  rcu_read_unlock();
+  if (reference_proc == NULL)
   {
     exitstatus = exit_codes[pid];
     return exitstatus;
   }
-  struct proc* reference_proc = pids[pid];
-  // you should get the referenced process from the pid by making a table each time a proc is created
-  V(reference_proc->sem_waiting);
   P(reference_proc->sem_running);
 
   exitstatus = reference_proc->p_exitcode;
   V(reference_proc->sem_running);
-  P(reference_proc->sem_waiting);
+  // if proc_destroy is waiting and we're the last, let it go
+  spinlock_acquire(&reference_proc->p_lock);
+  reference_proc->p_waiters--;
+  bool lastwaiter = reference_proc->p_reaping &&
+    reference_proc->p_waiters == 0;
+  spinlock_release(&reference_proc->p_lock);
+  if (lastwaiter) {
+    V(reference_proc->sem_nowaiters);
+  }
   result = copyout((void *)&exitstatus,status,sizeof(int));
   if (result) {
     return(result);
@@ -140,7 +157,7 @@ sys_waitpid(pid_t pid,
 #if OPT_A2
 pid_t fork()
 {
- struct addrspace *as;
+ struct addrspace *as, *childas;
  vaddr_t stackptr;
  int result;
  struct proc *child;
@@ -158,11 +175,71 @@ pid_t fork()
    return ENOMEM;
  }
  //Set address space of new process
- spinlock_acquire(&child->p_lock);
- as_copy(as,&child->p_addrspace);
- spinlock_release(&child->p_lock);
+ childas = NULL;
+ as_copy(as,&childas);
+ proc_setas(child, childas);
  
  //pid_t is defined as something, I should figue out what that is...
  return child->pid;
 }
 #endif
+
+/* handler for setweight() system call                  */
+/* sets the number of scheduling tickets of a process;  */
+/* see proc.h                                            */
+
+int
+sys_setweight(pid_t pid, unsigned tickets)
+{
+  struct proc *p;
+  int result;
+
+  rcu_read_lock();
+  p = proc_lookup(pid);
+  result = p == NULL ? ESRCH : proc_setweight(p, tickets);
+  rcu_read_unlock();
+  return result;
+}
+
+/* handler for setaffinity() system call                */
+/* restricts a process to a set of cpus; see thread.h    */
+
+int
+sys_setaffinity(pid_t pid, uint32_t mask)
+{
+  struct proc *p;
+  int result;
+
+  rcu_read_lock();
+  p = proc_lookup(pid);
+  result = p == NULL ? ESRCH : proc_setaffinity(p, mask);
+  rcu_read_unlock();
+  return result;
+}
+
+/* handler for futex() system call                      */
+/* sleeps or wakes on an int in user memory;            */
+/* see kern/futex.h                                      */
+
+int
+sys_futex(userptr_t addr, int op, int val, int *retval)
+{
+  struct addrspace *as;
+  int result;
+
+  as = curproc_getas();
+  switch (op) {
+  case FUTEX_WAIT:
+    result = futex_wait(as, (vaddr_t)addr, val);
+    *retval = 0;
+    return(result);
+  case FUTEX_WAKE:
+    if (val < 0) {
+      return(EINVAL);
+    }
+    *retval = futex_wake(as, (vaddr_t)addr, val);
+    return(0);
+  default:
+    return(EINVAL);
+  }
+}
@@ -84,7 +84,7 @@ int runprogram(char *progname)
 
 	/* Switch to it and activate it. */
 	curproc_setas(as);
-	as_activate();
+	curproc_activateas();
 
 	/* Load the executable. */
 	result = load_elf(v, &entrypoint);
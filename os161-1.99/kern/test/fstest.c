@@ -56,20 +56,32 @@
 #define NTHREADS 12
 #define NCREATES 32
 
-static struct semaphore *threadsem = NULL;
+static struct latch *threadlatch = NULL;
 
+/*
+ * Set up threadlatch for the NTHREADS threads of a test to count
+ * down as they finish. It's one-shot, so each test makes its own.
+ */
 static
 void
-init_threadsem(void)
+init_threadlatch(void)
 {
-	if (threadsem==NULL) {
-		threadsem = sem_create("fstestsem", 0);
-		if (threadsem == NULL) {
-			panic("fstest: sem_create failed\n");
-		}
+	KASSERT(threadlatch == NULL);
+	threadlatch = latch_create("fstestlatch", NTHREADS);
+	if (threadlatch == NULL) {
+		panic("fstest: latch_create failed\n");
 	}
 }
 
+static
+void
+wait_threadlatch(void)
+{
+	latch_wait(threadlatch);
+	latch_destroy(threadlatch);
+	threadlatch = NULL;
+}
+
 /*
  * Vary each line of the test file in a way that's predictable but
  * unlikely to mask bugs in the filesystem.
@@ -306,7 +318,7 @@ readstress_thread(void *fs, unsigned long num)
 	if (fstest_read(filesys, "")) {
 		kprintf("*** Thread %lu: failed\n", num);
 	}
-	V(threadsem);
+	latch_countdown(threadlatch);
 }
 
 static
@@ -315,8 +327,6 @@ doreadstress(const char *filesys)
 {
 	int i, err;
 
-	init_threadsem();
-
 	kprintf("*** Starting fs read stress test on %s:\n", filesys);
 
 	if (fstest_write(filesys, "", 1, 0)) {
@@ -324,6 +334,7 @@ doreadstress(const char *filesys)
 		return;
 	}
 
+	init_threadlatch();
 	for (i=0; i<NTHREADS; i++) {
 		err = thread_fork("readstress", NULL,
 				  readstress_thread, (char *)filesys, i);
@@ -333,9 +344,7 @@ doreadstress(const char *filesys)
 		}
 	}
 
-	for (i=0; i<NTHREADS; i++) {
-		P(threadsem);
-	}
+	wait_threadlatch();
 
 	if (fstest_remove(filesys, "")) {
 		kprintf("*** Test failed\n");
@@ -357,13 +366,13 @@ writestress_thread(void *fs, unsigned long num)
 
 	if (fstest_write(filesys, numstr, 1, 0)) {
 		kprintf("*** Thread %lu: failed\n", num);
-		V(threadsem);
+		latch_countdown(threadlatch);
 		return;
 	}
 
 	if (fstest_read(filesys, numstr)) {
 		kprintf("*** Thread %lu: failed\n", num);
-		V(threadsem);
+		latch_countdown(threadlatch);
 		return;
 	}
 
@@ -373,7 +382,7 @@ writestress_thread(void *fs, unsigned long num)
 
 	kprintf("*** Thread %lu: done\n", num);
 
-	V(threadsem);
+	latch_countdown(threadlatch);
 }
 
 static
@@ -382,10 +391,9 @@ dowritestress(const char *filesys)
 {
 	int i, err;
 
-	init_threadsem();
-
 	kprintf("*** Starting fs write stress test on %s:\n", filesys);
 
+	init_threadlatch();
 	for (i=0; i<NTHREADS; i++) {
 		err = thread_fork("writestress", NULL,
 				  writestress_thread, (char *)filesys, i);
@@ -394,9 +402,7 @@ dowritestress(const char *filesys)
 		}
 	}
 
-	for (i=0; i<NTHREADS; i++) {
-		P(threadsem);
-	}
+	wait_threadlatch();
 
 	kprintf("*** fs write stress test done\n");
 }
@@ -411,11 +417,11 @@ writestress2_thread(void *fs, unsigned long num)
 
 	if (fstest_write(filesys, "", NTHREADS, num)) {
 		kprintf("*** Thread %lu: failed\n", num);
-		V(threadsem);
+		latch_countdown(threadlatch);
 		return;
 	}
 
-	V(threadsem);
+	latch_countdown(threadlatch);
 }
 
 static
@@ -426,8 +432,6 @@ dowritestress2(const char *filesys)
 	char name[32];
 	struct vnode *vn;
 
-	init_threadsem();
-
 	kprintf("*** Starting fs write stress test 2 on %s:\n", filesys);
 
 	/* Create and truncate test file */
@@ -440,6 +444,7 @@ dowritestress2(const char *filesys)
 	}
 	vfs_close(vn);
 
+	init_threadlatch();
 	for (i=0; i<NTHREADS; i++) {
 		err = thread_fork("writestress2", NULL,
 				  writestress2_thread, (char *)filesys, i);
@@ -449,9 +454,7 @@ dowritestress2(const char *filesys)
 		}
 	}
 
-	for (i=0; i<NTHREADS; i++) {
-		P(threadsem);
-	}
+	wait_threadlatch();
 
 	if (fstest_read(filesys, "")) {
 		kprintf("*** Test failed\n");
@@ -482,25 +485,25 @@ createstress_thread(void *fs, unsigned long num)
 
 		if (fstest_write(filesys, numstr, 1, 0)) {
 			kprintf("*** Thread %lu: file %d: failed\n", num, i);
-			V(threadsem);
+			latch_countdown(threadlatch);
 			return;
 		}
 		
 		if (fstest_read(filesys, numstr)) {
 			kprintf("*** Thread %lu: file %d: failed\n", num, i);
-			V(threadsem);
+			latch_countdown(threadlatch);
 			return;
 		}
 
 		if (fstest_remove(filesys, numstr)) {
 			kprintf("*** Thread %lu: file %d: failed\n", num, i);
-			V(threadsem);
+			latch_countdown(threadlatch);
 			return;
 		}
 
 	}
 
-	V(threadsem);
+	latch_countdown(threadlatch);
 }
 
 static
@@ -509,10 +512,9 @@ docreatestress(const char *filesys)
 {
 	int i, err;
 
-	init_threadsem();
-
 	kprintf("*** Starting fs create stress test on %s:\n", filesys);
 
+	init_threadlatch();
 	for (i=0; i<NTHREADS; i++) {
 #ifdef UW
 		err = thread_fork("createstress", NULL,
@@ -528,9 +530,7 @@ docreatestress(const char *filesys)
 		}
 	}
 
-	for (i=0; i<NTHREADS; i++) {
-		P(threadsem);
-	}
+	wait_threadlatch();
 
 	kprintf("*** fs create stress test done\n");
 }
@@ -53,9 +53,9 @@
 
 static
 void
-mallocthread(void *sm, unsigned long num)
+mallocthread(void *lt, unsigned long num)
 {
-	struct semaphore *sem = sm;
+	struct latch *done = lt;
 	void *ptr;
 	void *oldptr=NULL;
 	void *oldptr2=NULL;
@@ -64,10 +64,10 @@ mallocthread(void *sm, unsigned long num)
 	for (i=0; i<NTRIES; i++) {
 		ptr = kmalloc(ITEMSIZE);
 		if (ptr==NULL) {
-			if (sem) {
+			if (done) {
 				kprintf("thread %lu: kmalloc returned NULL\n",
 					num);
-				V(sem);
+				latch_countdown(done);
 				return;
 			}
 			kprintf("kmalloc returned null; test failed.\n");
@@ -85,8 +85,8 @@ mallocthread(void *sm, unsigned long num)
 	if (oldptr) {
 		kfree(oldptr);
 	}
-	if (sem) {
-		V(sem);
+	if (done) {
+		latch_countdown(done);
 	}
 }
 
@@ -106,33 +106,30 @@ malloctest(int nargs, char **args)
 int
 mallocstress(int nargs, char **args)
 {
-	struct semaphore *sem;
+	struct latch *done;
 	int i, result;
 
 	(void)nargs;
 	(void)args;
 
-	sem = sem_create("mallocstress", 0);
-	if (sem == NULL) {
-		panic("mallocstress: sem_create failed\n");
+	done = latch_create("mallocstress", NTHREADS);
+	if (done == NULL) {
+		panic("mallocstress: latch_create failed\n");
 	}
 
 	kprintf("Starting kmalloc stress test...\n");
 
 	for (i=0; i<NTHREADS; i++) {
 		result = thread_fork("mallocstress", NULL,
-				     mallocthread, sem, i);
+				     mallocthread, done, i);
 		if (result) {
 			panic("mallocstress: thread_fork failed: %s\n",
 			      strerror(result));
 		}
 	}
 
-	for (i=0; i<NTHREADS; i++) {
-		P(sem);
-	}
-
-	sem_destroy(sem);
+	latch_wait(done);
+	latch_destroy(done);
 	kprintf("kmalloc stress test done\n");
 
 	return 0;
@@ -0,0 +1,1203 @@
+/*
+ * Scheduler benchmarks.
+ *
+ * These don't pass or fail; they print numbers so that scheduling
+ * policies (see the "sched" menu command) can be compared on the
+ * same workload.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <proc.h>
+#include <current.h>
+#include <synch.h>
+#include <test.h>
+
+/* Number of wakeups each sleeper waits for. */
+#define SLAT_ROUNDS     50
+/* Most sleepers we'll run at once. */
+#define SLAT_MAXSLEEPERS 16
+
+static struct semaphore *slat_wakesems[SLAT_MAXSLEEPERS];
+static struct semaphore *slat_acksem;
+static struct semaphore *slat_donesem;
+
+/* Time at which each sleeper was last woken up. */
+static time_t slat_wakesecs[SLAT_MAXSLEEPERS];
+static uint32_t slat_wakensecs[SLAT_MAXSLEEPERS];
+
+/* Results, protected by slat_lock. */
+static struct lock *slat_lock;
+static uint32_t slat_total_us;
+static uint32_t slat_max_us;
+static unsigned slat_samples;
+
+static volatile int slat_computes_done;
+
+/*
+ * Microseconds from SECS1.NSECS1 to SECS2.NSECS2; see test.h.
+ */
+uint32_t
+usecs_between(time_t secs1, uint32_t nsecs1, time_t secs2, uint32_t nsecs2)
+{
+	time_t dsecs;
+	uint32_t dnsecs;
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &dsecs, &dnsecs);
+	return (uint32_t)dsecs * 1000000 + dnsecs / 1000;
+}
+
+/*
+ * Microseconds elapsed since SECS.NSECS.
+ */
+uint32_t
+usecs_since(time_t secs, uint32_t nsecs)
+{
+	time_t nowsecs;
+	uint32_t nownsecs;
+
+	gettime(&nowsecs, &nownsecs);
+	return usecs_between(secs, nsecs, nowsecs, nownsecs);
+}
+
+/*
+ * Spin for N iterations of an empty loop.
+ */
+void
+busy_loop(unsigned n)
+{
+	volatile unsigned i;
+
+	for (i=0; i<n; i++) {
+		/* nothing */
+	}
+}
+
+/*
+ * A sleeper spends nearly all its time blocked in P(), and measures
+ * how long it takes to get the cpu after each V().
+ */
+static
+void
+slat_sleeper(void *junk, unsigned long num)
+{
+	uint32_t us;
+	int i;
+
+	(void)junk;
+
+	for (i=0; i<SLAT_ROUNDS; i++) {
+		P(slat_wakesems[num]);
+		us = usecs_since(slat_wakesecs[num], slat_wakensecs[num]);
+
+		lock_acquire(slat_lock);
+		slat_total_us += us;
+		if (us > slat_max_us) {
+			slat_max_us = us;
+		}
+		slat_samples++;
+		lock_release(slat_lock);
+
+		V(slat_acksem);
+	}
+	V(slat_donesem);
+}
+
+/*
+ * A compute thread never blocks and never yields.
+ */
+static
+void
+slat_compute(void *junk, unsigned long num)
+{
+	volatile unsigned long spin = 0;
+
+	(void)junk;
+	(void)num;
+
+	while (!slat_computes_done) {
+		spin++;
+	}
+	V(slat_donesem);
+}
+
+static
+void
+slat_setup(unsigned nsleepers)
+{
+	unsigned i;
+
+	slat_lock = lock_create("slat_lock");
+	slat_acksem = sem_create("slat_ack", 0);
+	slat_donesem = sem_create("slat_done", 0);
+	if (slat_lock == NULL || slat_acksem == NULL || slat_donesem == NULL) {
+		panic("schedlatency: out of memory\n");
+	}
+	for (i=0; i<nsleepers; i++) {
+		slat_wakesems[i] = sem_create("slat_wake", 0);
+		if (slat_wakesems[i] == NULL) {
+			panic("schedlatency: sem_create failed\n");
+		}
+	}
+	slat_total_us = 0;
+	slat_max_us = 0;
+	slat_samples = 0;
+	slat_computes_done = 0;
+}
+
+static
+void
+slat_cleanup(unsigned nsleepers)
+{
+	unsigned i;
+
+	for (i=0; i<nsleepers; i++) {
+		sem_destroy(slat_wakesems[i]);
+		slat_wakesems[i] = NULL;
+	}
+	sem_destroy(slat_donesem);
+	sem_destroy(slat_acksem);
+	lock_destroy(slat_lock);
+}
+
+/*
+ * Wakeup-to-run latency benchmark.
+ *
+ * Usage: sb1 [sleepers computes]
+ *
+ * The menu thread acts as the waker: each round it timestamps and
+ * wakes every sleeper, then waits for all of them to check in. The
+ * compute threads keep every cpu busy the whole time, so under plain
+ * round-robin a woken sleeper waits behind them.
+ */
+int
+schedlatency(int nargs, char **args)
+{
+	unsigned nsleepers = 4, ncomputes = 4;
+	unsigned i, j;
+	int result;
+
+	if (nargs == 3) {
+		nsleepers = atoi(args[1]);
+		ncomputes = atoi(args[2]);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: sb1 [sleepers computes]\n");
+		return EINVAL;
+	}
+	if (nsleepers < 1 || nsleepers > SLAT_MAXSLEEPERS) {
+		kprintf("sb1: between 1 and %d sleepers please\n",
+			SLAT_MAXSLEEPERS);
+		return EINVAL;
+	}
+
+	slat_setup(nsleepers);
+	kprintf("Starting wakeup latency benchmark (%u sleepers, "
+		"%u computes, policy %s)...\n", nsleepers, ncomputes,
+		sched_policynames[sched_policy]);
+
+	for (i=0; i<ncomputes; i++) {
+		result = thread_fork("slat_compute", NULL, slat_compute,
+				     NULL, i);
+		if (result) {
+			panic("schedlatency: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nsleepers; i++) {
+		result = thread_fork("slat_sleeper", NULL, slat_sleeper,
+				     NULL, i);
+		if (result) {
+			panic("schedlatency: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	for (j=0; j<SLAT_ROUNDS; j++) {
+		for (i=0; i<nsleepers; i++) {
+			gettime(&slat_wakesecs[i], &slat_wakensecs[i]);
+			V(slat_wakesems[i]);
+		}
+		for (i=0; i<nsleepers; i++) {
+			P(slat_acksem);
+		}
+	}
+
+	for (i=0; i<nsleepers; i++) {
+		P(slat_donesem);
+	}
+	slat_computes_done = 1;
+	for (i=0; i<ncomputes; i++) {
+		P(slat_donesem);
+	}
+
+	kprintf("%u wakeups: average %u us, max %u us\n", slat_samples,
+		slat_samples ? slat_total_us / slat_samples : 0,
+		slat_max_us);
+
+	slat_cleanup(nsleepers);
+	kprintf("Wakeup latency benchmark done.\n");
+	return 0;
+}
+
+/* Periods each EDF thread runs for. */
+#define EDFT_PERIODS	50
+/* Most EDF threads we'll run at once. */
+#define EDFT_MAXTHREADS	16
+
+static struct semaphore *edft_donesem;
+static struct semaphore *edft_holdsem;
+static struct lock *edft_lock;
+static unsigned edft_misses;
+static unsigned edft_periods;
+static volatile int edft_computes_done;
+
+/*
+ * An EDF thread that uses about half its budget every period.
+ */
+static
+void
+edft_periodic(void *junk, unsigned long num)
+{
+	struct thread *cur = curthread;
+	volatile unsigned long spin = 0;
+	int i;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<EDFT_PERIODS; i++) {
+		while (cur->t_edf_used < (cur->t_edf_budget + 1) / 2) {
+			spin++;
+		}
+		thread_edf_wait();
+	}
+
+	lock_acquire(edft_lock);
+	edft_misses += cur->t_edf_misses;
+	edft_periods += EDFT_PERIODS;
+	lock_release(edft_lock);
+	V(edft_donesem);
+}
+
+/*
+ * An EDF thread that just sits on its reservation until told to go.
+ */
+static
+void
+edft_holder(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	P(edft_holdsem);
+	V(edft_donesem);
+}
+
+/*
+ * Background load, as in tt3: never blocks, never yields.
+ */
+static
+void
+edft_compute(void *junk, unsigned long num)
+{
+	volatile unsigned long spin = 0;
+
+	(void)junk;
+	(void)num;
+
+	while (!edft_computes_done) {
+		spin++;
+	}
+	V(edft_donesem);
+}
+
+/*
+ * EDF deadline test.
+ *
+ * Usage: sb2 [edfthreads computes period budget]
+ *
+ * First checks admission control by reserving whole cpus until
+ * thread_fork_edf refuses. Then runs the EDF threads against the
+ * compute threads and counts the periods in which an EDF thread did
+ * not finish its work. With working admission control and
+ * preemption that should be none.
+ */
+int
+edftest(int nargs, char **args)
+{
+	unsigned nedf = 2, ncomputes = 4, period = 10, budget = 4;
+	unsigned i, nheld;
+	int result;
+
+	if (nargs == 5) {
+		nedf = atoi(args[1]);
+		ncomputes = atoi(args[2]);
+		period = atoi(args[3]);
+		budget = atoi(args[4]);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: sb2 [edfthreads computes period budget]\n");
+		return EINVAL;
+	}
+	if (nedf < 1 || nedf > EDFT_MAXTHREADS) {
+		kprintf("sb2: between 1 and %d EDF threads please\n",
+			EDFT_MAXTHREADS);
+		return EINVAL;
+	}
+
+	edft_donesem = sem_create("edft_done", 0);
+	edft_holdsem = sem_create("edft_hold", 0);
+	edft_lock = lock_create("edft_lock");
+	if (edft_donesem == NULL || edft_holdsem == NULL ||
+	    edft_lock == NULL) {
+		panic("edftest: out of memory\n");
+	}
+	edft_misses = 0;
+	edft_periods = 0;
+	edft_computes_done = 0;
+
+	kprintf("Starting EDF test...\n");
+
+	/* Admission control. */
+	for (nheld = 0; ; nheld++) {
+		result = thread_fork_edf("edft_holder", NULL, 10, 10,
+					 edft_holder, NULL, nheld);
+		if (result == EBUSY) {
+			break;
+		}
+		if (result) {
+			panic("edftest: thread_fork_edf failed: %s\n",
+			      strerror(result));
+		}
+	}
+	kprintf("Admitted %u full-cpu EDF threads before EBUSY\n", nheld);
+	for (i=0; i<nheld; i++) {
+		V(edft_holdsem);
+	}
+	for (i=0; i<nheld; i++) {
+		P(edft_donesem);
+	}
+
+	for (i=0; i<ncomputes; i++) {
+		result = thread_fork("edft_compute", NULL, edft_compute,
+				     NULL, i);
+		if (result) {
+			panic("edftest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nedf; i++) {
+		result = thread_fork_edf("edft_periodic", NULL, period, budget,
+					 edft_periodic, NULL, i);
+		if (result) {
+			kprintf("edftest: thread_fork_edf: %s\n",
+				strerror(result));
+			break;
+		}
+	}
+	nedf = i;
+
+	for (i=0; i<nedf; i++) {
+		P(edft_donesem);
+	}
+	edft_computes_done = 1;
+	for (i=0; i<ncomputes; i++) {
+		P(edft_donesem);
+	}
+
+	kprintf("%u EDF threads, period %u, budget %u: "
+		"%u of %u deadlines missed\n", nedf, period, budget,
+		edft_misses, edft_periods);
+
+	lock_destroy(edft_lock);
+	sem_destroy(edft_holdsem);
+	sem_destroy(edft_donesem);
+	kprintf("EDF test done.\n");
+	return 0;
+}
+
+/* Threads forked per batch, and how many batches by default. */
+#define FORKB_BATCH	8
+#define FORKB_BATCHES	500
+
+static struct semaphore *forkb_sem;
+
+static
+void
+forkb_child(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	V(forkb_sem);
+}
+
+/*
+ * Fork and reap NBATCHES batches of threads with the thread cache set
+ * to CACHEMAX, and return the elapsed microseconds.
+ */
+static
+uint32_t
+forkb_run(unsigned nbatches, unsigned cachemax)
+{
+	time_t secs;
+	uint32_t nsecs;
+	unsigned i, j, oldmax;
+	int result;
+
+	oldmax = thread_cache_max;
+	thread_cache_max = cachemax;
+
+	gettime(&secs, &nsecs);
+	for (i=0; i<nbatches; i++) {
+		for (j=0; j<FORKB_BATCH; j++) {
+			result = thread_fork("forkb_child", NULL, forkb_child,
+					     NULL, j);
+			if (result) {
+				panic("forkbench: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+		for (j=0; j<FORKB_BATCH; j++) {
+			P(forkb_sem);
+		}
+	}
+
+	thread_cache_max = oldmax;
+	return usecs_since(secs, nsecs);
+}
+
+/*
+ * Thread create/exit benchmark.
+ *
+ * Usage: sb3 [batches]
+ *
+ * Forks batches of threads that exit straight away, first with the
+ * thread cache turned off and then with it on, and prints the
+ * throughput of each.
+ */
+int
+forkbench(int nargs, char **args)
+{
+	unsigned nbatches = FORKB_BATCHES, nthreads, cachemax;
+	uint32_t offus, onus;
+
+	if (nargs == 2) {
+		nbatches = atoi(args[1]);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: sb3 [batches]\n");
+		return EINVAL;
+	}
+	if (nbatches < 1) {
+		kprintf("sb3: need at least one batch\n");
+		return EINVAL;
+	}
+
+	forkb_sem = sem_create("forkb_sem", 0);
+	if (forkb_sem == NULL) {
+		panic("forkbench: sem_create failed\n");
+	}
+	nthreads = nbatches * FORKB_BATCH;
+	cachemax = thread_cache_max > 0 ? thread_cache_max : FORKB_BATCH;
+
+	kprintf("Starting thread create/exit benchmark (%u threads)...\n",
+		nthreads);
+
+	offus = forkb_run(nbatches, 0);
+	kprintf("cache off: %u us, %u threads/sec\n", offus,
+		offus ? (uint32_t)((uint64_t)nthreads * 1000000 / offus) : 0);
+
+	/* Warm the cache up first. */
+	forkb_run(1, cachemax);
+	onus = forkb_run(nbatches, cachemax);
+	kprintf("cache on:  %u us, %u threads/sec\n", onus,
+		onus ? (uint32_t)((uint64_t)nthreads * 1000000 / onus) : 0);
+
+	sem_destroy(forkb_sem);
+	kprintf("Thread create/exit benchmark done.\n");
+	return 0;
+}
+
+/* Most lock-heavy threads gangbench will run. */
+#define GANGB_MAXTHREADS	16
+/* How long each run lasts, in seconds. */
+#define GANGB_SECS		2
+/* Spin iterations inside and outside the lock. */
+#define GANGB_INSIDE		200
+#define GANGB_OUTSIDE		100
+
+/* Process the lock-heavy threads run in; reused across runs. */
+static struct proc *gangb_proc;
+
+static struct lock *gangb_lock;
+static struct semaphore *gangb_donesem;
+static volatile bool gangb_stop;
+static volatile unsigned gangb_shared;
+static unsigned gangb_ops[GANGB_MAXTHREADS];
+
+/*
+ * A lock-heavy thread takes the shared lock over and over, holding it
+ * a little while each time. When the holder is descheduled, everyone
+ * else soon piles up waiting for it.
+ */
+static
+void
+gangb_worker(void *junk, unsigned long num)
+{
+	unsigned ops = 0;
+
+	(void)junk;
+
+	while (!gangb_stop) {
+		lock_acquire(gangb_lock);
+		gangb_shared++;
+		busy_loop(GANGB_INSIDE);
+		lock_release(gangb_lock);
+		busy_loop(GANGB_OUTSIDE);
+		ops++;
+	}
+	gangb_ops[num] = ops;
+	V(gangb_donesem);
+}
+
+/*
+ * A hog just computes, competing with the lock-heavy threads.
+ */
+static
+void
+gangb_hog(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	while (!gangb_stop) {
+		busy_loop(1000);
+	}
+	V(gangb_donesem);
+}
+
+/*
+ * Run NTHREADS lock-heavy threads against NHOGS hogs for GANGB_SECS
+ * seconds, with gang mode on or off, and return the lock-heavy
+ * threads' total lock acquisitions per second.
+ */
+static
+uint32_t
+gangb_run(unsigned nthreads, unsigned nhogs, bool gang)
+{
+	time_t secs;
+	uint32_t nsecs, us;
+	uint64_t ops;
+	unsigned i;
+	int result;
+
+	result = proc_setgang(gangb_proc, gang);
+	if (result) {
+		panic("gangbench: proc_setgang: %s\n", strerror(result));
+	}
+
+	gangb_stop = false;
+	gangb_shared = 0;
+	for (i=0; i<nhogs; i++) {
+		result = thread_fork("gangb_hog", NULL, gangb_hog, NULL, i);
+		if (result) {
+			panic("gangbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	gettime(&secs, &nsecs);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("gangb_worker", gangb_proc, gangb_worker,
+				     NULL, i);
+		if (result) {
+			panic("gangbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	clocksleep(GANGB_SECS);
+	gangb_stop = true;
+	us = usecs_since(secs, nsecs);
+	for (i=0; i<nthreads + nhogs; i++) {
+		P(gangb_donesem);
+	}
+
+	proc_setgang(gangb_proc, false);
+
+	ops = 0;
+	for (i=0; i<nthreads; i++) {
+		ops += gangb_ops[i];
+	}
+	if (ops != gangb_shared) {
+		kprintf("gangbench: lock lost updates (%u vs %u)\n",
+			(unsigned)ops, gangb_shared);
+	}
+	return us ? (uint32_t)(ops * 1000000 / us) : 0;
+}
+
+/*
+ * Gang scheduling benchmark.
+ *
+ * Usage: sb4 [threads [hogs]]
+ *
+ * Runs lock-heavy threads of one process against compute-bound hogs,
+ * first as ordinary threads and then with the process in gang mode,
+ * and prints the lock throughput of each. Both default to one per
+ * cpu.
+ */
+int
+gangbench(int nargs, char **args)
+{
+	unsigned ncpus, nthreads, nhogs;
+	uint32_t off, on;
+
+	ncpus = cpu_count();
+	nthreads = nhogs = ncpus;
+	if (nargs > 3) {
+		kprintf("Usage: sb4 [threads [hogs]]\n");
+		return EINVAL;
+	}
+	if (nargs > 1) {
+		nthreads = atoi(args[1]);
+	}
+	if (nargs > 2) {
+		nhogs = atoi(args[2]);
+	}
+	if (nthreads < 1 || nthreads > GANGB_MAXTHREADS) {
+		kprintf("sb4: threads must be between 1 and %u\n",
+			GANGB_MAXTHREADS);
+		return EINVAL;
+	}
+
+	if (gangb_proc == NULL) {
+		gangb_proc = proc_create_kernel("[gangbench]");
+		if (gangb_proc == NULL) {
+			return ENOMEM;
+		}
+	}
+	gangb_lock = lock_create("gangb_lock");
+	if (gangb_lock == NULL) {
+		panic("gangbench: lock_create failed\n");
+	}
+	gangb_donesem = sem_create("gangb_donesem", 0);
+	if (gangb_donesem == NULL) {
+		panic("gangbench: sem_create failed\n");
+	}
+
+	kprintf("Starting gang scheduling benchmark (%u threads, %u hogs, "
+		"%u s each)...\n", nthreads, nhogs, GANGB_SECS);
+
+	off = gangb_run(nthreads, nhogs, false);
+	kprintf("gang off: %u lock ops/sec\n", off);
+	on = gangb_run(nthreads, nhogs, true);
+	kprintf("gang on:  %u lock ops/sec\n", on);
+
+	sem_destroy(gangb_donesem);
+	lock_destroy(gangb_lock);
+	kprintf("Gang scheduling benchmark done.\n");
+	return 0;
+}
+
+/* Most threads lockbench will run. */
+#define LOCKB_MAXTHREADS	32
+/* Seconds each run lasts. */
+#define LOCKB_SECS		1
+/* Spin iterations inside and outside the lock. */
+#define LOCKB_INSIDE		20
+#define LOCKB_OUTSIDE		100
+/* Spin budget to use if lock_spin is off. */
+#define LOCKB_DEFSPIN		1000
+
+static struct lock *lockb_lock;
+static struct semaphore *lockb_startsem;
+static struct semaphore *lockb_donesem;
+static volatile bool lockb_stop;
+static volatile unsigned lockb_shared;
+static cpumask_t lockb_mask;
+static unsigned lockb_ops[LOCKB_MAXTHREADS];
+
+/*
+ * A worker takes the shared lock over and over for a very short
+ * critical section. It's forked onto the cpus being measured, and its
+ * affinity keeps it there.
+ */
+static
+void
+lockb_worker(void *junk, unsigned long num)
+{
+	unsigned ops = 0;
+
+	(void)junk;
+
+	P(lockb_startsem);
+	while (!lockb_stop) {
+		lock_acquire(lockb_lock);
+		lockb_shared++;
+		busy_loop(LOCKB_INSIDE);
+		lock_release(lockb_lock);
+		busy_loop(LOCKB_OUTSIDE);
+		ops++;
+	}
+	lockb_ops[num] = ops;
+	V(lockb_donesem);
+}
+
+/*
+ * Total context switches on all cpus so far.
+ */
+static
+unsigned
+lockb_switches(void)
+{
+	struct cpu *c;
+	unsigned i, total;
+
+	total = 0;
+	for (i=0; (c = cpu_get(i)) != NULL; i++) {
+		total += c->c_stats.ss_switches;
+	}
+	return total;
+}
+
+/*
+ * Run NTHREADS workers on the first NCPUS cpus for LOCKB_SECS seconds
+ * with lock_spin set to SPIN, and print their lock acquisitions per
+ * second and the context switches per thousand acquisitions.
+ */
+static
+void
+lockb_run(unsigned ncpus, unsigned nthreads, unsigned spin)
+{
+	time_t secs;
+	uint32_t nsecs, us;
+	uint64_t ops;
+	unsigned i, switches, saved;
+	int result;
+
+	saved = lock_spin;
+	lock_spin = spin;
+	lockb_mask = ncpus >= CPUMASK_BITS ? CPUMASK_ALL :
+		CPUMASK_BIT(ncpus) - 1;
+	lockb_stop = false;
+	lockb_shared = 0;
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork_affinity("lockb_worker", NULL,
+					      lockb_mask, lockb_worker,
+					      NULL, i);
+		if (result) {
+			panic("lockbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	switches = lockb_switches();
+	gettime(&secs, &nsecs);
+	for (i=0; i<nthreads; i++) {
+		V(lockb_startsem);
+	}
+	clocksleep(LOCKB_SECS);
+	lockb_stop = true;
+	us = usecs_since(secs, nsecs);
+	switches = lockb_switches() - switches;
+	for (i=0; i<nthreads; i++) {
+		P(lockb_donesem);
+	}
+	lock_spin = saved;
+
+	ops = 0;
+	for (i=0; i<nthreads; i++) {
+		ops += lockb_ops[i];
+	}
+	if (ops != lockb_shared) {
+		kprintf("lockbench: lock lost updates (%u vs %u)\n",
+			(unsigned)ops, lockb_shared);
+	}
+	kprintf(" %10u", us ? (uint32_t)(ops * 1000000 / us) : 0);
+	kprintf(" %8u", ops ? (uint32_t)((uint64_t)switches * 1000 / ops) : 0);
+}
+
+/*
+ * Adaptive lock benchmark.
+ *
+ * Usage: sb5 [threads-per-cpu]
+ *
+ * For 1, 2, 4, ... cpus up to all of them, runs short-critical-section
+ * lock workers confined to that many cpus, first with lock_spin off
+ * (always sleep) and then spinning, and prints the lock throughput and
+ * context switches of each. The spin run uses lock_spin if it's set
+ * and LOCKB_DEFSPIN otherwise. There's one worker per cpu by default,
+ * but always at least two.
+ */
+int
+lockbench(int nargs, char **args)
+{
+	unsigned ncpus, n, per, nthreads, spin;
+
+	ncpus = cpu_count();
+	per = 1;
+	if (nargs > 2) {
+		kprintf("Usage: sb5 [threads-per-cpu]\n");
+		return EINVAL;
+	}
+	if (nargs > 1) {
+		per = atoi(args[1]);
+	}
+	if (per < 1 || per * ncpus > LOCKB_MAXTHREADS) {
+		kprintf("sb5: at most %u threads in all\n", LOCKB_MAXTHREADS);
+		return EINVAL;
+	}
+	spin = lock_spin ? lock_spin : LOCKB_DEFSPIN;
+
+	lockb_lock = lock_create("lockb_lock");
+	if (lockb_lock == NULL) {
+		panic("lockbench: lock_create failed\n");
+	}
+	lockb_startsem = sem_create("lockb_startsem", 0);
+	if (lockb_startsem == NULL) {
+		panic("lockbench: sem_create failed\n");
+	}
+	lockb_donesem = sem_create("lockb_donesem", 0);
+	if (lockb_donesem == NULL) {
+		panic("lockbench: sem_create failed\n");
+	}
+
+	kprintf("Starting adaptive lock benchmark (%u per cpu, spin %u, "
+		"%u s each)...\n", per, spin, LOCKB_SECS);
+	kprintf("%4s %7s %10s %8s %10s %8s\n", "cpus", "threads",
+		"sleep/s", "sw/1k", "spin/s", "sw/1k");
+	n = 1;
+	while (1) {
+		nthreads = per * n < 2 ? 2 : per * n;
+		kprintf("%4u %7u", n, nthreads);
+		lockb_run(n, nthreads, 0);
+		lockb_run(n, nthreads, spin);
+		kprintf("\n");
+		if (n == ncpus) {
+			break;
+		}
+		n = n * 2 > ncpus ? ncpus : n * 2;
+	}
+
+	sem_destroy(lockb_donesem);
+	sem_destroy(lockb_startsem);
+	lock_destroy(lockb_lock);
+	kprintf("Adaptive lock benchmark done.\n");
+	return 0;
+}
+
+/* Seconds the spinlock benchmark runs. */
+#define SPINB_SECS		2
+/* Spin iterations inside and outside the spinlock. */
+#define SPINB_INSIDE		10
+#define SPINB_OUTSIDE		10
+
+static struct spinlock spinb_lock = SPINLOCK_INITIALIZER;
+static struct semaphore *spinb_startsem;
+static struct semaphore *spinb_donesem;
+static volatile bool spinb_stop;
+static volatile unsigned spinb_shared;
+static unsigned spinb_ops[CPUMASK_BITS];
+
+/*
+ * A spinlock worker, forked bound to cpu NUM, hammers the shared
+ * spinlock, holding it very briefly each time.
+ */
+static
+void
+spinb_worker(void *junk, unsigned long num)
+{
+	unsigned ops = 0;
+
+	(void)junk;
+
+	P(spinb_startsem);
+	while (!spinb_stop) {
+		spinlock_acquire(&spinb_lock);
+		spinb_shared++;
+		busy_loop(SPINB_INSIDE);
+		spinlock_release(&spinb_lock);
+		busy_loop(SPINB_OUTSIDE);
+		ops++;
+	}
+	spinb_ops[num] = ops;
+	V(spinb_donesem);
+}
+
+/*
+ * Spinlock contention benchmark.
+ *
+ * Usage: sb6
+ *
+ * Runs one worker bound to each cpu, all taking the same spinlock as
+ * fast as they can for SPINB_SECS seconds, and prints how many times
+ * each cpu got it, the total rate, and the spread between the luckiest
+ * and unluckiest cpu. With FIFO spinlocks the spread should be small.
+ */
+int
+spinbench(int nargs, char **args)
+{
+	time_t secs;
+	uint32_t nsecs, us;
+	uint64_t ops;
+	unsigned ncpus, i, min, max;
+	int result;
+
+	(void)args;
+
+	if (nargs > 1) {
+		kprintf("Usage: sb6\n");
+		return EINVAL;
+	}
+	ncpus = cpu_count();
+
+	spinb_startsem = sem_create("spinb_startsem", 0);
+	if (spinb_startsem == NULL) {
+		panic("spinbench: sem_create failed\n");
+	}
+	spinb_donesem = sem_create("spinb_donesem", 0);
+	if (spinb_donesem == NULL) {
+		panic("spinbench: sem_create failed\n");
+	}
+
+	kprintf("Starting spinlock contention benchmark (%u cpus, %u s)...\n",
+		ncpus, SPINB_SECS);
+
+	spinb_stop = false;
+	spinb_shared = 0;
+	for (i=0; i<ncpus; i++) {
+		result = thread_fork_affinity("spinb_worker", NULL,
+					      CPUMASK_BIT(i), spinb_worker,
+					      NULL, i);
+		if (result) {
+			panic("spinbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	gettime(&secs, &nsecs);
+	for (i=0; i<ncpus; i++) {
+		V(spinb_startsem);
+	}
+	clocksleep(SPINB_SECS);
+	spinb_stop = true;
+	us = usecs_since(secs, nsecs);
+	for (i=0; i<ncpus; i++) {
+		P(spinb_donesem);
+	}
+
+	ops = 0;
+	min = max = spinb_ops[0];
+	for (i=0; i<ncpus; i++) {
+		kprintf("cpu %2u: %u acquisitions\n", i, spinb_ops[i]);
+		ops += spinb_ops[i];
+		if (spinb_ops[i] < min) {
+			min = spinb_ops[i];
+		}
+		if (spinb_ops[i] > max) {
+			max = spinb_ops[i];
+		}
+	}
+	if (ops != spinb_shared) {
+		kprintf("spinbench: spinlock lost updates (%u vs %u)\n",
+			(unsigned)ops, spinb_shared);
+	}
+	kprintf("total: %u acquisitions/sec; fewest %u, most %u per cpu\n",
+		us ? (uint32_t)(ops * 1000000 / us) : 0, min, max);
+
+	sem_destroy(spinb_donesem);
+	sem_destroy(spinb_startsem);
+	kprintf("Spinlock contention benchmark done.\n");
+	return 0;
+}
+
+/* Most consumers cvbench will run, and how many by default. */
+#define CVB_MAXCONSUMERS	32
+#define CVB_DEFCONSUMERS	16
+/* Seconds each run lasts. */
+#define CVB_SECS		1
+/* Spin iterations a consumer spends on each item. */
+#define CVB_WORK		100
+
+static struct lock *cvb_lock;
+static struct cv *cvb_ready;
+static struct cv *cvb_empty;
+static struct semaphore *cvb_donesem;
+static volatile bool cvb_stop;
+static unsigned cvb_batch;
+/* Protected by cvb_lock. */
+static unsigned cvb_items;
+static unsigned cvb_consumed;
+
+/*
+ * The producer waits for the buffer to empty, refills it with a
+ * batch of one item per consumer, and wakes every consumer.
+ */
+static
+void
+cvb_producer(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	lock_acquire(cvb_lock);
+	while (!cvb_stop) {
+		if (cvb_items > 0) {
+			cv_wait(cvb_empty, cvb_lock);
+			continue;
+		}
+		cvb_items = cvb_batch;
+		cv_broadcast(cvb_ready, cvb_lock);
+	}
+	lock_release(cvb_lock);
+	V(cvb_donesem);
+}
+
+/*
+ * A consumer takes one item at a time, working on it outside the
+ * lock, and tells the producer when it takes the last one.
+ */
+static
+void
+cvb_consumer(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	lock_acquire(cvb_lock);
+	while (!cvb_stop) {
+		if (cvb_items == 0) {
+			cv_wait(cvb_ready, cvb_lock);
+			continue;
+		}
+		cvb_items--;
+		cvb_consumed++;
+		if (cvb_items == 0) {
+			cv_signal(cvb_empty, cvb_lock);
+		}
+		lock_release(cvb_lock);
+		busy_loop(CVB_WORK);
+		lock_acquire(cvb_lock);
+	}
+	lock_release(cvb_lock);
+	V(cvb_donesem);
+}
+
+/*
+ * Run the producer and NCONSUMERS consumers for CVB_SECS seconds with
+ * cv_waitmorph set to MORPH, and print the items consumed per second
+ * and the context switches per thousand items.
+ */
+static
+void
+cvb_run(unsigned nconsumers, unsigned morph)
+{
+	time_t secs;
+	uint32_t nsecs, us;
+	unsigned i, switches, saved;
+	int result;
+
+	saved = cv_waitmorph;
+	cv_waitmorph = morph;
+	cvb_stop = false;
+	cvb_batch = nconsumers;
+	cvb_items = 0;
+	cvb_consumed = 0;
+
+	switches = lockb_switches();
+	gettime(&secs, &nsecs);
+	result = thread_fork("cvb_producer", NULL, cvb_producer, NULL, 0);
+	if (result) {
+		panic("cvbench: thread_fork failed: %s\n", strerror(result));
+	}
+	for (i=0; i<nconsumers; i++) {
+		result = thread_fork("cvb_consumer", NULL, cvb_consumer,
+				     NULL, i);
+		if (result) {
+			panic("cvbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	clocksleep(CVB_SECS);
+
+	lock_acquire(cvb_lock);
+	cvb_stop = true;
+	cv_broadcast(cvb_ready, cvb_lock);
+	cv_broadcast(cvb_empty, cvb_lock);
+	lock_release(cvb_lock);
+	us = usecs_since(secs, nsecs);
+	switches = lockb_switches() - switches;
+	for (i=0; i<nconsumers + 1; i++) {
+		P(cvb_donesem);
+	}
+	cv_waitmorph = saved;
+
+	kprintf("morph %s %8u items/sec, %6u switches per 1000 items\n",
+		morph ? "on: " : "off:",
+		us ? (uint32_t)((uint64_t)cvb_consumed * 1000000 / us) : 0,
+		cvb_consumed ?
+		(uint32_t)((uint64_t)switches * 1000 / cvb_consumed) : 0);
+}
+
+/*
+ * Condition variable broadcast benchmark.
+ *
+ * Usage: sb7 [consumers]
+ *
+ * One producer hands out batches of items to a crowd of consumers,
+ * waking them all with cv_broadcast for each batch. Runs once without
+ * wait morphing, where all but one of the woken consumers immediately
+ * block again on the lock, and once with it, and prints the
+ * throughput and context switches of each.
+ */
+int
+cvbench(int nargs, char **args)
+{
+	unsigned nconsumers;
+
+	nconsumers = CVB_DEFCONSUMERS;
+	if (nargs > 2) {
+		kprintf("Usage: sb7 [consumers]\n");
+		return EINVAL;
+	}
+	if (nargs > 1) {
+		nconsumers = atoi(args[1]);
+	}
+	if (nconsumers < 1 || nconsumers > CVB_MAXCONSUMERS) {
+		kprintf("sb7: 1 to %u consumers\n", CVB_MAXCONSUMERS);
+		return EINVAL;
+	}
+
+	cvb_lock = lock_create("cvb_lock");
+	if (cvb_lock == NULL) {
+		panic("cvbench: lock_create failed\n");
+	}
+	cvb_ready = cv_create("cvb_ready");
+	if (cvb_ready == NULL) {
+		panic("cvbench: cv_create failed\n");
+	}
+	cvb_empty = cv_create("cvb_empty");
+	if (cvb_empty == NULL) {
+		panic("cvbench: cv_create failed\n");
+	}
+	cvb_donesem = sem_create("cvb_donesem", 0);
+	if (cvb_donesem == NULL) {
+		panic("cvbench: sem_create failed\n");
+	}
+
+	kprintf("Starting CV broadcast benchmark (%u consumers, %u s each)"
+		"...\n", nconsumers, CVB_SECS);
+	cvb_run(nconsumers, 0);
+	cvb_run(nconsumers, 1);
+
+	sem_destroy(cvb_donesem);
+	cv_destroy(cvb_empty);
+	cv_destroy(cvb_ready);
+	lock_destroy(cvb_lock);
+	kprintf("CV broadcast benchmark done.\n");
+	return 0;
+}
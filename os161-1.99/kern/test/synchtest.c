@@ -32,9 +32,12 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <clock.h>
+#include <cpu.h>
 #include <thread.h>
+#include <current.h>
 #include <synch.h>
 #include <test.h>
 
@@ -58,6 +61,9 @@ static struct cv *testcv;
 static struct semaphore *donesem;
 #endif
 
+/* Counted down by each test thread as it finishes; made fresh per run. */
+static struct latch *donelatch;
+
 #ifdef UW
 static
 void
@@ -105,6 +111,31 @@ inititems(void)
 	}
 }
 
+/*
+ * Set up donelatch for N threads.
+ */
+static
+void
+donelatch_start(unsigned n)
+{
+	donelatch = latch_create("donelatch", n);
+	if (donelatch == NULL) {
+		panic("synchtest: latch_create failed\n");
+	}
+}
+
+/*
+ * Wait for the threads counting down donelatch, and dispose of it.
+ */
+static
+void
+donelatch_wait(void)
+{
+	latch_wait(donelatch);
+	latch_destroy(donelatch);
+	donelatch = NULL;
+}
+
 static
 void
 semtestthread(void *junk, unsigned long num)
@@ -166,6 +197,167 @@ semtest(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Semaphore benchmark.
+ *
+ * NTHREADS threads, as in semtest, go through a semaphore with a
+ * count of one over and over for SB_SECS seconds, holding it very
+ * briefly. Each time, a thread records how long it waited in P in a
+ * histogram, which it can update safely since it's inside the
+ * semaphore. This is run with sem_fifo off and then on, and reports
+ * the P/V throughput and the median and 99th percentile waits. Without
+ * FIFO order, a waiter that's woken can find a newcomer has taken the
+ * count ahead of it and have to go back to sleep, which shows up in
+ * the tail.
+ *
+ * Histogram buckets split each power of two of microseconds into
+ * eight, so each bucket is within an eighth of its value. Waits of
+ * 2^SB_MAXPOW us or more all go in the last bucket.
+ */
+
+#define SB_SECS		2
+#define SB_HOLDLOOPS	20
+#define SB_MAXPOW	24
+#define SB_BUCKETS	((SB_MAXPOW - 2) * 8)
+
+static struct semaphore *sbsem;
+static volatile bool sb_stop;
+static unsigned sb_hist[SB_BUCKETS];
+static unsigned sb_ops;
+
+static
+unsigned
+sb_bucket(uint32_t us)
+{
+	unsigned p;
+
+	if (us < 8) {
+		return us;
+	}
+	for (p = 3; p < SB_MAXPOW && (us >> (p + 1)) != 0; p++) {
+		/* nothing */
+	}
+	if (p == SB_MAXPOW) {
+		return SB_BUCKETS - 1;
+	}
+	return (p - 2) * 8 + ((us >> (p - 3)) & 7);
+}
+
+/* Smallest wait, in microseconds, that goes in bucket B. */
+static
+uint32_t
+sb_bucketmin(unsigned b)
+{
+	if (b < 8) {
+		return b;
+	}
+	return (uint32_t)(8 + b % 8) << (b / 8 - 1);
+}
+
+/* Smallest wait at or above which PCT percent of the waits fall. */
+static
+uint32_t
+sb_percentile(unsigned pct)
+{
+	unsigned b, seen, want;
+
+	want = (uint32_t)(((uint64_t)sb_ops * pct + 99) / 100);
+	seen = 0;
+	for (b = 0; b < SB_BUCKETS; b++) {
+		seen += sb_hist[b];
+		if (seen >= want) {
+			return sb_bucketmin(b);
+		}
+	}
+	return sb_bucketmin(SB_BUCKETS - 1);
+}
+
+static
+void
+sbthread(void *junk, unsigned long num)
+{
+	time_t secs1, secs2;
+	uint32_t nsecs1, nsecs2;
+	volatile unsigned j;
+
+	(void)junk;
+	(void)num;
+
+	while (!sb_stop) {
+		gettime(&secs1, &nsecs1);
+		P(sbsem);
+		gettime(&secs2, &nsecs2);
+		sb_hist[sb_bucket(usecs_between(secs1, nsecs1,
+						secs2, nsecs2))]++;
+		sb_ops++;
+		for (j=0; j<SB_HOLDLOOPS; j++);
+		V(sbsem);
+	}
+	latch_countdown(donelatch);
+}
+
+static
+void
+sb_run(unsigned fifo)
+{
+	time_t secs1, secs2;
+	uint32_t nsecs1, nsecs2, us;
+	unsigned saved, i;
+	int result;
+
+	saved = sem_fifo;
+	sem_fifo = fifo;
+	sb_stop = false;
+	sb_ops = 0;
+	for (i=0; i<SB_BUCKETS; i++) {
+		sb_hist[i] = 0;
+	}
+
+	donelatch_start(NTHREADS);
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("sbthread", NULL, sbthread, NULL, i);
+		if (result) {
+			panic("sembench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	clocksleep(SB_SECS);
+	sb_stop = true;
+	gettime(&secs2, &nsecs2);
+	donelatch_wait();
+	us = usecs_between(secs1, nsecs1, secs2, nsecs2);
+
+	kprintf("fifo %s: %u P/V per sec, wait p50 %u us, p99 %u us\n",
+		fifo ? "on: " : "off:",
+		us ? (uint32_t)((uint64_t)sb_ops * 1000000 / us) : 0,
+		sb_percentile(50), sb_percentile(99));
+
+	sem_fifo = saved;
+}
+
+int
+sembench(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	sbsem = sem_create("sbsem", 1);
+	if (sbsem == NULL) {
+		panic("sembench: sem_create failed\n");
+	}
+
+	kprintf("Starting semaphore benchmark (%d threads, %u s each)...\n",
+		NTHREADS, SB_SECS);
+	sb_run(0);
+	sb_run(1);
+
+	sem_destroy(sbsem);
+	kprintf("Semaphore benchmark done.\n");
+	return 0;
+}
+
 static
 void
 fail(unsigned long num, const char *msg)
@@ -175,7 +367,7 @@ fail(unsigned long num, const char *msg)
 
 	lock_release(testlock);
 
-	V(donesem);
+	latch_countdown(donelatch);
 	thread_exit();
 }
 
@@ -218,7 +410,7 @@ locktestthread(void *junk, unsigned long num)
 
 		lock_release(testlock);
 	}
-	V(donesem);
+	latch_countdown(donelatch);
 #ifdef UW
   thread_exit();
 #endif
@@ -228,6 +420,8 @@ locktestthread(void *junk, unsigned long num)
 int
 locktest(int nargs, char **args)
 {
+	time_t secs1, secs2;
+	uint32_t nsecs1, nsecs2;
 	int i, result;
 
 	(void)nargs;
@@ -236,6 +430,11 @@ locktest(int nargs, char **args)
 	inititems();
 	kprintf("Starting lock test...\n");
 
+	donelatch_start(NTHREADS);
+
+	/* Timed, to compare runs with and without lock_handoff. */
+	gettime(&secs1, &nsecs1);
+
 	for (i=0; i<NTHREADS; i++) {
 		result = thread_fork("synchtest", NULL, locktestthread,
 				     NULL, i);
@@ -244,14 +443,15 @@ locktest(int nargs, char **args)
 			      strerror(result));
 		}
 	}
-	for (i=0; i<NTHREADS; i++) {
-		P(donesem);
-	}
+	donelatch_wait();
+	gettime(&secs2, &nsecs2);
 
 #ifdef UW
   cleanitems();
 #endif
-	kprintf("Lock test done.\n");
+	kprintf("Lock test done (%d threads, lock_handoff %u): %u us\n",
+		NTHREADS, lock_handoff,
+		usecs_between(secs1, nsecs1, secs2, nsecs2));
 
 	return 0;
 }
@@ -287,7 +487,7 @@ cvtestthread(void *junk, unsigned long num)
 				kprintf("cv_wait took only %u ns\n", nsecs2);
 				kprintf("That's too fast... you must be "
 					"busy-looping\n");
-				V(donesem);
+				latch_countdown(donelatch);
 				thread_exit();
 			}
 
@@ -304,7 +504,7 @@ cvtestthread(void *junk, unsigned long num)
 		cv_broadcast(testcv, testlock);
 		lock_release(testlock);
 	}
-	V(donesem);
+	latch_countdown(donelatch);
 #ifdef UW
   thread_exit();
 #endif
@@ -328,6 +528,7 @@ cvtest(int nargs, char **args)
 #endif
 
 	testval1 = NTHREADS-1;
+	donelatch_start(NTHREADS);
 
 	for (i=0; i<NTHREADS; i++) {
 		result = thread_fork("synchtest", NULL, cvtestthread, NULL, i);
@@ -336,9 +537,7 @@ cvtest(int nargs, char **args)
 			      strerror(result));
 		}
 	}
-	for (i=0; i<NTHREADS; i++) {
-		P(donesem);
-	}
+	donelatch_wait();
 
 #ifdef UW
   cleanitems();
@@ -347,3 +546,684 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Priority inversion test.
+ *
+ * A "low" thread is a CPU hog that holds pilock for long stretches.
+ * A "high" thread sleeps most of the time; each time low takes the
+ * lock it pokes high, which then blocks on the lock. Meanwhile a
+ * bunch of "medium" compute threads compete for the cpu. Under MLFQ
+ * low and the mediums all sink to the bottom level, so without
+ * inheritance low gets the cpu only its round-robin share of the time
+ * and high's wait grows with the number of mediums. With inheritance
+ * low runs at high's level until it lets go.
+ *
+ * We run the whole thing once with inheritance off and once with it
+ * on, and report high's worst and average wait in lock_acquire.
+ */
+
+#define PI_ROUNDS	20
+#define PI_HOLDLOOPS	200000
+
+static struct lock *pilock;
+static struct semaphore *pipoke;
+static struct latch *pidone;		/* low and high */
+static volatile int pi_mediums_done;
+static uint32_t pi_maxwait_us, pi_totalwait_us;
+
+static
+void
+pi_low(void *junk, unsigned long num)
+{
+	volatile int j;
+	int i;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<PI_ROUNDS; i++) {
+		lock_acquire(pilock);
+		V(pipoke);
+		for (j=0; j<PI_HOLDLOOPS; j++);
+		lock_release(pilock);
+		thread_yield();
+	}
+	latch_countdown(pidone);
+}
+
+static
+void
+pi_high(void *junk, unsigned long num)
+{
+	time_t secs1, secs2;
+	uint32_t nsecs1, nsecs2, us;
+	int i;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<PI_ROUNDS; i++) {
+		P(pipoke);
+		gettime(&secs1, &nsecs1);
+		lock_acquire(pilock);
+		gettime(&secs2, &nsecs2);
+		lock_release(pilock);
+
+		us = usecs_between(secs1, nsecs1, secs2, nsecs2);
+		pi_totalwait_us += us;
+		if (us > pi_maxwait_us) {
+			pi_maxwait_us = us;
+		}
+	}
+	latch_countdown(pidone);
+}
+
+static
+void
+pi_medium(void *junk, unsigned long num)
+{
+	volatile unsigned long spin = 0;
+
+	(void)junk;
+	(void)num;
+
+	while (!pi_mediums_done) {
+		spin++;
+	}
+	latch_countdown(donelatch);
+}
+
+static
+void
+pi_run(unsigned inherit, unsigned nmediums)
+{
+	unsigned saved, i;
+	int result;
+
+	saved = lock_inherit_priority;
+	lock_inherit_priority = inherit;
+	pi_mediums_done = 0;
+	pi_maxwait_us = 0;
+	pi_totalwait_us = 0;
+	pidone = latch_create("pidone", 2);
+	if (pidone == NULL) {
+		panic("pitest: latch_create failed\n");
+	}
+	donelatch_start(nmediums);
+
+	for (i=0; i<nmediums; i++) {
+		result = thread_fork("pi_medium", NULL, pi_medium, NULL, i);
+		if (result) {
+			panic("pitest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	result = thread_fork("pi_low", NULL, pi_low, NULL, 0);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+	result = thread_fork("pi_high", NULL, pi_high, NULL, 0);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+
+	latch_wait(pidone);
+	latch_destroy(pidone);
+	pi_mediums_done = 1;
+	donelatch_wait();
+
+	kprintf("inheritance %s: high waited at most %u us, "
+		"average %u us\n", inherit ? "on " : "off",
+		pi_maxwait_us, pi_totalwait_us / PI_ROUNDS);
+
+	lock_inherit_priority = saved;
+}
+
+int
+pitest(int nargs, char **args)
+{
+	unsigned nmediums = 8;
+
+	if (nargs == 2) {
+		nmediums = atoi(args[1]);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: sy4 [mediumthreads]\n");
+		return EINVAL;
+	}
+
+	pilock = lock_create("pilock");
+	pipoke = sem_create("pipoke", 0);
+	if (pilock == NULL || pipoke == NULL) {
+		panic("pitest: out of memory\n");
+	}
+
+	kprintf("Starting priority inversion test (%u mediums, "
+		"policy %s)...\n", nmediums,
+		sched_policynames[sched_policy]);
+	pi_run(0, nmediums);
+	pi_run(1, nmediums);
+
+	sem_destroy(pipoke);
+	lock_destroy(pilock);
+	kprintf("Priority inversion test done.\n");
+	return 0;
+}
+
+/*
+ * Reader-writer lock test.
+ *
+ * Readers take the lock shared over and over and check that the test
+ * values are consistent, which they only are between writes. A single
+ * writer keeps changing them, taking the lock either exclusive or by
+ * upgrading a shared hold, and after some writes downgrades and checks
+ * its own work as a reader. Since the writer changes the values one
+ * at a time with pauses in between, a reader that got in at the wrong
+ * time would see a mismatch.
+ *
+ * We run this with 1, 2, 4, ... NTHREADS readers for RW_SECS seconds
+ * each and report the read throughput, how it scales against one
+ * reader, and how many writes got through (writer preference should
+ * keep that from collapsing as readers are added).
+ */
+
+#define RW_SECS		1
+#define RW_READLOOPS	50
+#define RW_WRITELOOPS	50
+#define RW_WRITEGAP	2000
+
+static struct rwlock *rwlk;
+static volatile bool rw_stop;
+static volatile unsigned rw_errors;
+static unsigned rw_reads[NTHREADS];
+static unsigned rw_writes, rw_upgrades;
+
+/*
+ * Check the test values; the caller holds rwlk in some mode.
+ */
+static
+void
+rw_check(unsigned long num)
+{
+	if (testval2 != testval1*testval1 || testval3 != testval1%3) {
+		kprintf("thread %lu: rwlock test values inconsistent\n", num);
+		rw_errors++;
+	}
+}
+
+static
+void
+rw_reader(void *junk, unsigned long num)
+{
+	unsigned reads = 0;
+
+	(void)junk;
+
+	while (!rw_stop) {
+		rwlock_acquire_read(rwlk);
+		rw_check(num);
+		busy_loop(RW_READLOOPS);
+		rw_check(num);
+		rwlock_release_read(rwlk);
+		reads++;
+	}
+	rw_reads[num] = reads;
+	latch_countdown(donelatch);
+}
+
+/*
+ * Change the test values one at a time; the caller holds rwlk
+ * exclusive.
+ */
+static
+void
+rw_write(unsigned long val)
+{
+	KASSERT(rwlock_do_i_hold_write(rwlk));
+	testval1 = val;
+	busy_loop(RW_WRITELOOPS);
+	testval2 = val*val;
+	busy_loop(RW_WRITELOOPS);
+	testval3 = val%3;
+}
+
+static
+void
+rw_writer(void *junk, unsigned long num)
+{
+	unsigned long val;
+
+	(void)junk;
+
+	rw_writes = rw_upgrades = 0;
+	for (val = 1; !rw_stop; val++) {
+		if (val % 2 == 0) {
+			rwlock_acquire_write(rwlk);
+			rw_write(val);
+			rwlock_release_write(rwlk);
+		}
+		else {
+			rwlock_acquire_read(rwlk);
+			rw_check(num);
+			if (rwlock_upgrade(rwlk)) {
+				rw_upgrades++;
+			}
+			else {
+				rwlock_release_read(rwlk);
+				rwlock_acquire_write(rwlk);
+			}
+			rw_write(val);
+			rwlock_downgrade(rwlk);
+			rw_check(num);
+			rwlock_release_read(rwlk);
+		}
+		rw_writes++;
+		busy_loop(RW_WRITEGAP);
+	}
+	latch_countdown(donelatch);
+}
+
+/*
+ * One run with NREADERS readers; returns their reads per second.
+ * BASE is the rate with one reader, or 0 if this is that run.
+ */
+static
+uint32_t
+rw_run(unsigned nreaders, uint32_t base)
+{
+	time_t secs1, secs2;
+	uint32_t nsecs1, nsecs2, us, rate;
+	uint64_t reads;
+	unsigned i;
+	int result;
+
+	rw_stop = false;
+	testval1 = testval2 = testval3 = 0;
+	donelatch_start(nreaders + 1);
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<nreaders; i++) {
+		result = thread_fork("rw_reader", NULL, rw_reader, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	result = thread_fork("rw_writer", NULL, rw_writer, NULL, nreaders);
+	if (result) {
+		panic("rwtest: thread_fork failed: %s\n", strerror(result));
+	}
+
+	clocksleep(RW_SECS);
+	rw_stop = true;
+	gettime(&secs2, &nsecs2);
+	donelatch_wait();
+	us = usecs_between(secs1, nsecs1, secs2, nsecs2);
+
+	reads = 0;
+	for (i=0; i<nreaders; i++) {
+		reads += rw_reads[i];
+	}
+	rate = us ? (uint32_t)(reads * 1000000 / us) : 0;
+	if (base == 0) {
+		base = rate;
+	}
+	kprintf("%7u %10u %4u.%u%u %8u %8u\n", nreaders, rate,
+		base ? rate / base : 0,
+		base ? rate * 10 / base % 10 : 0,
+		base ? rate * 100 / base % 10 : 0,
+		rw_writes, rw_upgrades);
+	if (rw_writes == 0) {
+		kprintf("rwtest: writer starved\n");
+		rw_errors++;
+	}
+	return rate;
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	unsigned nreaders;
+	uint32_t base, rate;
+
+	(void)nargs;
+	(void)args;
+
+	rwlk = rwlock_create("rwlk");
+	if (rwlk == NULL) {
+		panic("rwtest: rwlock_create failed\n");
+	}
+
+	kprintf("Starting rwlock test (%u s per run)...\n", RW_SECS);
+	kprintf("%7s %10s %7s %8s %8s\n", "readers", "reads/s", "scale",
+		"writes", "upgrades");
+	rw_errors = 0;
+	base = 0;
+	for (nreaders = 1; nreaders <= NTHREADS; nreaders *= 2) {
+		rate = rw_run(nreaders, base);
+		if (base == 0) {
+			base = rate;
+		}
+	}
+
+	rwlock_destroy(rwlk);
+	if (rw_errors > 0) {
+		kprintf("Test failed: %u errors\n", rw_errors);
+	}
+	kprintf("Rwlock test done.\n");
+	return 0;
+}
+
+/*
+ * Futex test.
+ *
+ * First, FT_PAIRS pairs of threads, the two of each pair bound to
+ * different cpus where there's more than one, pass a turn back and
+ * forth through a futex word FT_ROUNDS times: each sets the word to
+ * the other's number and wakes it, then waits for the word to come
+ * back. The store and the wake race with the other thread checking
+ * the word and going to sleep, so a lost wakeup hangs the test.
+ *
+ * Then NTHREADS threads, spread over the cpus, wait on a gate word
+ * while the main thread opens it FT_GENS times, checking that
+ * futex_wake on another word in between wakes nobody.
+ *
+ * Every futex_wait that returns 0 was woken by exactly one
+ * futex_wake, so in both parts the sleeps have to match the wakeups
+ * futex_wake reported.
+ */
+
+#define FT_PAIRS	8
+#define FT_ROUNDS	1000
+#define FT_GENS		50
+
+static struct spinlock ft_spin = SPINLOCK_INITIALIZER;
+static volatile int ft_turn[FT_PAIRS];
+static volatile int ft_gate;
+static volatile int ft_other;
+static volatile unsigned ft_arrived;
+static unsigned ft_sleeps[NTHREADS];
+static unsigned ft_eagains[NTHREADS];
+static unsigned ft_wakes[NTHREADS];
+static volatile unsigned ft_errors;
+
+/*
+ * Wait until *WORD isn't OLD, counting what futex_wait did.
+ */
+static
+void
+ft_waitchange(volatile int *word, int old, unsigned num)
+{
+	int result;
+
+	while (*word == old) {
+		result = futex_wait(NULL, (vaddr_t)word, old);
+		if (result == 0) {
+			ft_sleeps[num]++;
+		}
+		else if (result == EAGAIN) {
+			ft_eagains[num]++;
+		}
+		else {
+			kprintf("futextest: futex_wait: %s\n",
+				strerror(result));
+			ft_errors++;
+			return;
+		}
+	}
+}
+
+static
+void
+ftpingpong(void *junk, unsigned long num)
+{
+	unsigned pair, side, i;
+
+	(void)junk;
+
+	pair = num / 2;
+	side = num % 2;
+
+	for (i=0; i<FT_ROUNDS; i++) {
+		ft_waitchange(&ft_turn[pair], !side, num);
+		ft_turn[pair] = !side;
+		ft_wakes[num] += futex_wake(NULL, (vaddr_t)&ft_turn[pair], 1);
+	}
+	latch_countdown(donelatch);
+}
+
+static
+void
+ftgate(void *junk, unsigned long num)
+{
+	int gen;
+
+	(void)junk;
+
+	for (gen=0; gen<FT_GENS; gen++) {
+		spinlock_acquire(&ft_spin);
+		ft_arrived++;
+		spinlock_release(&ft_spin);
+		ft_waitchange(&ft_gate, gen, num);
+	}
+	latch_countdown(donelatch);
+}
+
+int
+futextest(int nargs, char **args)
+{
+	time_t secs;
+	uint32_t nsecs, us;
+	unsigned i, ncpus, sleeps, eagains, wakes, woken;
+	int gen, result;
+
+	(void)nargs;
+	(void)args;
+
+	ncpus = cpu_count();
+	ft_errors = 0;
+	for (i=0; i<NTHREADS; i++) {
+		ft_sleeps[i] = ft_eagains[i] = ft_wakes[i] = 0;
+	}
+
+	kprintf("Starting futex test (%u cpus)...\n", ncpus);
+
+	ft_other = 0;
+	result = futex_wait(NULL, (vaddr_t)&ft_other, 1);
+	if (result != EAGAIN) {
+		kprintf("futextest: stale futex_wait returned %d\n", result);
+		ft_errors++;
+	}
+	result = futex_wait(NULL, (vaddr_t)&ft_other + 1, 0);
+	if (result != EINVAL) {
+		kprintf("futextest: misaligned futex_wait returned %d\n",
+			result);
+		ft_errors++;
+	}
+
+	donelatch_start(FT_PAIRS * 2);
+	gettime(&secs, &nsecs);
+	for (i=0; i<FT_PAIRS; i++) {
+		ft_turn[i] = 0;
+	}
+	for (i=0; i<FT_PAIRS * 2; i++) {
+		result = thread_fork_affinity("ftpingpong", NULL,
+					      CPUMASK_BIT(i % ncpus),
+					      ftpingpong, NULL, i);
+		if (result) {
+			panic("futextest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	donelatch_wait();
+	us = usecs_since(secs, nsecs);
+
+	sleeps = eagains = wakes = 0;
+	for (i=0; i<FT_PAIRS * 2; i++) {
+		sleeps += ft_sleeps[i];
+		eagains += ft_eagains[i];
+		wakes += ft_wakes[i];
+		ft_sleeps[i] = ft_eagains[i] = 0;
+	}
+	kprintf("ping-pong: %u handoffs/sec; %u sleeps, %u wakeups, "
+		"%u lost races\n",
+		us ? (uint32_t)((uint64_t)FT_PAIRS * 2 * FT_ROUNDS *
+				1000000 / us) : 0,
+		sleeps, wakes, eagains);
+	if (sleeps != wakes) {
+		kprintf("futextest: ping-pong sleeps and wakeups differ\n");
+		ft_errors++;
+	}
+
+	ft_gate = 0;
+	ft_arrived = 0;
+	wakes = 0;
+	donelatch_start(NTHREADS);
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork_affinity("ftgate", NULL,
+					      CPUMASK_BIT(i % ncpus),
+					      ftgate, NULL, i);
+		if (result) {
+			panic("futextest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (gen=0; gen<FT_GENS; gen++) {
+		while (ft_arrived < NTHREADS * (unsigned)(gen + 1)) {
+			thread_yield();
+		}
+		woken = futex_wake(NULL, (vaddr_t)&ft_other, NTHREADS);
+		if (woken != 0) {
+			kprintf("futextest: woke %u on an idle word\n", woken);
+			ft_errors++;
+		}
+		ft_gate = gen + 1;
+		wakes += futex_wake(NULL, (vaddr_t)&ft_gate, NTHREADS);
+	}
+	donelatch_wait();
+
+	sleeps = eagains = 0;
+	for (i=0; i<NTHREADS; i++) {
+		sleeps += ft_sleeps[i];
+		eagains += ft_eagains[i];
+	}
+	kprintf("gate: %u threads through %u openings; %u sleeps, "
+		"%u wakeups, %u lost races\n", NTHREADS, FT_GENS, sleeps,
+		wakes, eagains);
+	if (sleeps != wakes) {
+		kprintf("futextest: gate sleeps and wakeups differ\n");
+		ft_errors++;
+	}
+
+	if (ft_errors > 0) {
+		kprintf("Test failed: %u errors\n", ft_errors);
+	}
+	kprintf("Futex test done.\n");
+	return 0;
+}
+
+/*
+ * Barrier test.
+ *
+ * NTHREADS threads, spread over the cpus, go through a barrier
+ * BT_ROUNDS times. Before each round's barrier_wait, each adds itself
+ * to that round's arrival count; after it, each checks that everybody
+ * arrived, which fails if anyone got through early. Exactly one
+ * thread per round should get true back from barrier_wait. Threads
+ * let go first race into the next round while others are still
+ * waking from the last, which is what the generation count is for.
+ */
+
+#define BT_ROUNDS	200
+
+static struct barrier *btbar;
+static struct spinlock bt_spin = SPINLOCK_INITIALIZER;
+static unsigned bt_arrived[BT_ROUNDS];
+static unsigned bt_last[BT_ROUNDS];
+static volatile unsigned bt_errors;
+
+static
+void
+btthread(void *junk, unsigned long num)
+{
+	unsigned round;
+	bool last;
+
+	(void)junk;
+
+	for (round=0; round<BT_ROUNDS; round++) {
+		spinlock_acquire(&bt_spin);
+		bt_arrived[round]++;
+		spinlock_release(&bt_spin);
+
+		last = barrier_wait(btbar);
+
+		spinlock_acquire(&bt_spin);
+		if (bt_arrived[round] != NTHREADS) {
+			kprintf("thread %lu: round %u let go with %u of %u "
+				"arrived\n", num, round, bt_arrived[round],
+				NTHREADS);
+			bt_errors++;
+		}
+		if (last) {
+			bt_last[round]++;
+		}
+		spinlock_release(&bt_spin);
+	}
+	latch_countdown(donelatch);
+}
+
+int
+barriertest(int nargs, char **args)
+{
+	time_t secs;
+	uint32_t nsecs, us;
+	unsigned i, ncpus;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	ncpus = cpu_count();
+	btbar = barrier_create("btbar", NTHREADS);
+	if (btbar == NULL) {
+		panic("barriertest: barrier_create failed\n");
+	}
+	bt_errors = 0;
+	for (i=0; i<BT_ROUNDS; i++) {
+		bt_arrived[i] = bt_last[i] = 0;
+	}
+
+	kprintf("Starting barrier test (%d threads, %u rounds)...\n",
+		NTHREADS, BT_ROUNDS);
+	donelatch_start(NTHREADS);
+	gettime(&secs, &nsecs);
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork_affinity("btthread", NULL,
+					      CPUMASK_BIT(i % ncpus),
+					      btthread, NULL, i);
+		if (result) {
+			panic("barriertest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	donelatch_wait();
+	us = usecs_since(secs, nsecs);
+
+	for (i=0; i<BT_ROUNDS; i++) {
+		if (bt_last[i] != 1) {
+			kprintf("barriertest: round %u had %u last arrivals\n",
+				i, bt_last[i]);
+			bt_errors++;
+		}
+	}
+	barrier_destroy(btbar);
+
+	kprintf("%u rounds per sec\n",
+		us ? (uint32_t)((uint64_t)BT_ROUNDS * 1000000 / us) : 0);
+	if (bt_errors > 0) {
+		kprintf("Test failed: %u errors\n", bt_errors);
+	}
+	kprintf("Barrier test done.\n");
+	return 0;
+}
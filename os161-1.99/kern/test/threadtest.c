@@ -33,6 +33,7 @@
 #include <types.h>
 #include <lib.h>
 #include <thread.h>
+#include <proc.h>
 #include <synch.h>
 #include <test.h>
 
@@ -99,7 +100,9 @@ runthreads(int doloud)
 {
 	char name[16];
 	int i, result;
+	unsigned reloads0, elided0, reloads, elided;
 
+	curproc_asstats(&reloads0, &elided0);
 	for (i=0; i<NTHREADS; i++) {
 		snprintf(name, sizeof(name), "threadtest%d", i);
 		result = thread_fork(name, NULL,
@@ -114,6 +117,9 @@ runthreads(int doloud)
 	for (i=0; i<NTHREADS; i++) {
 		P(tsem);
 	}
+	curproc_asstats(&reloads, &elided);
+	kprintf("\nAddress space loads: %u done, %u skipped",
+		reloads - reloads0, elided - elided0);
 }
 
 
@@ -34,6 +34,7 @@
 #include <lib.h>
 #include <wchan.h>
 #include <thread.h>
+#include <proc.h>
 #include <synch.h>
 #include <test.h>
 
@@ -60,24 +61,31 @@ static struct wchan *waitchans[NWAITCHANS];  /* N distinct wait channels */
 
 static volatile int wakerdone;
 static struct semaphore *wakersem;
-static struct semaphore *donesem;
+static struct latch *donelatch;		/* sleepalots and computes */
+static struct latch *wakerlatch;
 
 static
 void
-setup(void)
+setup(int howmanytotal)
 {
 	char tmp[16];
 	int i;
 
 	if (wakersem == NULL) {
 		wakersem = sem_create("wakersem", 1);
-		donesem = sem_create("donesem", 0);
 		for (i=0; i<NWAITCHANS; i++) {
 			snprintf(tmp, sizeof(tmp), "wc%d", i);
 			waitchans[i] = wchan_create(kstrdup(tmp));
 		}
 	}
 	wakerdone = 0;
+
+	/* Latches are one-shot, so these are made new each run. */
+	donelatch = latch_create("donelatch", howmanytotal);
+	wakerlatch = latch_create("wakerlatch", 1);
+	if (donelatch == NULL || wakerlatch == NULL) {
+		panic("tt3: latch_create failed\n");
+	}
 }
 
 static
@@ -98,7 +106,7 @@ sleepalot_thread(void *junk, unsigned long num)
 		}
 		kprintf("[%lu]", num);
 	}
-	V(donesem);
+	latch_countdown(donelatch);
 }
 
 static
@@ -127,7 +135,7 @@ waker_thread(void *junk1, unsigned long junk2)
 			thread_yield();
 		}
 	}
-	V(donesem);
+	latch_countdown(wakerlatch);
 }
 
 static
@@ -204,7 +212,7 @@ compute_thread(void *junk1, unsigned long num)
 	kfree(m2);
 	kfree(m3);
 
-	V(donesem);
+	latch_countdown(donelatch);
 }
 
 static
@@ -225,30 +233,35 @@ make_computes(int howmany)
 
 static
 void
-finish(int howmanytotal)
+finish(void)
 {
-	int i;
-	for (i=0; i<howmanytotal; i++) {
-		P(donesem);
-	}
+	latch_wait(donelatch);
+	latch_destroy(donelatch);
 	P(wakersem);
 	wakerdone = 1;
 	V(wakersem);
-	P(donesem);
+	latch_wait(wakerlatch);
+	latch_destroy(wakerlatch);
 }
 
 static
 void
 runtest3(int nsleeps, int ncomputes)
 {
-	setup();
+	unsigned reloads0, elided0, reloads, elided;
+
+	setup(nsleeps+ncomputes);
 	kprintf("Starting thread test 3 (%d [sleepalots], %d {computes}, "
 		"1 waker)\n",
 		nsleeps, ncomputes);
+	curproc_asstats(&reloads0, &elided0);
 	make_sleepalots(nsleeps);
 	make_computes(ncomputes);
-	finish(nsleeps+ncomputes);
-	kprintf("\nThread test 3 done\n");
+	finish();
+	curproc_asstats(&reloads, &elided);
+	kprintf("\nAddress space loads: %u done, %u skipped\n",
+		reloads - reloads0, elided - elided0);
+	kprintf("Thread test 3 done\n");
 }
 
 int
@@ -34,6 +34,7 @@
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <rcu.h>
 
 /*
  * Time handling.
@@ -52,6 +53,12 @@
  */
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define STEAL_HARDCLOCKS	4	/* Idle cpus try stealing every 4. */
+
+/*
+ * Tickless mode; see clock.h.
+ */
+unsigned hardclock_tickless = 1;
 
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
@@ -88,20 +95,136 @@ timerclock(void)
 void
 hardclock(void)
 {
+	bool preempt;
+
 	/*
 	 * Collect statistics here as desired.
 	 */
 
 	curcpu->c_hardclocks++;
+	thread_load_tick(1);
+
+	/* Cpu 0 keeps the gang slots going even while idle. */
+	preempt = thread_gang_tick();
+
+	/* Idle or not, this may finish an RCU grace period. */
+	rcu_tick();
+
+	/*
+	 * In tickless mode an idle cpu has nothing to do here: there's
+	 * nothing to charge to anyone, nothing to migrate, and
+	 * thread_yield() would return straight away. Whoever gives it
+	 * work also sends it an IPI, so it doesn't need the tick to
+	 * notice.
+	 */
+	if (hardclock_tickless && curcpu->c_isidle) {
+		curcpu->c_idleclocks++;
+		return;
+	}
+
+	if (thread_edf_tick()) {
+		preempt = true;
+	}
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
+
+	/*
+	 * If nothing else is runnable here, yielding would only pick
+	 * this thread again, so skip the trip through thread_switch.
+	 * Peeking at the run queue without its lock is fine: anything
+	 * that shows up meanwhile gets its turn on the next tick.
+	 */
+	if (hardclock_tickless && !preempt &&
+	    runqueue_isempty(&curcpu->c_runqueue) &&
+	    !curcpu->c_inbox_pending) {
+		curcpu->c_noyieldclocks++;
+		return;
+	}
 	thread_yield();
 }
 
+/*
+ * Number of hardclocks from now until the current cpu next needs
+ * one, for timer drivers that can skip ticks; 0 means it doesn't
+ * need one at all until it's interrupted for some other reason.
+ *
+ * An idle cpu needs one every STEAL_HARDCLOCKS: it only tries to steal
+ * work (see thread_steal) when it wakes up, so without these it would
+ * sit idle beside a busy cpu's growing run queue until that cpu next
+ * considered migration. A cpu with only one runnable thread needs
+ * the next one that calls schedule() (MIGRATE_HARDCLOCKS is a
+ * multiple of SCHEDULE_HARDCLOCKS, so that covers migration too);
+ * the hardclocks in between would just skip the yield anyway. EDF
+ * threads, idle or not, need every tick to see their periods start.
+ * While there are gangs, cpu 0 needs every tick to start their slots,
+ * and busy cpus need them to take turns between gang threads. While
+ * RCU has a grace period going or calls to make, every cpu takes
+ * every tick, so the calls get made even if everyone goes idle.
+ */
+unsigned
+hardclock_nextevent(void)
+{
+	if (!hardclock_tickless) {
+		return 1;
+	}
+	if (!threadlist_isempty(&curcpu->c_edfqueue) ||
+	    curthread->t_edf_period != 0) {
+		return 1;
+	}
+	if (thread_gang_active() &&
+	    (curcpu->c_number == 0 || !curcpu->c_isidle)) {
+		return 1;
+	}
+	if (rcu_pending()) {
+		return 1;
+	}
+	if (curcpu->c_isidle) {
+		return STEAL_HARDCLOCKS -
+			(curcpu->c_hardclocks % STEAL_HARDCLOCKS);
+	}
+	if (!runqueue_isempty(&curcpu->c_runqueue) ||
+	    curcpu->c_inbox_pending) {
+		return 1;
+	}
+	return SCHEDULE_HARDCLOCKS -
+		(curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS);
+}
+
+/*
+ * Account for NCLOCKS hardclocks the timer skipped on the current
+ * cpu because hardclock_nextevent() said they weren't needed.
+ */
+void
+hardclock_skip(unsigned nclocks)
+{
+	curcpu->c_hardclocks += nclocks;
+	curcpu->c_skippedclocks += nclocks;
+	thread_load_tick(nclocks);
+}
+
+/*
+ * Print how many hardclocks each cpu took, and how many of those were
+ * avoided or cut short by tickless mode.
+ */
+void
+hardclock_printstats(void)
+{
+	struct cpu *c;
+	unsigned i;
+
+	kprintf("%4s %10s %10s %10s %10s\n", "cpu", "hardclocks",
+		"skipped", "idle", "noyield");
+	for (i=0; (c = cpu_get(i)) != NULL; i++) {
+		kprintf("%4u %10u %10u %10u %10u\n", c->c_number,
+			c->c_hardclocks, c->c_skippedclocks,
+			c->c_idleclocks, c->c_noyieldclocks);
+	}
+}
+
 /*
  * Suspend execution for n seconds.
  */
@@ -36,11 +36,37 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <current.h>	/* for curcpu */
+#include <lockstat.h>
 
 /*
  * Spinlocks.
+ *
+ * These are ticket locks; see spinlock.h. lk_next and lk_serving are
+ * accessed with spinlock_data_get and spinlock_data_set so that they
+ * get whatever memory ordering the machine needs for the lock word.
+ * They only ever wrap around together, so comparing them for equality
+ * is all that's needed.
  */
 
+/*
+ * Take the guard word, with test-test-and-set. It's held only for
+ * long enough to take a ticket.
+ */
+static
+void
+spinlock_guard_acquire(struct spinlock *lk)
+{
+	while (1) {
+		if (spinlock_data_get(&lk->lk_lock) != 0) {
+			continue;
+		}
+		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
+			continue;
+		}
+		break;
+	}
+}
+
 
 /*
  * Initialize spinlock.
@@ -49,7 +75,10 @@ void
 spinlock_init(struct spinlock *lk)
 {
 	spinlock_data_set(&lk->lk_lock, 0);
+	spinlock_data_set(&lk->lk_next, 0);
+	spinlock_data_set(&lk->lk_serving, 0);
 	lk->lk_holder = NULL;
+	lk->lk_acqtime = 0;
 }
 
 /*
@@ -60,19 +89,24 @@ spinlock_cleanup(struct spinlock *lk)
 {
 	KASSERT(lk->lk_holder == NULL);
 	KASSERT(spinlock_data_get(&lk->lk_lock) == 0);
+	KASSERT(spinlock_data_get(&lk->lk_next) ==
+		spinlock_data_get(&lk->lk_serving));
 }
 
 /*
  * Get the lock.
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
- * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * might come back to this lock and deadlock), then take a ticket and
+ * wait for our turn.
  */
 void
 spinlock_acquire(struct spinlock *lk)
 {
 	struct cpu *mycpu;
+	spinlock_data_t ticket;
+	uint32_t waitstart = 0;
+	bool contended = false;
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -87,27 +121,85 @@ spinlock_acquire(struct spinlock *lk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&lk->lk_lock) != 0) {
-			continue;
+	/*
+	 * Test-and-set is a machine-level atomic operation that
+	 * writes 1 into the guard word and returns the previous
+	 * value; it's what makes taking a ticket atomic. After that we
+	 * wait only on lk_serving, which no one writes but the holder.
+	 */
+	spinlock_guard_acquire(lk);
+	ticket = spinlock_data_get(&lk->lk_next);
+	spinlock_data_set(&lk->lk_next, ticket + 1);
+	spinlock_data_set(&lk->lk_lock, 0);
+
+	if (spinlock_data_get(&lk->lk_serving) != ticket) {
+		contended = true;
+		if (lockstat_enabled) {
+			waitstart = lockstat_now();
 		}
-		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
-			continue;
+		while (spinlock_data_get(&lk->lk_serving) != ticket) {
+			/* spin */
 		}
-		break;
 	}
 
 	lk->lk_holder = mycpu;
+
+	/* Only the holder touches lk_acqtime. */
+	lk->lk_acqtime = 0;
+	if (lockstat_enabled) {
+		lk->lk_acqtime = lockstat_acquired(LOCKSTAT_SPIN, lk, NULL,
+						   contended, waitstart);
+	}
+}
+
+/*
+ * Try to get the lock without spinning.
+ *
+ * This makes exactly one test-test-and-set attempt at the guard, for
+ * callers that would rather go do something else than wait for a
+ * busy lock, and only takes a ticket if it would be served at once.
+ */
+bool
+spinlock_tryacquire(struct spinlock *lk)
+{
+	struct cpu *mycpu;
+	spinlock_data_t ticket;
+
+	splraise(IPL_NONE, IPL_HIGH);
+
+	/* this must work before curcpu initialization */
+	if (CURCPU_EXISTS()) {
+		mycpu = curcpu->c_self;
+		if (lk->lk_holder == mycpu) {
+			panic("Deadlock on spinlock %p\n", lk);
+		}
+	}
+	else {
+		mycpu = NULL;
+	}
+
+	if (spinlock_data_get(&lk->lk_lock) != 0 ||
+	    spinlock_data_testandset(&lk->lk_lock) != 0) {
+		spllower(IPL_HIGH, IPL_NONE);
+		return false;
+	}
+	ticket = spinlock_data_get(&lk->lk_next);
+	if (spinlock_data_get(&lk->lk_serving) != ticket) {
+		/* Held, or others are already waiting their turn. */
+		spinlock_data_set(&lk->lk_lock, 0);
+		spllower(IPL_HIGH, IPL_NONE);
+		return false;
+	}
+	spinlock_data_set(&lk->lk_next, ticket + 1);
+	spinlock_data_set(&lk->lk_lock, 0);
+
+	lk->lk_holder = mycpu;
+	lk->lk_acqtime = 0;
+	if (lockstat_enabled) {
+		lk->lk_acqtime = lockstat_acquired(LOCKSTAT_SPIN, lk, NULL,
+						   false, 0);
+	}
+	return true;
 }
 
 /*
@@ -121,8 +213,14 @@ spinlock_release(struct spinlock *lk)
 		KASSERT(lk->lk_holder == curcpu->c_self);
 	}
 
+	if (lockstat_enabled) {
+		lockstat_released(LOCKSTAT_SPIN, lk, NULL, lk->lk_acqtime);
+	}
+
+	/* Only the holder writes lk_serving, so no atomic op is needed. */
 	lk->lk_holder = NULL;
-	spinlock_data_set(&lk->lk_lock, 0);
+	spinlock_data_set(&lk->lk_serving,
+			  spinlock_data_get(&lk->lk_serving) + 1);
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -33,18 +33,33 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <copyinout.h>
+#include <clock.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
+#include <proc.h>
 #include <synch.h>
+#include <lockstat.h>
 #include <opt-A2.h>
 
 ////////////////////////////////////////////////////////////
 //
 // Semaphore.
 
+/*
+ * FIFO mode: V gives the count straight to the first sleeper, instead
+ * of waking it to race for the count. Handoff mode also switches to
+ * it.
+ */
+unsigned sem_fifo = 0;
+unsigned sem_handoff = 0;
+
 struct semaphore *
 sem_create(const char *name, int initial_count) {
     struct semaphore *sem;
@@ -88,6 +103,9 @@ sem_destroy(struct semaphore *sem) {
 
 void
 P(struct semaphore *sem) {
+    uint32_t waitstart = 0;
+    bool contended = false;
+
     KASSERT(sem != NULL);
 
     /*
@@ -99,6 +117,10 @@ P(struct semaphore *sem) {
     KASSERT(curthread->t_in_interrupt == false);
 
     spinlock_acquire(&sem->sem_lock);
+    if (lockstat_enabled) {
+        contended = sem->sem_count == 0;
+        waitstart = lockstat_now();
+    }
     while (sem->sem_count == 0) {
         /*
          * Bridge to the wchan lock, so if someone else comes
@@ -106,33 +128,62 @@ P(struct semaphore *sem) {
          * through on the wchan until we've finished going to
          * sleep. Note that wchan_sleep unlocks the wchan.
          *
-         * Note that we don't maintain strict FIFO ordering of
+         * Normally we don't maintain strict FIFO ordering of
          * threads going through the semaphore; that is, we
          * might "get" it on the first try even if other
-         * threads are waiting. Apparently according to some
-         * textbooks semaphores must for some reason have
-         * strict ordering. Too bad. :-)
-         *
-         * Exercise: how would you implement strict FIFO
-         * ordering?
+         * threads are waiting. In FIFO mode (sem_fifo) V hands
+         * the count to the first sleeper directly, so the count
+         * is only ever nonzero when nobody is sleeping and
+         * nobody can get in ahead of a sleeper.
          */
         wchan_lock(sem->sem_wchan);
         spinlock_release(&sem->sem_lock);
         wchan_sleep(sem->sem_wchan);
 
         spinlock_acquire(&sem->sem_lock);
+        if (curthread->t_handoff == sem) {
+            /*
+             * V handed us the count directly; put it back so we
+             * can take it below like anyone else.
+             */
+            curthread->t_handoff = NULL;
+            sem->sem_count++;
+            break;
+        }
     }
     KASSERT(sem->sem_count > 0);
     sem->sem_count--;
     spinlock_release(&sem->sem_lock);
+
+    if (lockstat_enabled) {
+        lockstat_acquired(LOCKSTAT_SEM, sem, sem->sem_name, contended,
+                          waitstart);
+    }
 }
 
 void
 V(struct semaphore *sem) {
+    struct thread *wakee;
+
     KASSERT(sem != NULL);
 
     spinlock_acquire(&sem->sem_lock);
 
+    if (sem_fifo || sem_handoff) {
+        wakee = wchan_takeone(sem->sem_wchan);
+        if (wakee != NULL) {
+            /* The count goes to the wakee without passing through us. */
+            wakee->t_handoff = sem;
+            spinlock_release(&sem->sem_lock);
+            if (sem_handoff) {
+                thread_yield_to(wakee);
+            } else {
+                thread_wakeup(wakee);
+            }
+            return;
+        }
+    }
+
     sem->sem_count++;
     KASSERT(sem->sem_count > 0);
     wchan_wakeone(sem->sem_wchan);
@@ -144,11 +195,140 @@ V(struct semaphore *sem) {
 //
 // Lock.
 
+#if OPT_A2
+/*
+ * Priority inheritance.
+ *
+ * All of the inheritance state (t_inherited, t_waitpri, t_blockedon,
+ * and t_heldlocks in threads; lk_waiters, lk_nextheld, and
+ * lk_curthread in locks) is protected by one global spinlock, so we
+ * can walk a chain of holders without taking each lock's own spinlock
+ * in turn. Lock order is lk_lock, then pi_spinlock, then run queue
+ * locks.
+ *
+ * Each lock counts its waiters by priority level, so the priority a
+ * holder inherits is just the best nonempty level over the locks it
+ * holds. Waiters are counted at the level they had when they were
+ * last counted (t_waitpri), which keeps the counts exact even though
+ * a sleeping thread's own priority can change under it.
+ */
+unsigned lock_inherit_priority = 1;
+
+/*
+ * Handoff mode: lock_release makes the first sleeper the holder and
+ * switches to it, so the releaser can't take the lock straight back
+ * while the wakee is still on its way.
+ */
+unsigned lock_handoff = 0;
+
+/*
+ * Adaptive spinning budget for lock_acquire, in trips around the spin
+ * loop; 0 means always sleep.
+ */
+unsigned lock_spin = 0;
+
+static struct spinlock pi_spinlock = SPINLOCK_INITIALIZER;
+
+/*
+ * Work out what T should inherit from the locks it holds.
+ */
+static
+int
+pi_recompute(struct thread *t)
+{
+    struct lock *lk;
+    int best, pri;
+
+    KASSERT(spinlock_do_i_hold(&pi_spinlock));
+
+    best = SCHED_NLEVELS;
+    if (!lock_inherit_priority) {
+        return best;
+    }
+    for (lk = t->t_heldlocks; lk != NULL; lk = lk->lk_nextheld) {
+        for (pri = 0; pri < best; pri++) {
+            if (lk->lk_waiters[pri] > 0) {
+                best = pri;
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+/*
+ * The waiters on LOCK have changed; pass the change along to its
+ * holder, and if the holder's priority changes and it's also waiting
+ * for a lock, to that lock's holder, and so on.
+ */
+static
+void
+pi_propagate(struct lock *lock)
+{
+    struct thread *holder;
+    int oldpri, newpri;
+
+    KASSERT(spinlock_do_i_hold(&pi_spinlock));
+
+    while ((holder = lock->lk_curthread) != NULL) {
+        oldpri = THREAD_PRIORITY(holder);
+        holder->t_inherited = pi_recompute(holder);
+        newpri = THREAD_PRIORITY(holder);
+        if (newpri == oldpri) {
+            break;
+        }
+
+        thread_reposition(holder);
+
+        lock = holder->t_blockedon;
+        if (lock == NULL) {
+            break;
+        }
+        KASSERT(lock->lk_waiters[holder->t_waitpri] > 0);
+        lock->lk_waiters[holder->t_waitpri]--;
+        holder->t_waitpri = newpri;
+        lock->lk_waiters[newpri]++;
+    }
+}
+
+/*
+ * Start or stop waiting for LOCK. T is the thread that's starting to
+ * wait: normally curthread, but cv_signal and cv_broadcast also use
+ * this for the threads they move onto LOCK's wait channel.
+ */
+static
+void
+pi_block(struct lock *lock, struct thread *t)
+{
+    spinlock_acquire(&pi_spinlock);
+    KASSERT(t->t_blockedon == NULL);
+    t->t_blockedon = lock;
+    t->t_waitpri = THREAD_PRIORITY(t);
+    lock->lk_waiters[t->t_waitpri]++;
+    pi_propagate(lock);
+    spinlock_release(&pi_spinlock);
+}
+
+static
+void
+pi_unblock(struct lock *lock)
+{
+    spinlock_acquire(&pi_spinlock);
+    KASSERT(curthread->t_blockedon == lock);
+    KASSERT(lock->lk_waiters[curthread->t_waitpri] > 0);
+    lock->lk_waiters[curthread->t_waitpri]--;
+    curthread->t_waitpri = SCHED_NLEVELS;
+    curthread->t_blockedon = NULL;
+    spinlock_release(&pi_spinlock);
+}
+#endif
+
 struct lock *
 lock_create(const char *name) {
     // add stuff here as needed
 #if OPT_A2
     struct lock *lock;
+    int i;
 
     int initial_count = 1;
 
@@ -172,6 +352,13 @@ lock_create(const char *name) {
 
     spinlock_init(&lock->lk_lock);
     lock->lk_value = initial_count;
+    lock->lk_curthread = NULL;
+    lock->lk_acqtime = 0;
+
+    for (i = 0; i < SCHED_NLEVELS; i++) {
+        lock->lk_waiters[i] = 0;
+    }
+    lock->lk_nextheld = NULL;
 
     return lock;
 
@@ -213,10 +400,19 @@ lock_destroy(struct lock *lock) {
 
 }
 
-void
-lock_acquire(struct lock *lock) {
-    // Write this
 #if OPT_A2
+/*
+ * The guts of lock_acquire. If QUEUED, we've just been woken on the
+ * lock's wait channel after cv_signal or cv_broadcast moved us there
+ * (see cv_waitmorph), and carry on as if we'd gone to sleep in here.
+ */
+static
+void
+lock_acquire_common(struct lock *lock, bool queued) {
+    unsigned spins;
+    uint32_t waitstart = 0;
+    bool contended = false, handedoff = false;
+
     KASSERT(lock != NULL);
 
     /*
@@ -228,19 +424,82 @@ lock_acquire(struct lock *lock) {
     KASSERT(curthread->t_in_interrupt == false);
 
 
+    spins = 0;
     spinlock_acquire(&lock->lk_lock);
-    while (lock->lk_value == 0) {
+    if (lockstat_enabled) {
+        contended = queued || lock->lk_value == 0;
+        waitstart = lockstat_now();
+    }
+    if (queued) {
+        if (lock->lk_curthread == curthread) {
+            handedoff = true;
+        } else {
+            pi_unblock(lock);
+        }
+    }
+    while (!handedoff && lock->lk_value == 0) {
+        /*
+         * If the holder is running, it'll probably be done before
+         * we could get to sleep and back, so spin for a bit. We
+         * can't spin holding lk_lock or the holder couldn't release.
+         * (It might not even be the same holder from one check to
+         * the next; that's fine, any running holder will do.)
+         */
+        if (spins < lock_spin && thread_oncpu(lock->lk_curthread)) {
+            spinlock_release(&lock->lk_lock);
+            while (lock->lk_value == 0 && spins < lock_spin &&
+                   thread_oncpu(lock->lk_curthread)) {
+                spins++;
+            }
+            spinlock_acquire(&lock->lk_lock);
+            continue;
+        }
+
+        /* Lend our priority to the holder while we wait. */
+        pi_block(lock, curthread);
 
         wchan_lock(lock->lk_wchan);
         spinlock_release(&lock->lk_lock);
         wchan_sleep(lock->lk_wchan);
 
         spinlock_acquire(&lock->lk_lock);
+        if (lock->lk_curthread == curthread) {
+            /* Handed to us; lock_release did the bookkeeping. */
+            handedoff = true;
+            break;
+        }
+        pi_unblock(lock);
+    }
+    if (!handedoff) {
+        KASSERT(lock->lk_value == 1);
+        lock->lk_value = 0;
+
+        /* Anyone still waiting now lends their priority to us. */
+        spinlock_acquire(&pi_spinlock);
+        lock->lk_curthread = curthread;
+        lock->lk_nextheld = curthread->t_heldlocks;
+        curthread->t_heldlocks = lock;
+        curthread->t_inherited = pi_recompute(curthread);
+        spinlock_release(&pi_spinlock);
     }
-    KASSERT(lock->lk_value == 1);
-    lock->lk_value = 0;
-    lock->lk_curthread = curthread;
+
     spinlock_release(&lock->lk_lock);
+
+    /* Only the holder touches lk_acqtime. */
+    lock->lk_acqtime = 0;
+    if (lockstat_enabled) {
+        lock->lk_acqtime = lockstat_acquired(LOCKSTAT_LOCK, lock,
+                                             lock->lk_name, contended,
+                                             waitstart);
+    }
+}
+#endif
+
+void
+lock_acquire(struct lock *lock) {
+    // Write this
+#if OPT_A2
+    lock_acquire_common(lock, false);
 #else
 
 #endif
@@ -250,15 +509,58 @@ void
 lock_release(struct lock *lock) {
     // Write this
 #if OPT_A2
+    struct lock **pp;
+    struct thread *wakee;
+
     KASSERT(lock != NULL);
     KASSERT(lock->lk_curthread == curthread);
 
+    if (lockstat_enabled) {
+        lockstat_released(LOCKSTAT_LOCK, lock, lock->lk_name,
+                          lock->lk_acqtime);
+    }
+
     spinlock_acquire(&lock->lk_lock);
-        lock->lk_value = 1;
-        KASSERT(lock->lk_value == 1);
-        wchan_wakeone(lock->lk_wchan);
+        wakee = lock_handoff ? wchan_takeone(lock->lk_wchan) : NULL;
+
+        /* Give back whatever the waiters on this lock lent us. */
+        spinlock_acquire(&pi_spinlock);
+        for (pp = &curthread->t_heldlocks; *pp != lock;
+             pp = &(*pp)->lk_nextheld) {
+            KASSERT(*pp != NULL);
+        }
+        *pp = lock->lk_nextheld;
+        lock->lk_nextheld = NULL;
         lock->lk_curthread = NULL;
+        curthread->t_inherited = pi_recompute(curthread);
+
+        if (wakee != NULL) {
+            /*
+             * Hand the lock over: the wakee stops waiting and
+             * becomes the holder, all as lock_acquire would have
+             * done once it got here.
+             */
+            KASSERT(wakee->t_blockedon == lock);
+            KASSERT(lock->lk_waiters[wakee->t_waitpri] > 0);
+            lock->lk_waiters[wakee->t_waitpri]--;
+            wakee->t_waitpri = SCHED_NLEVELS;
+            wakee->t_blockedon = NULL;
+            lock->lk_curthread = wakee;
+            lock->lk_nextheld = wakee->t_heldlocks;
+            wakee->t_heldlocks = lock;
+            wakee->t_inherited = pi_recompute(wakee);
+        }
+        spinlock_release(&pi_spinlock);
+
+        if (wakee == NULL) {
+            lock->lk_value = 1;
+            wchan_wakeone(lock->lk_wchan);
+        }
     spinlock_release(&lock->lk_lock);
+
+    if (wakee != NULL) {
+        thread_yield_to(wakee);
+    }
 #else
 
 #endif
@@ -287,6 +589,42 @@ lock_do_i_hold(struct lock *lock) {
 //
 // CV
 
+#if OPT_A2
+/*
+ * Wait morphing: cv_signal and cv_broadcast move waiters straight
+ * onto the lock's wait channel, blocked on the lock just as if they'd
+ * called lock_acquire, instead of waking them only for all but one
+ * to find the lock held and go back to sleep. Each then wakes once,
+ * when lock_release gets to it.
+ */
+unsigned cv_waitmorph = 0;
+
+/*
+ * Move the first sleeper on CV, or all of them if ALL, onto LOCK's
+ * wait channel. We hold LOCK, so nobody can release it and wake them
+ * until we're done.
+ */
+static
+void
+cv_morph(struct cv *cv, struct lock *lock, bool all) {
+    struct thread *t;
+
+    KASSERT(lock->lk_curthread == curthread);
+
+    spinlock_acquire(&lock->lk_lock);
+    while ((t = wchan_takeone(cv->cv_wchan)) != NULL) {
+        /* Tell cv_wait it's already waiting for the lock. */
+        t->t_handoff = lock;
+        pi_block(lock, t);
+        wchan_enqueue(lock->lk_wchan, t);
+        if (!all) {
+            break;
+        }
+    }
+    spinlock_release(&lock->lk_lock);
+}
+#endif
+
 
 struct cv *
 cv_create(const char *name) {
@@ -375,7 +713,14 @@ cv_wait(struct cv *cv, struct lock *lock) {
 
 
     //upon waking, reacquire the lock
-    lock_acquire(cv->cv_lock);
+    if (curthread->t_handoff != NULL) {
+        /* cv_morph already queued us for it. */
+        KASSERT(curthread->t_handoff == lock);
+        curthread->t_handoff = NULL;
+        lock_acquire_common(lock, true);
+    } else {
+        lock_acquire(cv->cv_lock);
+    }
 
 #else
     // Write this
@@ -390,7 +735,11 @@ cv_signal(struct cv *cv, struct lock *lock) {
 
     spinlock_acquire(&cv->cv_spinlock);
     if (lock == cv->cv_lock) {
-        wchan_wakeone(cv->cv_wchan);
+        if (cv_waitmorph) {
+            cv_morph(cv, lock, false);
+        } else {
+            wchan_wakeone(cv->cv_wchan);
+        }
     }
     spinlock_release(&cv->cv_spinlock);
 #else
@@ -405,7 +754,11 @@ cv_broadcast(struct cv *cv, struct lock *lock) {
 #if OPT_A2
     spinlock_acquire(&cv->cv_spinlock);
     if (lock == cv->cv_lock) {
-        wchan_wakeall(cv->cv_wchan);
+        if (cv_waitmorph) {
+            cv_morph(cv, lock, true);
+        } else {
+            wchan_wakeall(cv->cv_wchan);
+        }
     }
     spinlock_release(&cv->cv_spinlock);
 #else
@@ -414,3 +767,909 @@ cv_broadcast(struct cv *cv, struct lock *lock) {
     (void) lock;  // suppress warning until code gets written
 #endif
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name) {
+    struct rwlock *rw;
+
+    rw = kmalloc(sizeof(struct rwlock));
+    if (rw == NULL) {
+        return NULL;
+    }
+
+    rw->rwlk_name = kstrdup(name);
+    if (rw->rwlk_name == NULL) {
+        kfree(rw);
+        return NULL;
+    }
+
+    rw->rwlk_readwchan = wchan_create(rw->rwlk_name);
+    if (rw->rwlk_readwchan == NULL) {
+        kfree(rw->rwlk_name);
+        kfree(rw);
+        return NULL;
+    }
+
+    rw->rwlk_writewchan = wchan_create(rw->rwlk_name);
+    if (rw->rwlk_writewchan == NULL) {
+        wchan_destroy(rw->rwlk_readwchan);
+        kfree(rw->rwlk_name);
+        kfree(rw);
+        return NULL;
+    }
+
+    rw->rwlk_upgradewchan = wchan_create(rw->rwlk_name);
+    if (rw->rwlk_upgradewchan == NULL) {
+        wchan_destroy(rw->rwlk_writewchan);
+        wchan_destroy(rw->rwlk_readwchan);
+        kfree(rw->rwlk_name);
+        kfree(rw);
+        return NULL;
+    }
+
+    spinlock_init(&rw->rwlk_lock);
+    rw->rwlk_readers = 0;
+    rw->rwlk_writerswaiting = 0;
+    rw->rwlk_writer = NULL;
+    rw->rwlk_upgrader = NULL;
+
+    return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw) {
+    KASSERT(rw != NULL);
+    KASSERT(rw->rwlk_readers == 0);
+    KASSERT(rw->rwlk_writer == NULL);
+
+    /* wchan_cleanup will assert if anyone's waiting on it */
+    spinlock_cleanup(&rw->rwlk_lock);
+    wchan_destroy(rw->rwlk_upgradewchan);
+    wchan_destroy(rw->rwlk_writewchan);
+    wchan_destroy(rw->rwlk_readwchan);
+    kfree(rw->rwlk_name);
+    kfree(rw);
+}
+
+/*
+ * Sleep on WC until woken, bridging from the rwlock's spinlock to the
+ * wchan's as P does. Returns with the spinlock held again.
+ */
+static
+void
+rwlock_sleep(struct rwlock *rw, struct wchan *wc) {
+    wchan_lock(wc);
+    spinlock_release(&rw->rwlk_lock);
+    wchan_sleep(wc);
+    spinlock_acquire(&rw->rwlk_lock);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw) {
+    KASSERT(rw != NULL);
+    KASSERT(curthread->t_in_interrupt == false);
+
+    spinlock_acquire(&rw->rwlk_lock);
+    KASSERT(rw->rwlk_writer != curthread);
+    while (rw->rwlk_writer != NULL || rw->rwlk_writerswaiting > 0 ||
+           rw->rwlk_upgrader != NULL) {
+        rwlock_sleep(rw, rw->rwlk_readwchan);
+    }
+    rw->rwlk_readers++;
+    spinlock_release(&rw->rwlk_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw) {
+    KASSERT(rw != NULL);
+
+    spinlock_acquire(&rw->rwlk_lock);
+    KASSERT(rw->rwlk_readers > 0);
+    rw->rwlk_readers--;
+    if (rw->rwlk_upgrader != NULL) {
+        /* Only the upgrader itself left? Then it can go ahead. */
+        if (rw->rwlk_readers == 1) {
+            wchan_wakeone(rw->rwlk_upgradewchan);
+        }
+    }
+    else if (rw->rwlk_readers == 0 && rw->rwlk_writerswaiting > 0) {
+        wchan_wakeone(rw->rwlk_writewchan);
+    }
+    spinlock_release(&rw->rwlk_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw) {
+    KASSERT(rw != NULL);
+    KASSERT(curthread->t_in_interrupt == false);
+
+    spinlock_acquire(&rw->rwlk_lock);
+    KASSERT(rw->rwlk_writer != curthread);
+    rw->rwlk_writerswaiting++;
+    while (rw->rwlk_writer != NULL || rw->rwlk_readers > 0 ||
+           rw->rwlk_upgrader != NULL) {
+        rwlock_sleep(rw, rw->rwlk_writewchan);
+    }
+    rw->rwlk_writerswaiting--;
+    rw->rwlk_writer = curthread;
+    spinlock_release(&rw->rwlk_lock);
+}
+
+/*
+ * Let the next waiters in once nobody holds the lock: a writer if
+ * there is one, otherwise all the readers.
+ */
+static
+void
+rwlock_wakenext(struct rwlock *rw) {
+    KASSERT(spinlock_do_i_hold(&rw->rwlk_lock));
+
+    if (rw->rwlk_writerswaiting > 0) {
+        wchan_wakeone(rw->rwlk_writewchan);
+    }
+    else {
+        wchan_wakeall(rw->rwlk_readwchan);
+    }
+}
+
+void
+rwlock_release_write(struct rwlock *rw) {
+    KASSERT(rw != NULL);
+
+    spinlock_acquire(&rw->rwlk_lock);
+    KASSERT(rw->rwlk_writer == curthread);
+    rw->rwlk_writer = NULL;
+    rwlock_wakenext(rw);
+    spinlock_release(&rw->rwlk_lock);
+}
+
+bool
+rwlock_upgrade(struct rwlock *rw) {
+    KASSERT(rw != NULL);
+    KASSERT(curthread->t_in_interrupt == false);
+
+    spinlock_acquire(&rw->rwlk_lock);
+    KASSERT(rw->rwlk_readers > 0);
+    if (rw->rwlk_upgrader != NULL) {
+        spinlock_release(&rw->rwlk_lock);
+        return false;
+    }
+
+    /* New readers and writers now wait; the other readers drain. */
+    rw->rwlk_upgrader = curthread;
+    while (rw->rwlk_readers > 1) {
+        rwlock_sleep(rw, rw->rwlk_upgradewchan);
+    }
+    rw->rwlk_upgrader = NULL;
+    rw->rwlk_readers = 0;
+    rw->rwlk_writer = curthread;
+    spinlock_release(&rw->rwlk_lock);
+    return true;
+}
+
+void
+rwlock_downgrade(struct rwlock *rw) {
+    KASSERT(rw != NULL);
+
+    spinlock_acquire(&rw->rwlk_lock);
+    KASSERT(rw->rwlk_writer == curthread);
+    rw->rwlk_writer = NULL;
+    rw->rwlk_readers = 1;
+    /* Writer preference: other readers only if no writer is waiting. */
+    if (rw->rwlk_writerswaiting == 0) {
+        wchan_wakeall(rw->rwlk_readwchan);
+    }
+    spinlock_release(&rw->rwlk_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw) {
+    bool ret;
+
+    KASSERT(rw != NULL);
+
+    spinlock_acquire(&rw->rwlk_lock);
+    ret = rw->rwlk_writer == curthread;
+    spinlock_release(&rw->rwlk_lock);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Latch.
+
+struct latch *
+latch_create(const char *name, unsigned count) {
+    struct latch *lt;
+
+    lt = kmalloc(sizeof(struct latch));
+    if (lt == NULL) {
+        return NULL;
+    }
+
+    lt->lt_name = kstrdup(name);
+    if (lt->lt_name == NULL) {
+        kfree(lt);
+        return NULL;
+    }
+
+    lt->lt_wchan = wchan_create(lt->lt_name);
+    if (lt->lt_wchan == NULL) {
+        kfree(lt->lt_name);
+        kfree(lt);
+        return NULL;
+    }
+
+    spinlock_init(&lt->lt_lock);
+    lt->lt_count = count;
+
+    return lt;
+}
+
+void
+latch_destroy(struct latch *lt) {
+    KASSERT(lt != NULL);
+
+    /* wchan_cleanup will assert if anyone's waiting on it */
+    spinlock_cleanup(&lt->lt_lock);
+    wchan_destroy(lt->lt_wchan);
+    kfree(lt->lt_name);
+    kfree(lt);
+}
+
+void
+latch_countdown(struct latch *lt) {
+    KASSERT(lt != NULL);
+
+    spinlock_acquire(&lt->lt_lock);
+    KASSERT(lt->lt_count > 0);
+    lt->lt_count--;
+    if (lt->lt_count == 0) {
+        /* Nobody sleeps once it's zero, so this happens only once */
+        wchan_wakeall(lt->lt_wchan);
+    }
+    spinlock_release(&lt->lt_lock);
+}
+
+void
+latch_wait(struct latch *lt) {
+    KASSERT(lt != NULL);
+    KASSERT(curthread->t_in_interrupt == false);
+
+    spinlock_acquire(&lt->lt_lock);
+    while (lt->lt_count > 0) {
+        wchan_lock(lt->lt_wchan);
+        spinlock_release(&lt->lt_lock);
+        wchan_sleep(lt->lt_wchan);
+        spinlock_acquire(&lt->lt_lock);
+    }
+    spinlock_release(&lt->lt_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Barrier.
+
+struct barrier *
+barrier_create(const char *name, unsigned count) {
+    struct barrier *b;
+
+    KASSERT(count > 0);
+
+    b = kmalloc(sizeof(struct barrier));
+    if (b == NULL) {
+        return NULL;
+    }
+
+    b->bar_name = kstrdup(name);
+    if (b->bar_name == NULL) {
+        kfree(b);
+        return NULL;
+    }
+
+    b->bar_wchan = wchan_create(b->bar_name);
+    if (b->bar_wchan == NULL) {
+        kfree(b->bar_name);
+        kfree(b);
+        return NULL;
+    }
+
+    spinlock_init(&b->bar_lock);
+    b->bar_count = count;
+    b->bar_arrived = 0;
+    b->bar_generation = 0;
+
+    return b;
+}
+
+void
+barrier_destroy(struct barrier *b) {
+    KASSERT(b != NULL);
+    KASSERT(b->bar_arrived == 0);
+
+    /* wchan_cleanup will assert if anyone's waiting on it */
+    spinlock_cleanup(&b->bar_lock);
+    wchan_destroy(b->bar_wchan);
+    kfree(b->bar_name);
+    kfree(b);
+}
+
+bool
+barrier_wait(struct barrier *b) {
+    unsigned gen;
+
+    KASSERT(b != NULL);
+    KASSERT(curthread->t_in_interrupt == false);
+
+    spinlock_acquire(&b->bar_lock);
+    KASSERT(b->bar_arrived < b->bar_count);
+    b->bar_arrived++;
+    if (b->bar_arrived == b->bar_count) {
+        /*
+         * Last one in. Start the next round before waking anybody,
+         * so that a thread that gets going again right away and
+         * comes back around counts toward the new round.
+         */
+        b->bar_arrived = 0;
+        b->bar_generation++;
+        wchan_wakeall(b->bar_wchan);
+        spinlock_release(&b->bar_lock);
+        return true;
+    }
+
+    /*
+     * Wait for the round to end. Checking the generation rather than
+     * the arrival count means we can't miss it even if the count has
+     * already started going up again for the next round.
+     */
+    gen = b->bar_generation;
+    while (b->bar_generation == gen) {
+        wchan_lock(b->bar_wchan);
+        spinlock_release(&b->bar_lock);
+        wchan_sleep(b->bar_wchan);
+        spinlock_acquire(&b->bar_lock);
+    }
+    spinlock_release(&b->bar_lock);
+    return false;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Futexes.
+//
+// Sleepers hash on their address into a fixed table of buckets, each
+// with a spinlock, a wait channel, and a list of who's waiting on
+// what. Threads waiting on different addresses can share a bucket;
+// futex_wake picks out the right ones by address and wakes them
+// individually. The bucket lock comes before the wait channel's.
+
+#define FUTEX_HASHBITS  6
+#define FUTEX_BUCKETS   (1 << FUTEX_HASHBITS)
+
+/* A thread in futex_wait; lives on its stack. */
+struct futex_waiter {
+    struct addrspace *fw_as;
+    vaddr_t fw_addr;
+    struct thread *fw_thread;
+    bool fw_sleeping;           /* Committed to sleeping on fb_wchan */
+    bool fw_woken;              /* futex_wake took us off the list */
+    struct futex_waiter *fw_next;
+};
+
+struct futex_bucket {
+    struct spinlock fb_lock;
+    struct wchan *fb_wchan;
+    struct futex_waiter *fb_waiters;    /* Oldest first */
+};
+
+static struct futex_bucket futex_table[FUTEX_BUCKETS];
+
+void
+futex_bootstrap(void) {
+    unsigned i;
+
+    for (i = 0; i < FUTEX_BUCKETS; i++) {
+        spinlock_init(&futex_table[i].fb_lock);
+        futex_table[i].fb_wchan = wchan_create("futex");
+        if (futex_table[i].fb_wchan == NULL) {
+            panic("futex_bootstrap: Out of memory\n");
+        }
+        futex_table[i].fb_waiters = NULL;
+    }
+}
+
+static
+struct futex_bucket *
+futex_hash(struct addrspace *as, vaddr_t addr) {
+    uint32_t h;
+
+    h = ((uint32_t)(uintptr_t)as ^ (uint32_t)addr) >> 2;
+    h *= 2654435761U;   /* Knuth's multiplicative hash */
+    return &futex_table[h >> (32 - FUTEX_HASHBITS)];
+}
+
+/*
+ * Take W off its bucket's list, if it's still there.
+ */
+static
+void
+futex_unlink(struct futex_bucket *fb, struct futex_waiter *w) {
+    struct futex_waiter **pp;
+
+    KASSERT(spinlock_do_i_hold(&fb->fb_lock));
+    for (pp = &fb->fb_waiters; *pp != NULL; pp = &(*pp)->fw_next) {
+        if (*pp == w) {
+            *pp = w->fw_next;
+            return;
+        }
+    }
+}
+
+int
+futex_wait(struct addrspace *as, vaddr_t addr, int val) {
+    struct futex_bucket *fb;
+    struct futex_waiter w, **pp;
+    int cur, result;
+
+    KASSERT(curthread->t_in_interrupt == false);
+
+    if (addr % sizeof(int) != 0) {
+        return EINVAL;
+    }
+
+    w.fw_as = as;
+    w.fw_addr = addr;
+    w.fw_thread = curthread;
+    w.fw_sleeping = false;
+    w.fw_woken = false;
+    w.fw_next = NULL;
+
+    /*
+     * Get on the list first and only then look at the value. A
+     * futex_wake that comes before we're on the list came after
+     * the value changed, so we'll see the change; one that comes
+     * after will find us. Reading the value can fault, so it
+     * can't be done under the bucket lock.
+     */
+    fb = futex_hash(as, addr);
+    spinlock_acquire(&fb->fb_lock);
+    for (pp = &fb->fb_waiters; *pp != NULL; pp = &(*pp)->fw_next) {
+        /* nothing */
+    }
+    *pp = &w;
+    spinlock_release(&fb->fb_lock);
+
+    if (as == NULL) {
+        cur = *(volatile int *)addr;
+        result = 0;
+    } else {
+        KASSERT(as == curproc_getas());
+        result = copyin((const_userptr_t)addr, &cur, sizeof(cur));
+    }
+
+    spinlock_acquire(&fb->fb_lock);
+    if (w.fw_woken) {
+        /* Woken before we got to sleep; that counts. */
+        spinlock_release(&fb->fb_lock);
+        return 0;
+    }
+    if (result == 0 && cur != val) {
+        result = EAGAIN;
+    }
+    if (result) {
+        futex_unlink(fb, &w);
+        spinlock_release(&fb->fb_lock);
+        return result;
+    }
+
+    /*
+     * Bridge to the wait channel as P does, so a futex_wake that
+     * sees fw_sleeping can't get to the channel before we're on
+     * it. It takes us off the list, so there's nothing to clean up
+     * when we wake.
+     */
+    w.fw_sleeping = true;
+    wchan_lock(fb->fb_wchan);
+    spinlock_release(&fb->fb_lock);
+    wchan_sleep(fb->fb_wchan);
+
+    KASSERT(w.fw_woken);
+    return 0;
+}
+
+unsigned
+futex_wake(struct addrspace *as, vaddr_t addr, unsigned n) {
+    struct futex_bucket *fb;
+    struct futex_waiter *w, **pp;
+    unsigned woken;
+
+    woken = 0;
+    fb = futex_hash(as, addr);
+    spinlock_acquire(&fb->fb_lock);
+    pp = &fb->fb_waiters;
+    while (woken < n && (w = *pp) != NULL) {
+        if (w->fw_as != as || w->fw_addr != addr) {
+            pp = &w->fw_next;
+            continue;
+        }
+        *pp = w->fw_next;
+        /*
+         * W lives on its thread's stack, so once fw_woken is set
+         * and we let go of the bucket it may be gone; but a
+         * sleeping thread stays put until we wake it.
+         */
+        w->fw_woken = true;
+        if (w->fw_sleeping) {
+            wchan_wakethread(fb->fb_wchan, w->fw_thread);
+        }
+        woken++;
+    }
+    spinlock_release(&fb->fb_lock);
+    return woken;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Lock contention profiling; see lockstat.h.
+//
+// Each cpu records into its own table, so the lock paths don't all
+// hammer one shared structure. A table's guard word is taken with the
+// machine's test-and-set directly rather than through the spinlock
+// API, which would recurse into us; it's only ever held with
+// interrupts off, briefly, and with no other locking inside, so it
+// can't deadlock.
+
+struct lockstat_entry {
+    int le_kind;			/* LOCKSTAT_*, or -1 if unused */
+    const void *le_lock;		/* Spinlock address */
+    char le_name[LOCKSTAT_NAMELEN];	/* Lock or semaphore name */
+    unsigned le_acquires;		/* Times taken */
+    unsigned le_contended;		/* Times that had to wait */
+    uint64_t le_waitusecs;		/* Total time spent waiting */
+    uint32_t le_maxhold;		/* Longest time held */
+};
+
+struct lockstat_table {
+    volatile spinlock_data_t lt_guard;
+    unsigned lt_dropped;		/* Records with no free slot */
+    struct lockstat_entry lt_entries[LOCKSTAT_SLOTS];
+};
+
+volatile bool lockstat_enabled = false;
+static struct lockstat_table *lockstat_tables[CPUMASK_BITS];
+
+static
+void
+lockstat_clear(struct lockstat_table *lt) {
+    unsigned i;
+
+    lt->lt_dropped = 0;
+    for (i = 0; i < LOCKSTAT_SLOTS; i++) {
+        bzero(&lt->lt_entries[i], sizeof(lt->lt_entries[i]));
+        lt->lt_entries[i].le_kind = -1;
+    }
+}
+
+static
+void
+lockstat_guard_acquire(struct lockstat_table *lt) {
+    while (spinlock_data_get(&lt->lt_guard) != 0 ||
+           spinlock_data_testandset(&lt->lt_guard) != 0) {
+        /* spin */
+    }
+}
+
+static
+void
+lockstat_guard_release(struct lockstat_table *lt) {
+    spinlock_data_set(&lt->lt_guard, 0);
+}
+
+/*
+ * Check if entry E is for the given lock. Names are compared only as
+ * far as they're kept.
+ */
+static
+bool
+lockstat_match(const struct lockstat_entry *e, int kind, const void *lk,
+               const char *name) {
+    unsigned i;
+
+    if (e->le_kind != kind) {
+        return false;
+    }
+    if (kind == LOCKSTAT_SPIN) {
+        return e->le_lock == lk;
+    }
+    for (i = 0; i < LOCKSTAT_NAMELEN - 1; i++) {
+        if (e->le_name[i] != name[i]) {
+            return false;
+        }
+        if (name[i] == 0) {
+            break;
+        }
+    }
+    return true;
+}
+
+/*
+ * Find (or make) the entry for a lock in table LT, by open hashing.
+ * Returns NULL if the table is full.
+ */
+static
+struct lockstat_entry *
+lockstat_lookup(struct lockstat_table *lt, int kind, const void *lk,
+                const char *name) {
+    struct lockstat_entry *e;
+    unsigned h, i, n;
+
+    if (kind == LOCKSTAT_SPIN) {
+        h = (uintptr_t)lk >> 3;
+    }
+    else {
+        h = kind;
+        for (i = 0; i < LOCKSTAT_NAMELEN - 1 && name[i] != 0; i++) {
+            h = h * 33 + (unsigned char)name[i];
+        }
+    }
+
+    for (n = 0; n < LOCKSTAT_SLOTS; n++) {
+        e = &lt->lt_entries[(h + n) % LOCKSTAT_SLOTS];
+        if (e->le_kind == -1) {
+            e->le_kind = kind;
+            e->le_lock = lk;
+            if (name != NULL) {
+                for (i = 0; i < LOCKSTAT_NAMELEN - 1 && name[i] != 0;
+                     i++) {
+                    e->le_name[i] = name[i];
+                }
+                e->le_name[i] = 0;
+            }
+            return e;
+        }
+        if (lockstat_match(e, kind, lk, name)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Add to the current cpu's entry for a lock.
+ */
+static
+void
+lockstat_record(int kind, const void *lk, const char *name,
+                bool acquired, bool contended, uint32_t wait, uint32_t hold) {
+    struct lockstat_table *lt;
+    struct lockstat_entry *e;
+    int spl;
+
+    /* this must work before curcpu initialization */
+    if (!CURCPU_EXISTS()) {
+        return;
+    }
+
+    spl = splhigh();
+    lt = lockstat_tables[curcpu->c_number];
+    if (lt != NULL) {
+        lockstat_guard_acquire(lt);
+        e = lockstat_lookup(lt, kind, lk, name);
+        if (e == NULL) {
+            lt->lt_dropped++;
+        }
+        else if (acquired) {
+            e->le_acquires++;
+            if (contended) {
+                e->le_contended++;
+                e->le_waitusecs += wait;
+            }
+        }
+        else if (hold > e->le_maxhold) {
+            e->le_maxhold = hold;
+        }
+        lockstat_guard_release(lt);
+    }
+    splx(spl);
+}
+
+uint32_t
+lockstat_now(void) {
+    time_t secs;
+    uint32_t nsecs, now;
+
+    gettime(&secs, &nsecs);
+    now = (uint32_t)secs * 1000000 + nsecs / 1000;
+    return now == 0 ? 1 : now;
+}
+
+uint32_t
+lockstat_acquired(int kind, const void *lk, const char *name,
+                  bool contended, uint32_t waitstart) {
+    uint32_t now;
+
+    now = lockstat_now();
+    if (waitstart == 0) {
+        /* We started waiting before profiling was turned on. */
+        contended = false;
+    }
+    lockstat_record(kind, lk, name, true, contended, now - waitstart, 0);
+    return now;
+}
+
+void
+lockstat_released(int kind, const void *lk, const char *name,
+                  uint32_t acqtime) {
+    if (acqtime != 0) {
+        lockstat_record(kind, lk, name, false, false, 0,
+                        lockstat_now() - acqtime);
+    }
+}
+
+int
+lockstat_enable(bool on) {
+    struct cpu *c;
+    unsigned i;
+
+    if (on) {
+        for (i = 0; (c = cpu_get(i)) != NULL; i++) {
+            if (lockstat_tables[i] != NULL) {
+                continue;
+            }
+            lockstat_tables[i] = kmalloc(sizeof(struct lockstat_table));
+            if (lockstat_tables[i] == NULL) {
+                return ENOMEM;
+            }
+            spinlock_data_set(&lockstat_tables[i]->lt_guard, 0);
+            lockstat_clear(lockstat_tables[i]);
+        }
+    }
+    lockstat_enabled = on;
+    return 0;
+}
+
+/*
+ * Describe a spinlock. They have no names, but the per-cpu ones are
+ * the likeliest to show up, so recognize those.
+ */
+static
+void
+lockstat_spinname(const void *lk, char *buf, size_t len) {
+    struct cpu *c;
+    unsigned i;
+
+    for (i = 0; (c = cpu_get(i)) != NULL; i++) {
+        if (lk == &c->c_runqueue_lock) {
+            snprintf(buf, len, "cpu%u runqueue", i);
+            return;
+        }
+        if (lk == &c->c_ipi_lock) {
+            snprintf(buf, len, "cpu%u ipi", i);
+            return;
+        }
+    }
+    snprintf(buf, len, "spinlock %p", lk);
+}
+
+void
+lockstat_print(unsigned topn, bool reset) {
+    static const char *const kinds[] = { "spin", "lock", "sem" };
+    struct lockstat_entry *merged, *copy, *e, *m, *best;
+    char spinname[LOCKSTAT_NAMELEN];
+    unsigned i, j, k, nmerged, dropped;
+    int spl;
+
+    merged = kmalloc(LOCKSTAT_SLOTS * sizeof(*merged));
+    copy = kmalloc(LOCKSTAT_SLOTS * sizeof(*copy));
+    if (merged == NULL || copy == NULL) {
+        kprintf("lockstat: Out of memory\n");
+        kfree(merged);
+        kfree(copy);
+        return;
+    }
+
+    /*
+     * Copy each cpu's table out under its guard (no printing or
+     * allocating then; they take locks we might be recording), and
+     * add it into the merged list. Locks beyond what fits are
+     * counted as dropped.
+     */
+    nmerged = 0;
+    dropped = 0;
+    for (i = 0; i < CPUMASK_BITS; i++) {
+        if (lockstat_tables[i] == NULL) {
+            continue;
+        }
+        spl = splhigh();
+        lockstat_guard_acquire(lockstat_tables[i]);
+        memcpy(copy, lockstat_tables[i]->lt_entries,
+               LOCKSTAT_SLOTS * sizeof(*copy));
+        dropped += lockstat_tables[i]->lt_dropped;
+        if (reset) {
+            lockstat_clear(lockstat_tables[i]);
+        }
+        lockstat_guard_release(lockstat_tables[i]);
+        splx(spl);
+
+        for (j = 0; j < LOCKSTAT_SLOTS; j++) {
+            e = &copy[j];
+            if (e->le_kind == -1) {
+                continue;
+            }
+            for (k = 0; k < nmerged; k++) {
+                if (lockstat_match(&merged[k], e->le_kind, e->le_lock,
+                                   e->le_name)) {
+                    break;
+                }
+            }
+            if (k == nmerged) {
+                if (nmerged == LOCKSTAT_SLOTS) {
+                    dropped += e->le_acquires;
+                    continue;
+                }
+                merged[nmerged++] = *e;
+                continue;
+            }
+            m = &merged[k];
+            m->le_acquires += e->le_acquires;
+            m->le_contended += e->le_contended;
+            m->le_waitusecs += e->le_waitusecs;
+            if (e->le_maxhold > m->le_maxhold) {
+                m->le_maxhold = e->le_maxhold;
+            }
+        }
+    }
+
+    kprintf("%-20s %4s %9s %9s %10s %8s %8s\n", "lock", "kind", "acquires",
+            "contended", "wait us", "avg wait", "max hold");
+    for (i = 0; i < topn; i++) {
+        /* Pick the most contended left, by count then wait time. */
+        best = NULL;
+        for (k = 0; k < nmerged; k++) {
+            m = &merged[k];
+            if (m->le_kind == -1 || m->le_contended == 0) {
+                continue;
+            }
+            if (best == NULL || m->le_contended > best->le_contended ||
+                (m->le_contended == best->le_contended &&
+                 m->le_waitusecs > best->le_waitusecs)) {
+                best = m;
+            }
+        }
+        if (best == NULL) {
+            break;
+        }
+
+        if (best->le_kind == LOCKSTAT_SPIN) {
+            lockstat_spinname(best->le_lock, spinname, sizeof(spinname));
+            kprintf("%-20s ", spinname);
+        }
+        else {
+            kprintf("%-20s ", best->le_name);
+        }
+        kprintf("%4s %9u %9u %10u %8u ", kinds[best->le_kind],
+                best->le_acquires, best->le_contended,
+                (uint32_t)best->le_waitusecs,
+                (uint32_t)(best->le_waitusecs / best->le_contended));
+        if (best->le_kind == LOCKSTAT_SEM) {
+            kprintf("%8s\n", "-");
+        }
+        else {
+            kprintf("%8u\n", best->le_maxhold);
+        }
+        best->le_kind = -1;
+    }
+    if (i == 0) {
+        kprintf("(no contended locks)\n");
+    }
+    if (dropped > 0) {
+        kprintf("(%u records dropped; too many locks)\n", dropped);
+    }
+
+    kfree(copy);
+    kfree(merged);
+}
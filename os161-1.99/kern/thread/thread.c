@@ -32,12 +32,14 @@
  */
 
 #define THREADINLINE
+#define RCU_INLINE
 
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
 #include <array.h>
 #include <cpu.h>
+#include <clock.h>
 #include <spl.h>
 #include <spinlock.h>
 #include <wchan.h>
@@ -50,6 +52,7 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <rcu.h>
 
 #include "opt-synchprobs.h"
 
@@ -57,6 +60,38 @@
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/*
+ * MLFQ tuning. schedule() runs every SCHEDULE_HARDCLOCKS and charges
+ * one slice to whatever thread it interrupted; a thread that has been
+ * charged MLFQ_ALLOTMENT(level) slices at a level drops to the next
+ * one. Every MLFQ_BOOST_SCHEDULES calls, everything on the cpu goes
+ * back to the top level.
+ */
+#define MLFQ_ALLOTMENT(pri)	(1U << (pri))
+#define MLFQ_BOOST_SCHEDULES	25
+
+/*
+ * Number of times an idle cpu will try the run queue lock of the cpu
+ * it wants to steal from before giving up and going idle.
+ */
+#define STEAL_LOCK_TRIES	2
+
+/*
+ * Weight of the newest run in t_runavg, as a shift: each run counts
+ * for 1/(1<<RUNAVG_DECAY) of the average.
+ */
+#define RUNAVG_DECAY		2
+
+/*
+ * EDF bookkeeping. Utilizations (budget/period) are kept in
+ * 1/EDF_UTILSCALE of a cpu, rounded up so admission errs on the safe
+ * side. EDF_BEFORE compares hardclock counts, allowing for wrap.
+ */
+#define EDF_UTILSCALE		1024
+#define EDF_UTIL(budget, period) \
+	(((budget) * EDF_UTILSCALE + (period) - 1) / (period))
+#define EDF_BEFORE(a, b)	((int)((a) - (b)) < 0)
+
 /* Wait channel. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -69,8 +104,76 @@ DECLARRAY(cpu);
 DEFARRAY(cpu, /*no inline*/ );
 static struct cpuarray allcpus;
 
+/* Scheduling policy; see thread.h. */
+int sched_policy = SCHED_MLFQ;
+const char *const sched_policynames[SCHED_NPOLICIES] = {
+	"rr", "mlfq", "stride",
+};
+
+/*
+ * Virtual time for SCHED_STRIDE: the pass of the process most recently
+ * picked to run, on any cpu. It's only a hint, so it isn't locked.
+ */
+static volatile unsigned stride_vtime;
+
+/* Protects c_edfutil of every cpu. */
+static struct spinlock edf_admit_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Migration tuning; see thread_consider_migration.
+ *
+ * A thread that hasn't run on this cpu for sched_migrate_coldticks
+ * hardclocks is assumed to have nothing left in the cache. A thread
+ * whose estimated migration cost exceeds sched_migrate_maxcost is
+ * never pushed to another cpu.
+ */
+unsigned sched_migrate_coldticks = 8;
+unsigned sched_migrate_maxcost = RUNAVG_SCALE;
+
+/* Thread cache size; see thread_cache_put. */
+unsigned thread_cache_max = 16;
+
+/* Scheduler statistics timing; see thread_printstats. */
+unsigned schedstat_timing = 1;
+
+/*
+ * Each cpu's scheduler statistics as of the last reset. Only
+ * thread_printstats uses these, so that the counters themselves are
+ * never written by any cpu but their own.
+ */
+static struct schedstat schedstat_base[CPUMASK_BITS];
+
+/*
+ * Gang scheduling state; see "Gang scheduling" below. gang_lock
+ * protects all of it, as well as p_gang and p_gangready of every
+ * process; it nests inside run queue locks. The volatile ones are
+ * also peeked at without it.
+ */
+static struct spinlock gang_lock = SPINLOCK_INITIALIZER;
+static struct proc *gang_procs[GANG_MAXPROCS];	/* Processes in gang mode */
+static volatile unsigned gang_nprocs;		/* Entries in gang_procs */
+static unsigned gang_slot;		/* Current slot; gang_nprocs is the open one */
+static struct proc *volatile gang_current;	/* Gang of the slot, or NULL */
+static volatile unsigned gang_nready;	/* Ready threads of gang_current */
+static volatile unsigned gang_nwaiting;	/* Ready threads of all gangs */
+static unsigned gang_ticks;		/* Hardclocks into the slot; cpu 0 only */
+unsigned sched_gang_slice = 4;
+
 /* Used to wait for secondary CPUs to come online. */
-static struct semaphore *cpu_startup_sem;
+static struct latch *cpu_startup_latch;
+
+/*
+ * RCU state; see "Read-copy-update" below. rcu_lock protects all of
+ * it and is a leaf. rcu_gpnum is also peeked at without it.
+ */
+static struct spinlock rcu_lock = SPINLOCK_INITIALIZER;
+static volatile unsigned rcu_gpnum;	/* Last grace period started */
+static unsigned rcu_gpdone;		/* Last grace period finished */
+static cpumask_t rcu_qsneeded;		/* Cpus it's still waiting for */
+static struct rcu_head *rcu_nextcbs;	/* Calls that need the next one */
+static struct rcu_head *rcu_curcbs;	/* Calls waiting for rcu_gpnum */
+static struct rcu_head *volatile rcu_donecbs; /* Calls ready to make */
+static struct wchan *rcu_wchan;		/* For synchronize_rcu */
 
 ////////////////////////////////////////////////////////////
 
@@ -112,37 +215,84 @@ thread_checkstack(struct thread *thread)
 }
 
 /*
- * Create a thread. This is used both to create a first thread
- * for each CPU and to create subsequent forked threads.
+ * Give a thread a name. Short names go in t_namebuf so that they
+ * don't cost an allocation.
  */
 static
-struct thread *
-thread_create(const char *name)
+int
+thread_setname(struct thread *thread, const char *name)
 {
-	struct thread *thread;
-
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
-	if (thread == NULL) {
-		return NULL;
+	if (strlen(name) < sizeof(thread->t_namebuf)) {
+		strcpy(thread->t_namebuf, name);
+		thread->t_name = thread->t_namebuf;
+		return 0;
 	}
-
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
+		return ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * Undo thread_setname.
+ */
+static
+void
+thread_clearname(struct thread *thread)
+{
+	if (thread->t_name != NULL && thread->t_name != thread->t_namebuf) {
+		kfree(thread->t_name);
 	}
+	thread->t_name = NULL;
+}
+
+/*
+ * Initialize everything in a thread except its name and stack. This
+ * is used both for new threads and for ones reused from the cache.
+ */
+static
+void
+thread_init(struct thread *thread)
+{
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
+	thread->t_runlevel = 0;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_affinity = CPUMASK_ALL;
+
+	/* Scheduler fields; new threads start at the top level */
+	thread->t_priority = SCHED_TOPPRI;
+	thread->t_slices = 0;
+	thread->t_inherited = SCHED_NLEVELS;
+	thread->t_waitpri = SCHED_NLEVELS;
+	thread->t_blockedon = NULL;
+	thread->t_heldlocks = NULL;
+	thread->t_handoff = NULL;
+	thread->t_rcu_nesting = 0;
+	thread->t_lastcpu = NULL;
+	thread->t_runstart = 0;
+	thread->t_lastran = 0;
+	thread->t_runavg = 0;
+	thread->t_readytime = 0;
+	thread->t_load = LOAD_SCALE;
+	thread->t_loadcpu = NULL;
+	thread->t_loadstamp = 0;
+	thread->t_edf_period = 0;
+	thread->t_edf_budget = 0;
+	thread->t_edf_release = 0;
+	thread->t_edf_deadline = 0;
+	thread->t_edf_used = 0;
+	thread->t_edf_done = false;
+	thread->t_edf_misses = 0;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -150,6 +300,29 @@ thread_create(const char *name)
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
 	/* If you add to struct thread, be sure to initialize here */
+}
+
+/*
+ * Create a thread. This is used both to create a first thread
+ * for each CPU and to create subsequent forked threads.
+ */
+static
+struct thread *
+thread_create(const char *name)
+{
+	struct thread *thread;
+
+	thread = kmalloc(sizeof(*thread));
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	if (thread_setname(thread, name)) {
+		kfree(thread);
+		return NULL;
+	}
+	thread->t_stack = NULL;
+	thread_init(thread);
 
 	return thread;
 }
@@ -167,6 +340,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -180,10 +354,32 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_idleclocks = 0;
+	c->c_noyieldclocks = 0;
+	c->c_skippedclocks = 0;
+	threadlist_init(&c->c_threadcache);
+	c->c_lastas = NULL;
+	c->c_lastasgen = 0;
+	c->c_asreloads = 0;
+	c->c_aselided = 0;
+	bzero(&c->c_stats, sizeof(c->c_stats));
+	c->c_schedules = 0;
+	c->c_rcu_gp = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	runqueue_init(&c->c_runqueue);
+	threadlist_init(&c->c_edfqueue);
+	threadlist_init(&c->c_gangstaged);
+	c->c_load = 0;
 	spinlock_init(&c->c_runqueue_lock);
+	c->c_edfutil = 0;
+
+	c->c_inbox_pending = false;
+	c->c_gangproc = NULL;
+	for (i=0; i<INBOX_MAXCPUS; i++) {
+		c->c_inbox[i].ib_head = 0;
+		c->c_inbox[i].ib_tail = 0;
+	}
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
@@ -193,6 +389,12 @@ cpu_create(unsigned hardware_number)
 	if (result != 0) {
 		panic("cpu_create: array_add: %s\n", strerror(result));
 	}
+	if (c->c_number >= INBOX_MAXCPUS) {
+		panic("cpu_create: too many cpus for the wakeup inbox\n");
+	}
+	if (c->c_number >= CPUMASK_BITS) {
+		panic("cpu_create: too many cpus for cpumask_t\n");
+	}
 
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
 	c->c_curthread = thread_create(namebuf);
@@ -227,6 +429,27 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Look up a cpu by its software number.
+ */
+struct cpu *
+cpu_get(unsigned num)
+{
+	if (num >= cpuarray_num(&allcpus)) {
+		return NULL;
+	}
+	return cpuarray_get(&allcpus, num);
+}
+
+/*
+ * Count the cpus.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
 /*
  * Destroy a thread.
  *
@@ -258,10 +481,76 @@ thread_destroy(struct thread *thread)
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
-	kfree(thread->t_name);
+	thread_clearname(thread);
 	kfree(thread);
 }
 
+/*
+ * Thread cache.
+ *
+ * Rather than freeing dead threads, exorcise() puts them on the
+ * current cpu's c_threadcache, stack and all, so thread_fork can
+ * reuse them without going through kmalloc. The stack guard band is
+ * checked on the way in and left alone, so it doesn't need to be set
+ * up again.
+ *
+ * The cache is only touched by its own cpu with interrupts off.
+ * Each cpu keeps at most thread_cache_max threads; anything beyond
+ * that (including after thread_cache_max is lowered) is freed.
+ */
+static
+void
+thread_cache_put(struct thread *thread)
+{
+	struct cpu *c = curcpu->c_self;
+
+	KASSERT(curthread->t_iplhigh_count > 0);
+
+	if (thread->t_stack == NULL ||
+	    c->c_threadcache.tl_count >= thread_cache_max) {
+		thread_destroy(thread);
+	}
+	else {
+		thread_checkstack(thread);
+		thread_clearname(thread);
+		thread->t_wchan_name = "CACHED";
+		threadlist_addhead(&c->c_threadcache, thread);
+	}
+
+	/* Trim down to the high-water mark. */
+	while (c->c_threadcache.tl_count > thread_cache_max) {
+		thread = threadlist_remtail(&c->c_threadcache);
+		thread_destroy(thread);
+	}
+}
+
+/*
+ * Get a thread, with stack, from the current cpu's cache, or NULL if
+ * it's empty.
+ */
+static
+struct thread *
+thread_cache_get(const char *name)
+{
+	struct thread *thread;
+	int spl;
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_threadcache);
+	splx(spl);
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	if (thread_setname(thread, name)) {
+		thread_destroy(thread);
+		return NULL;
+	}
+	thread_machdep_cleanup(&thread->t_machdep);
+	thread_init(thread);
+	return thread;
+}
+
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
  * need to have thread_destroy called on them.)
@@ -277,7 +566,7 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		thread_cache_put(z);
 	}
 }
 
@@ -303,9 +592,8 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = NULL;
-	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	curcpu->c_runqueue.rq_count = 0;
+	curcpu->c_runqueue.rq_nonempty = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -380,6 +668,11 @@ thread_bootstrap(void)
 	/* cpu_create() should have set t_proc. */
 	KASSERT(curthread->t_proc != NULL);
 
+	rcu_wchan = wchan_create("rcu");
+	if (rcu_wchan == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/* Done */
 }
 
@@ -402,7 +695,7 @@ cpu_hatch(unsigned software_number)
 
 	kprintf("cpu%u: %s\n", software_number, cpu_identify());
 
-	V(cpu_startup_sem);
+	latch_countdown(cpu_startup_latch);
 	thread_exit();
 }
 
@@ -412,128 +705,1464 @@ cpu_hatch(unsigned software_number)
 void
 thread_start_cpus(void)
 {
-	unsigned i;
-
 	kprintf("cpu0: %s\n", cpu_identify());
 
-	cpu_startup_sem = sem_create("cpu_hatch", 0);
-	mainbus_start_cpus();
-	
-	for (i=0; i<cpuarray_num(&allcpus) - 1; i++) {
-		P(cpu_startup_sem);
+	/*
+	 * The cpus were all found (and are in allcpus) during
+	 * mainbus_bootstrap; this just lets them go. Wait for each of
+	 * them but us to check in.
+	 */
+	cpu_startup_latch = latch_create("cpu_hatch",
+					 cpuarray_num(&allcpus) - 1);
+	if (cpu_startup_latch == NULL) {
+		panic("thread_start_cpus: latch_create failed\n");
 	}
-	sem_destroy(cpu_startup_sem);
-	cpu_startup_sem = NULL;
+	mainbus_start_cpus();
+
+	latch_wait(cpu_startup_latch);
+	latch_destroy(cpu_startup_latch);
+	cpu_startup_latch = NULL;
 }
 
 /*
- * Make a thread runnable.
+ * EDF class.
  *
- * targetcpu might be curcpu; it might not be, too. 
+ * Runnable EDF threads sit on their cpu's c_edfqueue, which is always
+ * searched before the ordinary run queue. Their deadlines keep moving,
+ * so it isn't kept sorted; there are never many EDF threads.
+ *
+ * A thread's period ends at t_edf_deadline. If it hasn't called
+ * thread_edf_wait() by then, that counts as a miss. Either way, it
+ * then gets a fresh budget for the next period. A thread that uses up
+ * its budget waits for the next period like one that has finished.
+ */
+
+/*
+ * Bring T's period up to date as of hardclock NOW.
  */
 static
 void
-thread_make_runnable(struct thread *target, bool already_have_lock)
+thread_edf_advance(struct thread *t, unsigned now)
 {
-	struct cpu *targetcpu;
-	bool isidle;
+	unsigned n;
 
-	/* Lock the run queue of the target thread's cpu. */
-	targetcpu = target->t_cpu;
-
-	if (already_have_lock) {
-		/* The target thread's cpu should be already locked. */
-		KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
-	}
-	else {
-		spinlock_acquire(&targetcpu->c_runqueue_lock);
+	if (EDF_BEFORE(now, t->t_edf_deadline)) {
+		return;
 	}
 
-	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
-	if (isidle) {
-		/*
-		 * Other processor is idle; send interrupt to make
-		 * sure it unidles.
-		 */
-		ipi_send(targetcpu, IPI_UNIDLE);
-	}
+	/* Number of periods that have ended. */
+	n = (now - t->t_edf_deadline) / t->t_edf_period + 1;
+	t->t_edf_misses += t->t_edf_done ? n - 1 : n;
+	t->t_edf_release = t->t_edf_deadline + (n - 1) * t->t_edf_period;
+	t->t_edf_deadline = t->t_edf_release + t->t_edf_period;
+	t->t_edf_used = 0;
+	t->t_edf_done = false;
+}
 
-	if (!already_have_lock) {
-		spinlock_release(&targetcpu->c_runqueue_lock);
+/*
+ * Whether EDF thread T is entitled to run at hardclock NOW.
+ */
+static
+bool
+thread_edf_eligible(struct thread *t, unsigned now)
+{
+	return !t->t_edf_done && t->t_edf_used < t->t_edf_budget &&
+		!EDF_BEFORE(now, t->t_edf_release);
+}
+
+/*
+ * Take the eligible EDF thread with the earliest deadline off a cpu's
+ * EDF queue, if there is one. The run queue must be locked.
+ */
+static
+struct thread *
+thread_edf_next(struct cpu *c)
+{
+	struct thread *t, *best;
+	unsigned now;
+
+	best = NULL;
+	now = c->c_hardclocks;
+	THREADLIST_FORALL(t, c->c_edfqueue) {
+		thread_edf_advance(t, now);
+		if (thread_edf_eligible(t, now) && (best == NULL ||
+		    EDF_BEFORE(t->t_edf_deadline, best->t_edf_deadline))) {
+			best = t;
+		}
 	}
+	if (best != NULL) {
+		threadlist_remove(&c->c_edfqueue, best);
+	}
+	return best;
 }
 
 /*
- * Create a new thread based on an existing one.
+ * Gang scheduling.
  *
- * The new thread has name NAME, and starts executing in function
- * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
+ * Runnable threads of a process in gang mode don't go on the per-cpu
+ * run queues; they wait on the process's p_gangready list instead.
+ * Cpu 0 divides time into slots of sched_gang_slice hardclocks, gives
+ * one slot to each gang in turn and then an open slot to everyone
+ * else, and tells the other cpus with IPI_GANG when a slot starts.
+ * During its slot a gang's threads come before everything but EDF
+ * threads, so they all run at once, on as many cpus as there are.
+ * Outside it they only get cpus that have nothing else to run.
  *
- * The new thread is created in the process P. If P is null, the
- * process is inherited from the caller. It will start on the same CPU
- * as the caller, unless the scheduler intervenes first.
+ * The point is that threads that synchronize closely (spinning on
+ * each other, or handing a lock back and forth) run together instead
+ * of waiting for each other to get scheduled.
+ *
+ * Once a thread is on a gang's list any cpu can take it and switch to
+ * it, so it mustn't get there while its own cpu may still be
+ * switching away from it, with its context not yet saved. A gang
+ * thread made runnable therefore goes through its cpu's run queue
+ * lock like any other, and waits on that cpu's c_gangstaged list
+ * until thread_gang_publish moves it to the gang.
  */
-int
-thread_fork(const char *name,
-	    struct proc *proc,
-	    void (*entrypoint)(void *data1, unsigned long data2),
-	    void *data1, unsigned long data2)
+
+/*
+ * True if T belongs on its gang's ready list rather than a run queue.
+ * Peeks at p_gang without the gang lock; hardly anything is in gang
+ * mode, so this is a cheap first check.
+ */
+static
+bool
+thread_gang_member(const struct thread *t)
 {
-	struct thread *newthread;
-	int result;
+	return t->t_edf_period == 0 && t->t_proc != NULL &&
+		t->t_proc->p_gang;
+}
 
-#ifdef UW
-	DEBUG(DB_THREADS,"Forking thread: %s\n",name);
-#endif // UW
+/*
+ * Put T on its gang's ready list, if its process is in gang mode.
+ * Returns false, having done nothing, if it isn't.
+ */
+static
+bool
+thread_gang_add(struct thread *t)
+{
+	struct proc *p;
 
-	newthread = thread_create(name);
-	if (newthread == NULL) {
-		return ENOMEM;
+	if (!thread_gang_member(t)) {
+		return false;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+	p = t->t_proc;
+	spinlock_acquire(&gang_lock);
+	if (!p->p_gang) {
+		spinlock_release(&gang_lock);
+		return false;
 	}
-	thread_checkstack_init(newthread);
+	threadlist_addtail(&p->p_gangready, t);
+	gang_nwaiting++;
+	if (p == gang_current) {
+		gang_nready++;
+	}
+	spinlock_release(&gang_lock);
+	return true;
+}
 
-	/*
-	 * Now we clone various fields from the parent thread.
-	 */
+/*
+ * Take the first thread on gang P's ready list that may run on cpu C.
+ * The gang lock must be held.
+ */
+static
+struct thread *
+thread_gang_take(struct proc *p, struct cpu *c)
+{
+	struct thread *t;
 
-	/* Thread subsystem fields */
-	newthread->t_cpu = curthread->t_cpu;
+	KASSERT(spinlock_do_i_hold(&gang_lock));
 
-	/* Attach the new thread to its process */
-	if (proc == NULL) {
-		proc = curthread->t_proc;
+	THREADLIST_FORALL(t, p->p_gangready) {
+		if (CPUMASK_HAS(t->t_affinity, c->c_number)) {
+			threadlist_remove(&p->p_gangready, t);
+			gang_nwaiting--;
+			if (p == gang_current) {
+				gang_nready--;
+			}
+			return t;
+		}
 	}
-	result = proc_addthread(proc, newthread);
-	if (result) {
-		/* thread_destroy will clean up the stack */
-		thread_destroy(newthread);
-		return result;
+	return NULL;
+}
+
+/*
+ * Take a gang thread for cpu C to run. If FILLER is false it must be
+ * one of the current gang's; if it's true, it can be any gang's,
+ * looking at each in slot order after the current one.
+ */
+static
+struct thread *
+thread_gang_next(struct cpu *c, bool filler)
+{
+	struct thread *t;
+	unsigned i, n;
+
+	if ((filler ? gang_nwaiting : gang_nready) == 0) {
+		return NULL;
 	}
 
-	/*
-	 * Because new threads come out holding the cpu runqueue lock
-	 * (see notes at bottom of thread_switch), we need to account
-	 * for the spllower() that will be done releasing it.
-	 */
-	newthread->t_iplhigh_count++;
+	t = NULL;
+	spinlock_acquire(&gang_lock);
+	if (!filler) {
+		if (gang_current != NULL) {
+			t = thread_gang_take(gang_current, c);
+		}
+	}
+	else {
+		n = gang_nprocs;
+		for (i=0; i<n && t == NULL; i++) {
+			t = thread_gang_take(gang_procs[(gang_slot + 1 + i) % n],
+					     c);
+		}
+	}
+	spinlock_release(&gang_lock);
+
+	if (t != NULL) {
+		t->t_cpu = c;
+	}
+	return t;
+}
+
+/*
+ * True if the gang scheduler wants the cpu running CUR to switch: the
+ * current gang has threads waiting and CUR isn't in it, or CUR is in
+ * a gang and other gang threads are waiting for a turn. Looks without
+ * locking, so it's only a hint.
+ */
+static
+bool
+thread_gang_wantswitch(struct thread *cur)
+{
+	struct proc *p;
+
+	p = cur->t_proc;
+	if (gang_nready > 0 && p != gang_current) {
+		return true;
+	}
+	if (p != NULL && p->p_gang && gang_nwaiting > 0) {
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Find a cpu to run a thread of gang P, allowed on the cpus in MASK,
+ * that was just made ready: an idle one if there is one, or during
+ * P's slot, one that isn't running P. Peeks without locking; if it
+ * misses, the thread waits for a tick or for a cpu to go idle.
+ */
+static
+void
+thread_gang_kick(struct proc *p, cpumask_t mask)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self && c->c_isidle &&
+		    CPUMASK_HAS(mask, c->c_number)) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+	if (p != gang_current) {
+		return;
+	}
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self && c->c_gangproc != p &&
+		    CPUMASK_HAS(mask, c->c_number)) {
+			ipi_send(c, IPI_GANG);
+			return;
+		}
+	}
+}
+
+/*
+ * Put a thread on a cpu's run queue. The run queue must be locked.
+ *
+ * EDF threads go on the separate EDF queue, and threads in gang mode
+ * on the cpu's c_gangstaged list, for thread_gang_publish to move to
+ * their gang's ready list.
+ *
+ * Under SCHED_MLFQ the thread goes on the end of the run queue level
+ * for its effective priority, so the queue reads in priority order
+ * without any searching (see threadlist.h). Under SCHED_RR and
+ * SCHED_STRIDE everything goes on level 0; stride order is worked out
+ * when picking (see thread_runqueue_next) because passes keep moving.
+ *
+ * Under SCHED_STRIDE a process whose pass has fallen behind the
+ * virtual time, because its threads have all been asleep, is brought
+ * up to it here; otherwise it would come back with a pile of banked
+ * credit and lock everyone else out until it had spent it.
+ */
+static
+void
+thread_runqueue_add(struct cpu *c, struct thread *t)
+{
+	struct proc *p;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	if (t->t_edf_period != 0) {
+		threadlist_addtail(&c->c_edfqueue, t);
+		return;
+	}
+	if (thread_gang_member(t)) {
+		threadlist_addtail(&c->c_gangstaged, t);
+		return;
+	}
+
+	if (sched_policy == SCHED_STRIDE && t->t_proc != NULL) {
+		p = t->t_proc;
+		spinlock_acquire(&p->p_lock);
+		if (STRIDE_BEFORE(p->p_pass, stride_vtime)) {
+			p->p_pass = stride_vtime;
+		}
+		spinlock_release(&p->p_lock);
+	}
+
+	/* Other policies use level 0 only, as a plain FIFO. */
+	runqueue_add(&c->c_runqueue, t,
+		     sched_policy == SCHED_MLFQ ? THREAD_PRIORITY(t) : 0);
+}
+
+/*
+ * Move the gang threads staged on cpu C to their gangs' ready lists,
+ * where any cpu can take them, and find cpus to run them.
+ *
+ * C's run queue must be locked, and C must not be partway through a
+ * switch: call this after switchframe_switch returns, or after taking
+ * the lock of some other cpu (which can't be switching, then, except
+ * from its idle loop). The one thread C may still be switching away
+ * from in its idle loop is its curthread, so that one is always left
+ * staged; C can run it itself (see thread_runqueue_next), and it's
+ * published after C's next switch.
+ *
+ * A thread whose gang was broken up meanwhile goes on C's run queue
+ * instead.
+ */
+static
+void
+thread_gang_publish(struct cpu *c)
+{
+	struct thread *t;
+	struct proc *p;
+	cpumask_t mask;
+	unsigned n;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	/* Count, since each thread may come straight back. */
+	for (n = c->c_gangstaged.tl_count; n > 0; n--) {
+		t = threadlist_remhead(&c->c_gangstaged);
+		if (t == c->c_curthread) {
+			threadlist_addtail(&c->c_gangstaged, t);
+			continue;
+		}
+		/* Once it's on the gang's list, it may be gone. */
+		p = t->t_proc;
+		mask = t->t_affinity;
+		if (thread_gang_add(t)) {
+			thread_gang_kick(p, mask);
+		}
+		else {
+			thread_runqueue_add(c, t);
+		}
+	}
+}
+
+/*
+ * Take the next thread to run off a cpu's run queues.
+ *
+ * Eligible EDF threads always come first, then threads of the gang
+ * whose slot it is. After that, under SCHED_STRIDE it's the first
+ * thread whose process has the lowest pass; otherwise it's just the
+ * head of the queue. Passes are read without p_lock; a stale one only
+ * costs a slightly unfair pick. If the queue is empty, any gang's
+ * thread can fill in, and failing that, one of the gang threads
+ * staged here.
+ */
+static
+struct thread *
+thread_runqueue_next(struct cpu *c)
+{
+	struct thread *t, *best;
+	unsigned pass, bestpass;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	if (!threadlist_isempty(&c->c_edfqueue)) {
+		t = thread_edf_next(c);
+		if (t != NULL) {
+			return t;
+		}
+	}
+
+	t = thread_gang_next(c, false);
+	if (t != NULL) {
+		return t;
+	}
+
+	if (sched_policy != SCHED_STRIDE) {
+		best = runqueue_remhead(&c->c_runqueue);
+	}
+	else {
+		best = NULL;
+		bestpass = 0;
+		RUNQUEUE_FORALL(t, c->c_runqueue) {
+			pass = t->t_proc != NULL ?
+				t->t_proc->p_pass : stride_vtime;
+			if (best == NULL || STRIDE_BEFORE(pass, bestpass)) {
+				best = t;
+				bestpass = pass;
+			}
+		}
+		if (best != NULL) {
+			runqueue_remove(&c->c_runqueue, best);
+			stride_vtime = bestpass;
+		}
+	}
+
+	if (best == NULL) {
+		best = thread_gang_next(c, true);
+	}
+	if (best == NULL) {
+		best = threadlist_remhead(&c->c_gangstaged);
+	}
+	return best;
+}
+
+/*
+ * Post a thread to another cpu's wakeup inbox (see cpu.h).
+ *
+ * Returns false, having done nothing, if TARGETCPU is the current cpu
+ * or our ring in its inbox is full; the caller should then put the
+ * thread on the run queue the ordinary way. An IPI is sent only when
+ * the inbox goes from empty to nonempty; the target clears
+ * c_inbox_pending before draining, so a wakeup that races with the
+ * drain always either gets drained or sends a fresh IPI.
+ */
+static
+bool
+thread_inbox_post(struct cpu *targetcpu, struct thread *target)
+{
+	struct cpu_inbox *ib;
+	bool posted;
+	int spl;
+
+	/* Stay on this cpu; we're the only producer for our ring. */
+	spl = splhigh();
+
+	posted = false;
+	if (targetcpu != curcpu->c_self) {
+		ib = &targetcpu->c_inbox[curcpu->c_number];
+		if (ib->ib_tail - ib->ib_head < INBOX_SLOTS) {
+			ib->ib_ring[ib->ib_tail % INBOX_SLOTS] = target;
+			ib->ib_tail++;
+			posted = true;
+
+			if (!targetcpu->c_inbox_pending) {
+				targetcpu->c_inbox_pending = true;
+				ipi_send(targetcpu, IPI_UNIDLE);
+			}
+		}
+	}
+
+	splx(spl);
+	return posted;
+}
+
+/*
+ * Move everything in the current cpu's wakeup inbox onto its run
+ * queue. The run queue must be locked.
+ */
+static
+void
+thread_inbox_drain(void)
+{
+	struct cpu_inbox *ib;
+	struct thread *t;
+	unsigned i, numcpus;
+
+	KASSERT(spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	if (!curcpu->c_inbox_pending) {
+		return;
+	}
+	curcpu->c_inbox_pending = false;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		ib = &curcpu->c_inbox[i];
+		while (ib->ib_head != ib->ib_tail) {
+			t = ib->ib_ring[ib->ib_head % INBOX_SLOTS];
+			ib->ib_head++;
+			thread_runqueue_add(curcpu, t);
+		}
+	}
+}
+
+/*
+ * If T is sitting on its cpu's run queue, take it off and put it back
+ * so it lands in the right place for its effective priority. If it's
+ * anywhere else (running, asleep, in an inbox, or in the middle of
+ * being migrated) it'll be queued properly the next time it's made
+ * runnable, so there's nothing to do.
+ *
+ * We have to search for it, because t_listnode being in use doesn't
+ * tell us which list it's on. If it is on the run queue, though, it's
+ * on the level in its t_runlevel, so that's the only one to search.
+ * This only happens when a lock holder's priority changes, which is
+ * already a slow path.
+ */
+void
+thread_reposition(struct thread *t)
+{
+	struct cpu *c;
+	struct thread *t2;
+
+	if (sched_policy != SCHED_MLFQ) {
+		return;
+	}
+
+	c = t->t_cpu;
+	spinlock_acquire(&c->c_runqueue_lock);
+	THREADLIST_FORALL(t2, c->c_runqueue.rq_levels[t->t_runlevel]) {
+		if (t2 == t) {
+			runqueue_remove(&c->c_runqueue, t);
+			thread_runqueue_add(c, t);
+			break;
+		}
+	}
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+/*
+ * Load tracking.
+ *
+ * Each cpu's load (c_load) is brought up to date on every hardclock
+ * from the number of threads runnable there, including the one
+ * running. A thread's load (t_load) is only brought up to date when
+ * it wakes up and when it stops being runnable; in between it's
+ * runnable the whole time, so thread_load can work out the current
+ * value. When a thread migrates, its load moves with it, so that
+ * both cpus see the change at once instead of over a few half-lives;
+ * otherwise the cpu it left would still look busy and pull it back.
+ */
+
+/*
+ * 2^(-k/LOAD_HALFLIFE) for k < LOAD_HALFLIFE, in 1/65536.
+ */
+static const uint32_t load_decaytab[LOAD_HALFLIFE] = {
+	65536, 64132, 62757, 61413, 60097, 58809, 57549, 56316,
+	55109, 53928, 52773, 51642, 50535, 49452, 48393, 47356,
+	46341, 45348, 44376, 43425, 42495, 41584, 40693, 39821,
+	38968, 38133, 37316, 36516, 35734, 34968, 34219, 33486,
+};
+
+/*
+ * LOAD decayed over NCLOCKS hardclocks.
+ */
+static
+unsigned
+load_decay(unsigned load, unsigned nclocks)
+{
+	if (nclocks >= 32 * LOAD_HALFLIFE) {
+		return 0;
+	}
+	load >>= nclocks / LOAD_HALFLIFE;
+	return ((uint64_t)load * load_decaytab[nclocks % LOAD_HALFLIFE]) >> 16;
+}
+
+/*
+ * LOAD after NCLOCKS more hardclocks with NR threads runnable.
+ */
+static
+unsigned
+load_accum(unsigned load, unsigned nclocks, unsigned nr)
+{
+	return load_decay(load, nclocks) +
+		nr * (LOAD_SCALE - load_decay(LOAD_SCALE, nclocks));
+}
+
+/*
+ * Current load of T, which must be runnable (or running).
+ */
+static
+unsigned
+thread_load(struct thread *t)
+{
+	unsigned load;
+
+	if (t->t_loadcpu == NULL) {
+		return t->t_load;
+	}
+	load = load_accum(t->t_load,
+			  t->t_loadcpu->c_hardclocks - t->t_loadstamp, 1);
+	return load > LOAD_SCALE ? LOAD_SCALE : load;
+}
+
+/*
+ * Bring T's load up to date. It was runnable since the last update if
+ * RUNNABLE is true, and asleep if not. Interrupts must be off, so we
+ * stay on the cpu we stamp it with.
+ */
+static
+void
+thread_load_update(struct thread *t, bool runnable)
+{
+	if (t->t_loadcpu != NULL) {
+		t->t_load = runnable ? thread_load(t) :
+			load_decay(t->t_load,
+				   t->t_loadcpu->c_hardclocks - t->t_loadstamp);
+	}
+	t->t_loadcpu = curcpu->c_self;
+	t->t_loadstamp = curcpu->c_hardclocks;
+}
+
+/*
+ * Move LOAD out of cpu C's load. C's run queue must be locked.
+ */
+static
+void
+thread_load_remove(struct cpu *c, unsigned load)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	c->c_load = c->c_load > load ? c->c_load - load : 0;
+}
+
+/*
+ * Update the current cpu's load; see thread.h.
+ */
+void
+thread_load_tick(unsigned nclocks)
+{
+	unsigned nr;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	nr = curcpu->c_runqueue.rq_count + curcpu->c_edfqueue.tl_count;
+	if (!curcpu->c_isidle) {
+		nr++;
+	}
+	curcpu->c_load = load_accum(curcpu->c_load, nclocks, nr);
+	spinlock_release(&curcpu->c_runqueue_lock);
+}
+
+/*
+ * Find the cpu in MASK, other than EXCLUDE, with the lowest load,
+ * or if loads are equal the fewest threads on its run queue. Both are
+ * peeked at without locking, so this is only a hint. Returns NULL if
+ * there's no such cpu.
+ */
+static
+struct cpu *
+thread_leastloaded(cpumask_t mask, struct cpu *exclude)
+{
+	struct cpu *c, *best;
+	unsigned i, numcpus;
+
+	best = NULL;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == exclude || !CPUMASK_HAS(mask, c->c_number)) {
+			continue;
+		}
+		if (best == NULL || c->c_load < best->c_load ||
+		    (c->c_load == best->c_load &&
+		     c->c_runqueue.rq_count < best->c_runqueue.rq_count)) {
+			best = c;
+		}
+	}
+	return best;
+}
+
+/*
+ * The time for the scheduler statistics, in microseconds, or 0 if
+ * schedstat_timing is off.
+ */
+static
+uint64_t
+schedstat_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	if (!schedstat_timing) {
+		return 0;
+	}
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000 + nsecs / 1000;
+}
+
+/*
+ * Wait histogram bucket for USECS microseconds; see struct schedstat.
+ */
+static
+unsigned
+schedstat_bucket(uint64_t usecs)
+{
+	unsigned b;
+
+	for (b=0; usecs > 0 && b < SCHEDSTAT_BUCKETS - 1; b++) {
+		usecs >>= 1;
+	}
+	return b;
+}
+
+/*
+ * Make a thread runnable.
+ *
+ * targetcpu might be curcpu; it might not be, too. If it isn't, the
+ * thread normally goes through targetcpu's wakeup inbox.
+ *
+ * The thread always goes back to its own cpu, even if its affinity
+ * mask no longer allows it there. That cpu may still be in the middle
+ * of switching away from it, holding its run queue lock until the
+ * switch is done; the thread mustn't be visible to any other cpu
+ * until then. A stray is moved on later, under the run queue locks,
+ * by thread_consider_migration or by a cpu that steals it.
+ */
+static
+void
+thread_make_runnable(struct thread *target, bool already_have_lock)
+{
+	struct cpu *targetcpu;
+	bool isidle, gang;
+	int spl;
+
+	targetcpu = target->t_cpu;
+
+	/*
+	 * Start its run queue wait, and if it's waking up, count that
+	 * and bring its load up to date (a thread being preempted was
+	 * runnable all along). Interrupts must be off to touch our
+	 * statistics.
+	 */
+	target->t_readytime = schedstat_now();
+	if (!already_have_lock) {
+		spl = splhigh();
+		thread_load_update(target, false);
+		curcpu->c_stats.ss_wakeups++;
+		if (targetcpu != curcpu->c_self) {
+			curcpu->c_stats.ss_remotewakeups++;
+		}
+		splx(spl);
+	}
+
+	/*
+	 * A thread in gang mode waits for its gang's turn instead. It
+	 * doesn't go through the inbox: taking its cpu's run queue lock
+	 * here means that cpu is done switching away from it, so it can
+	 * be published to the gang right away.
+	 */
+	gang = thread_gang_member(target);
+	if (!already_have_lock && !gang &&
+	    thread_inbox_post(targetcpu, target)) {
+		return;
+	}
+
+	/* Lock the run queue of the target thread's cpu. */
+
+	if (already_have_lock) {
+		/* The target thread's cpu should be already locked. */
+		KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
+	}
+	else {
+		spinlock_acquire(&targetcpu->c_runqueue_lock);
+	}
+
+	isidle = targetcpu->c_isidle;
+	thread_runqueue_add(targetcpu, target);
+	if (gang && !already_have_lock) {
+		thread_gang_publish(targetcpu);
+	}
+	if (isidle) {
+		/*
+		 * Other processor is idle; send interrupt to make
+		 * sure it unidles.
+		 */
+		ipi_send(targetcpu, IPI_UNIDLE);
+	}
+
+	if (!already_have_lock) {
+		spinlock_release(&targetcpu->c_runqueue_lock);
+	}
+}
+
+/*
+ * Work stealing.
+ *
+ * This is called from the idle loop in thread_switch, with interrupts
+ * off and no run queue locks held, before the cpu goes to sleep in
+ * cpu_idle(). It picks the other cpu with the most runnable threads
+ * and takes the one off the tail of its run queue, which is the one
+ * that would otherwise wait longest.
+ *
+ * The victim's run queue lock is only ever tried, never waited for,
+ * and only STEAL_LOCK_TRIES times; several idle cpus spinning on one
+ * busy cpu's run queue lock would slow that cpu down for nothing. If
+ * we fail we just idle, and try again on the next interrupt.
+ * thread_consider_migration() still pushes work around as well.
+ *
+ * The stolen thread's load comes along with it; see "Load tracking".
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t, *t2;
+	unsigned i, numcpus, count, maxcount, load = 0;
+
+	victim = NULL;
+	maxcount = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		/* Unlocked peek; we'll check again with the lock held. */
+		count = c->c_runqueue.rq_count;
+		if (count > maxcount) {
+			maxcount = count;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	for (i=0; i<STEAL_LOCK_TRIES; i++) {
+		if (spinlock_tryacquire(&victim->c_runqueue_lock)) {
+			break;
+		}
+	}
+	if (i == STEAL_LOCK_TRIES) {
+		return NULL;
+	}
+
+	/*
+	 * If the victim is idle it's about to run what's on its queue
+	 * itself. Otherwise take the last thread that's allowed to run
+	 * here, but not the victim's curthread; see the comments in
+	 * thread_consider_migration.
+	 */
+	t = NULL;
+	if (!victim->c_isidle) {
+		RUNQUEUE_FORALL_REV(t2, victim->c_runqueue) {
+			if (t2 != victim->c_curthread &&
+			    CPUMASK_HAS(t2->t_affinity, curcpu->c_number)) {
+				t = t2;
+				break;
+			}
+		}
+		if (t != NULL) {
+			runqueue_remove(&victim->c_runqueue, t);
+			load = thread_load(t);
+			thread_load_remove(victim, load);
+		}
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (t != NULL) {
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		curcpu->c_load += load;
+		spinlock_release(&curcpu->c_runqueue_lock);
+		t->t_cpu = curcpu->c_self;
+		curcpu->c_stats.ss_steals++;
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u\n",
+		      t->t_name, victim->c_number, curcpu->c_number);
+	}
+	return t;
+}
+
+/*
+ * Common code for thread_fork, thread_fork_affinity, and
+ * thread_fork_edf. MASK is the new thread's cpu affinity, or 0 to
+ * take the process's. EDFCPU is NULL for an ordinary thread;
+ * otherwise the thread is an EDF thread with the given PERIOD and
+ * BUDGET, bound to EDFCPU.
+ */
+static
+int
+thread_fork_common(const char *name,
+		   struct proc *proc, cpumask_t mask,
+		   struct cpu *edfcpu, unsigned period, unsigned budget,
+		   void (*entrypoint)(void *data1, unsigned long data2),
+		   void *data1, unsigned long data2)
+{
+	struct thread *newthread;
+	int result;
+
+#ifdef UW
+	DEBUG(DB_THREADS,"Forking thread: %s\n",name);
+#endif // UW
+
+	/* Reuse a dead thread if we can; it already has a stack */
+	newthread = thread_cache_get(name);
+	if (newthread == NULL) {
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
+
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
+	}
+
+	/*
+	 * Now we clone various fields from the parent thread.
+	 */
+
+	/* Thread subsystem fields */
+	newthread->t_cpu = curthread->t_cpu;
+
+	/* EDF threads start their first period right away */
+	if (edfcpu != NULL) {
+		newthread->t_cpu = edfcpu;
+		newthread->t_edf_period = period;
+		newthread->t_edf_budget = budget;
+		newthread->t_edf_release = edfcpu->c_hardclocks;
+		newthread->t_edf_deadline = newthread->t_edf_release + period;
+	}
+
+	/* Attach the new thread to its process */
+	if (proc == NULL) {
+		proc = curthread->t_proc;
+	}
+	result = proc_addthread(proc, newthread);
+	if (result) {
+		/* thread_destroy will clean up the stack */
+		thread_destroy(newthread);
+		return result;
+	}
+
+	/*
+	 * Take the cpu affinity we were given, or else the process's.
+	 * If that excludes this cpu, start on the least loaded cpu it
+	 * allows instead. That's safe here, unlike in
+	 * thread_make_runnable, because the new thread isn't running
+	 * (or switching out) anywhere yet.
+	 */
+	newthread->t_affinity = mask != 0 ? mask : proc->p_affinity;
+	if (edfcpu == NULL &&
+	    !CPUMASK_HAS(newthread->t_affinity, curcpu->c_number)) {
+		newthread->t_cpu = thread_leastloaded(newthread->t_affinity,
+						      NULL);
+		KASSERT(newthread->t_cpu != NULL);
+	}
+
+	/*
+	 * Because new threads come out holding the cpu runqueue lock
+	 * (see notes at bottom of thread_switch), we need to account
+	 * for the spllower() that will be done releasing it.
+	 */
+	newthread->t_iplhigh_count++;
+
+	/* Set up the switchframe so entrypoint() gets called */
+	switchframe_init(newthread, entrypoint, data1, data2);
+
+	/* Lock the current cpu's run queue and make the new thread runnable */
+	thread_make_runnable(newthread, false);
+
+	return 0;
+}
+
+/*
+ * Create a new thread based on an existing one.
+ *
+ * The new thread has name NAME, and starts executing in function
+ * ENTRYPOINT. DATA1 and DATA2 are passed to ENTRYPOINT.
+ *
+ * The new thread is created in the process P. If P is null, the
+ * process is inherited from the caller. It will start on the same CPU
+ * as the caller, unless the scheduler intervenes first or the
+ * process's affinity doesn't allow that CPU.
+ */
+int
+thread_fork(const char *name,
+	    struct proc *proc,
+	    void (*entrypoint)(void *data1, unsigned long data2),
+	    void *data1, unsigned long data2)
+{
+	return thread_fork_common(name, proc, 0, NULL, 0, 0,
+				  entrypoint, data1, data2);
+}
+
+/*
+ * Create a new thread restricted to the cpus in MASK; see thread.h.
+ */
+int
+thread_fork_affinity(const char *name,
+		     struct proc *proc,
+		     cpumask_t mask,
+		     void (*entrypoint)(void *data1, unsigned long data2),
+		     void *data1, unsigned long data2)
+{
+	int result;
+
+	result = thread_checkaffinity(mask);
+	if (result) {
+		return result;
+	}
+	return thread_fork_common(name, proc, mask, NULL, 0, 0,
+				  entrypoint, data1, data2);
+}
+
+/*
+ * Create a new EDF thread; see thread.h.
+ *
+ * Admission control: EDF on one cpu meets every deadline as long as
+ * the threads' budget/period add up to no more than 1, so we put the
+ * new thread on the least loaded cpu, out of those in the process's
+ * affinity mask, that it still fits on, and fail if there isn't one.
+ */
+int
+thread_fork_edf(const char *name,
+		struct proc *proc,
+		unsigned period, unsigned budget,
+		void (*entrypoint)(void *data1, unsigned long data2),
+		void *data1, unsigned long data2)
+{
+	struct cpu *c, *best;
+	unsigned i, util;
+	cpumask_t mask;
+	int result;
+
+	if (period == 0 || budget == 0 || budget > period) {
+		return EINVAL;
+	}
+	util = EDF_UTIL(budget, period);
+	mask = (proc != NULL ? proc : curproc)->p_affinity;
+
+	best = NULL;
+	spinlock_acquire(&edf_admit_lock);
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (CPUMASK_HAS(mask, c->c_number) &&
+		    c->c_edfutil + util <= EDF_UTILSCALE &&
+		    (best == NULL || c->c_edfutil < best->c_edfutil)) {
+			best = c;
+		}
+	}
+	if (best != NULL) {
+		best->c_edfutil += util;
+	}
+	spinlock_release(&edf_admit_lock);
+	if (best == NULL) {
+		return EBUSY;
+	}
+
+	result = thread_fork_common(name, proc, 0, best, period, budget,
+				    entrypoint, data1, data2);
+	if (result) {
+		spinlock_acquire(&edf_admit_lock);
+		best->c_edfutil -= util;
+		spinlock_release(&edf_admit_lock);
+	}
+	return result;
+}
+
+/*
+ * Check that an affinity mask names at least one cpu that exists.
+ */
+int
+thread_checkaffinity(cpumask_t mask)
+{
+	return thread_leastloaded(mask, NULL) == NULL ? EINVAL : 0;
+}
+
+/*
+ * Set a thread's cpu affinity; see thread.h.
+ *
+ * We don't move the thread here; it might be running on another cpu,
+ * or on some run queue, or asleep. thread_consider_migration takes
+ * care of it once it's on a run queue.
+ */
+int
+thread_setaffinity(struct thread *t, cpumask_t mask)
+{
+	int result;
+
+	result = thread_checkaffinity(mask);
+	if (result) {
+		return result;
+	}
+	if (t->t_edf_period == 0) {
+		t->t_affinity = mask;
+	}
+	return 0;
+}
+
+/*
+ * Check whether a thread is running; see thread.h. An idle cpu's
+ * curthread is whatever went to sleep there last, so it doesn't count.
+ */
+bool
+thread_oncpu(const struct thread *t)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c->c_curthread == t && !c->c_isidle) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Put a process in gang mode or take it out; see "Gang scheduling"
+ * above.
+ *
+ * Threads of a new gang that are already on a run queue join the
+ * gang the next time they're requeued. Threads of a former gang that
+ * are waiting for its slot go back on run queues right away.
+ */
+int
+thread_setgang(struct proc *proc, bool on)
+{
+	struct threadlist released;
+	struct thread *t;
+	unsigned i;
+
+	threadlist_init(&released);
+	spinlock_acquire(&gang_lock);
+	if (on && !proc->p_gang) {
+		if (gang_nprocs == GANG_MAXPROCS) {
+			spinlock_release(&gang_lock);
+			threadlist_cleanup(&released);
+			return EBUSY;
+		}
+		gang_procs[gang_nprocs++] = proc;
+		proc->p_gang = true;
+	}
+	else if (!on && proc->p_gang) {
+		for (i=0; gang_procs[i] != proc; i++) {
+			KASSERT(i < gang_nprocs);
+		}
+		if (gang_current == proc) {
+			gang_current = NULL;
+			gang_nready = 0;
+		}
+		for (; i+1 < gang_nprocs; i++) {
+			gang_procs[i] = gang_procs[i+1];
+		}
+		gang_nprocs--;
+		gang_procs[gang_nprocs] = NULL;
+		/* Keep the slot pointing at the same gang, or the open slot. */
+		if (gang_current == NULL) {
+			gang_slot = gang_nprocs;
+		}
+		else if (gang_procs[gang_slot] != gang_current) {
+			gang_slot--;
+		}
+		proc->p_gang = false;
+		while ((t = threadlist_remhead(&proc->p_gangready)) != NULL) {
+			gang_nwaiting--;
+			threadlist_addtail(&released, t);
+		}
+	}
+	spinlock_release(&gang_lock);
+
+	while ((t = threadlist_remhead(&released)) != NULL) {
+		thread_make_runnable(t, false);
+	}
+	threadlist_cleanup(&released);
+	return 0;
+}
+
+/*
+ * Start the next gang slot every sched_gang_slice hardclocks of cpu 0
+ * and tell the other cpus; see thread.h.
+ */
+bool
+thread_gang_tick(void)
+{
+	if (gang_nprocs == 0) {
+		return false;
+	}
+
+	if (curcpu->c_number == 0 && ++gang_ticks >= sched_gang_slice) {
+		gang_ticks = 0;
+		spinlock_acquire(&gang_lock);
+		gang_slot = (gang_slot + 1) % (gang_nprocs + 1);
+		gang_current = gang_slot < gang_nprocs ?
+			gang_procs[gang_slot] : NULL;
+		gang_nready = gang_current != NULL ?
+			gang_current->p_gangready.tl_count : 0;
+		spinlock_release(&gang_lock);
+		ipi_broadcast(IPI_GANG);
+	}
+	return thread_gang_wantswitch(curthread);
+}
+
+bool
+thread_gang_active(void)
+{
+	return gang_nprocs > 0;
+}
+
+/*
+ * Finish the current EDF thread's work for this period. If it's
+ * already late, the next period has started and it's still eligible,
+ * so it just yields.
+ */
+void
+thread_edf_wait(void)
+{
+	struct thread *cur;
+	unsigned now;
+
+	cur = curthread;
+	KASSERT(cur->t_edf_period != 0);
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	now = curcpu->c_hardclocks;
+	if (EDF_BEFORE(now, cur->t_edf_deadline)) {
+		cur->t_edf_done = true;
+	}
+	else {
+		thread_edf_advance(cur, now);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	thread_yield();
+}
+
+/*
+ * Record the end of a thread's run on the current cpu: when it
+ * stopped, and fold the run's length into its decayed average.
+ */
+static
+void
+thread_account_run(struct thread *t)
+{
+	unsigned runlen;
+
+	runlen = (curcpu->c_hardclocks - t->t_runstart) * RUNAVG_SCALE;
+	t->t_runavg -= t->t_runavg >> RUNAVG_DECAY;
+	t->t_runavg += runlen >> RUNAVG_DECAY;
+	t->t_lastran = curcpu->c_hardclocks;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Read-copy-update; see rcu.h.
+ *
+ * There's at most one grace period in progress: rcu_gpnum, while it's
+ * not equal to rcu_gpdone. It waits for the cpus in rcu_qsneeded,
+ * those that weren't idle when it started. Each cpu notes in c_rcu_gp
+ * the last grace period it has passed a quiescent state in, so it
+ * only takes rcu_lock once per grace period. When a grace period
+ * ends, the calls that were waiting for it are ready to make, and the
+ * calls that came in meanwhile start the next one.
+ */
+
+/*
+ * Append the list CBS to the list *LISTP.
+ */
+static
+void
+rcu_splice(struct rcu_head **listp, struct rcu_head *cbs)
+{
+	while (*listp != NULL) {
+		listp = &(*listp)->rh_next;
+	}
+	*listp = cbs;
+}
+
+/*
+ * The current grace period is over.
+ */
+static
+void
+rcu_gp_end(void)
+{
+	KASSERT(spinlock_do_i_hold(&rcu_lock));
+
+	rcu_gpdone = rcu_gpnum;
+	rcu_splice((struct rcu_head **)&rcu_donecbs, rcu_curcbs);
+	rcu_curcbs = NULL;
+}
+
+/*
+ * If no grace period is in progress, start one for the calls on
+ * rcu_nextcbs, if any. Idle cpus have no readers, and any they start
+ * later can't see what the calls are for, so they're left out; if
+ * that's all of them, the grace period is over at once. (c_isidle is
+ * read unlocked; it's also set briefly by cpus in thread_switch,
+ * which isn't a reader either.)
+ */
+static
+void
+rcu_gp_start(void)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+	cpumask_t needed;
+
+	KASSERT(spinlock_do_i_hold(&rcu_lock));
+
+	while (rcu_gpdone == rcu_gpnum && rcu_nextcbs != NULL) {
+		rcu_curcbs = rcu_nextcbs;
+		rcu_nextcbs = NULL;
+		rcu_gpnum++;
+
+		needed = 0;
+		numcpus = cpuarray_num(&allcpus);
+		for (i=0; i<numcpus; i++) {
+			c = cpuarray_get(&allcpus, i);
+			if (!c->c_isidle) {
+				needed |= CPUMASK_BIT(c->c_number);
+			}
+		}
+		rcu_qsneeded = needed;
+		if (needed == 0) {
+			rcu_gp_end();
+		}
+	}
+}
+
+/*
+ * The current cpu is in a quiescent state: it's not in the middle of
+ * a read-side critical section. Interrupts must be off.
+ */
+static
+void
+rcu_qs(void)
+{
+	cpumask_t bit;
+
+	if (curcpu->c_rcu_gp == rcu_gpnum) {
+		/* Already counted, or there's no grace period yet. */
+		return;
+	}
+
+	bit = CPUMASK_BIT(curcpu->c_number);
+	spinlock_acquire(&rcu_lock);
+	curcpu->c_rcu_gp = rcu_gpnum;
+	if (rcu_gpdone != rcu_gpnum && (rcu_qsneeded & bit) != 0) {
+		rcu_qsneeded &= ~bit;
+		if (rcu_qsneeded == 0) {
+			rcu_gp_end();
+			rcu_gp_start();
+		}
+	}
+	spinlock_release(&rcu_lock);
+}
+
+/*
+ * Queue a call for after a grace period; see rcu.h.
+ */
+void
+call_rcu(struct rcu_head *head, void (*func)(void *), void *arg)
+{
+	head->rh_func = func;
+	head->rh_arg = arg;
+	head->rh_next = NULL;
+
+	spinlock_acquire(&rcu_lock);
+	rcu_splice(&rcu_nextcbs, head);
+	rcu_gp_start();
+	spinlock_release(&rcu_lock);
+}
+
+/*
+ * The call synchronize_rcu waits for.
+ */
+static
+void
+rcu_wakeup(void *arg)
+{
+	volatile bool *donep = arg;
+
+	*donep = true;
+	wchan_wakeall(rcu_wchan);
+}
+
+/*
+ * Wait for a grace period; see rcu.h.
+ */
+void
+synchronize_rcu(void)
+{
+	struct rcu_head head;
+	volatile bool done;
+
+	KASSERT(!curthread->t_in_interrupt);
+	KASSERT(curthread->t_rcu_nesting == 0);
+
+	done = false;
+	call_rcu(&head, rcu_wakeup, (void *)&done);
+
+	/* rcu_wakeup sets DONE before it locks the channel to wake us. */
+	wchan_lock(rcu_wchan);
+	while (!done) {
+		wchan_sleep(rcu_wchan);
+		wchan_lock(rcu_wchan);
+	}
+	wchan_unlock(rcu_wchan);
+}
+
+/*
+ * RCU work for hardclock(): note a quiescent state unless we
+ * interrupted a reader, and make any calls whose grace period is
+ * over. Whichever cpu gets here first makes them.
+ */
+void
+rcu_tick(void)
+{
+	struct rcu_head *cbs, *next;
 
-	/* Set up the switchframe so entrypoint() gets called */
-	switchframe_init(newthread, entrypoint, data1, data2);
+	if (curthread->t_rcu_nesting == 0) {
+		rcu_qs();
+	}
 
-	/* Lock the current cpu's run queue and make the new thread runnable */
-	thread_make_runnable(newthread, false);
+	if (rcu_donecbs == NULL) {
+		return;
+	}
+	spinlock_acquire(&rcu_lock);
+	cbs = rcu_donecbs;
+	rcu_donecbs = NULL;
+	spinlock_release(&rcu_lock);
+
+	while (cbs != NULL) {
+		/* The call may free CBS. */
+		next = cbs->rh_next;
+		cbs->rh_func(cbs->rh_arg);
+		cbs = next;
+	}
+}
 
-	return 0;
+/*
+ * Check whether RCU needs ticks: a grace period is in progress, or
+ * there are calls ready to make. Unlocked; it's only a hint.
+ */
+bool
+rcu_pending(void)
+{
+	return rcu_gpnum != rcu_gpdone || rcu_donecbs != NULL;
 }
 
+////////////////////////////////////////////////////////////
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -545,9 +2174,11 @@ thread_fork(const char *name,
  */
 static
 void
-thread_switch(threadstate_t newstate, struct wchan *wc)
+thread_switch(threadstate_t newstate, struct wchan *wc, struct thread *to)
 {
 	struct thread *cur, *next;
+	struct schedstat *stats;
+	uint64_t now, idlestart;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -557,6 +2188,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	spl = splhigh();
 
 	cur = curthread;
+	stats = &curcpu->c_stats;
 
 	/*
 	 * If we're idle, return without doing anything. This happens
@@ -567,19 +2199,49 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		return;
 	}
 
+	/*
+	 * Don't preempt an RCU reader; the next tick will. Readers
+	 * mustn't sleep or yield of their own accord. Anything else
+	 * is a quiescent state.
+	 */
+	if (cur->t_rcu_nesting > 0) {
+		KASSERT(newstate == S_READY && cur->t_in_interrupt);
+		splx(spl);
+		return;
+	}
+	rcu_qs();
+
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
-	/* Lock the run queue. */
+	/* Lock the run queue, and pick up any remote wakeups. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
+	thread_inbox_drain();
 
-	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	/*
+	 * Micro-optimization: if nothing to do, just return. (An EDF
+	 * thread that can't run now must still wait, though, and so
+	 * must a thread the gang scheduler wants out of the way.)
+	 */
+	if (to == NULL &&
+	    newstate == S_READY && runqueue_isempty(&curcpu->c_runqueue) &&
+	    threadlist_isempty(&curcpu->c_edfqueue) &&
+	    (cur->t_edf_period == 0 ||
+	     thread_edf_eligible(cur, curcpu->c_hardclocks)) &&
+	    !thread_gang_wantswitch(cur)) {
+		/* Not switching, so whatever the drain staged can go. */
+		thread_gang_publish(curcpu->c_self);
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
 	}
 
+	/* Update the run history for the run that's ending. */
+	thread_account_run(cur);
+	if (newstate != S_READY) {
+		thread_load_update(cur, true);
+	}
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -589,6 +2251,14 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		break;
 	    case S_SLEEP:
 		cur->t_wchan_name = wc->wc_name;
+		/*
+		 * Giving up the cpu voluntarily earns a move up one
+		 * level and a fresh allotment there.
+		 */
+		if (cur->t_priority > SCHED_TOPPRI) {
+			cur->t_priority--;
+		}
+		cur->t_slices = 0;
 		/*
 		 * Add the thread to the list in the wait channel, and
 		 * unlock same. To avoid a race with someone else
@@ -613,8 +2283,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	cur->t_state = newstate;
 
 	/*
-	 * Get the next thread. While there isn't one, call md_idle().
-	 * curcpu->c_isidle must be true when md_idle is
+	 * Get the next thread. While there isn't one, try to steal one
+	 * from another cpu, and failing that call cpu_idle().
+	 * curcpu->c_isidle must be true when cpu_idle is
 	 * called. Unlock the runqueue while idling too, to make sure
 	 * things can be added to it.
 	 *
@@ -629,18 +2300,58 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	 * lock to look at it, this should not be visible or matter.
 	 */
 
+	/*
+	 * A directed yield (thread_yield_to) names the next thread,
+	 * which the caller took off a wait channel; it's waking up.
+	 */
+	if (to != NULL) {
+		next = to;
+		KASSERT(next->t_cpu == curcpu->c_self);
+		next->t_readytime = 0;
+		thread_load_update(next, false);
+		stats->ss_wakeups++;
+		goto picked;
+	}
+
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		thread_inbox_drain();
+		next = thread_runqueue_next(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+			if (next == NULL) {
+				stats->ss_idles++;
+				idlestart = schedstat_now();
+				cpu_idle();
+				now = schedstat_now();
+				if (idlestart != 0 && now > idlestart) {
+					stats->ss_idleusecs += now - idlestart;
+				}
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
 
+ picked:
+	/* Update the statistics, including how long NEXT waited. */
+	if (next != cur) {
+		stats->ss_switches++;
+		if (newstate == S_SLEEP) {
+			stats->ss_sleeps++;
+		}
+	}
+	if (next->t_readytime != 0) {
+		now = schedstat_now();
+		if (now >= next->t_readytime) {
+			stats->ss_waithist[
+				schedstat_bucket(now - next->t_readytime)]++;
+		}
+		next->t_readytime = 0;
+	}
+
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
 	 * curthread and it may not be, depending on how curthread and
@@ -651,6 +2362,12 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	curcpu->c_curthread = next;
 	curthread = next;
 
+	/* Start the new run. (Not after the switch; see below.) */
+	next->t_lastcpu = curcpu->c_self;
+	next->t_runstart = curcpu->c_hardclocks;
+	curcpu->c_gangproc = next->t_proc != NULL && next->t_proc->p_gang ?
+		next->t_proc : NULL;
+
 	/* do the switch (in assembler in switch.S) */
 	switchframe_switch(&cur->t_context, &next->t_context);
 
@@ -705,11 +2422,17 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	cur->t_wchan_name = NULL;
 	cur->t_state = S_RUN;
 
+	/*
+	 * The switch is done, so the thread we switched away from can
+	 * be seen by other cpus now, if it's a gang thread staged here.
+	 */
+	thread_gang_publish(curcpu->c_self);
+
 	/* Unlock the run queue. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
-	/* Activate our address space in the MMU. */
-	as_activate();
+	/* Activate our address space in the MMU, if it isn't already. */
+	curproc_activateas();
 
 	/* Clean up dead threads. */
 	exorcise();
@@ -738,11 +2461,14 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	cur->t_wchan_name = NULL;
 	cur->t_state = S_RUN;
 
+	/* As in thread_switch, now that the switch is done. */
+	thread_gang_publish(curcpu->c_self);
+
 	/* Release the runqueue lock acquired in thread_switch. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
-	/* Activate our address space in the MMU. */
-	as_activate();
+	/* Activate our address space in the MMU, if it isn't already. */
+	curproc_activateas();
 
 	/* Clean up dead threads. */
 	exorcise();
@@ -773,7 +2499,7 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
  *
  * The parts of the thread structure we don't actually need to run
  * should be cleaned up right away. The rest has to wait until
- * thread_destroy is called from exorcise().
+ * exorcise() caches or destroys the thread.
  *
  * Does not return.
  */
@@ -799,12 +2525,22 @@ thread_exit(void)
 	/* Make sure we *are* detached (move this only if you're sure!) */
 	KASSERT(cur->t_proc == NULL);
 
+	KASSERT(cur->t_rcu_nesting == 0);
+
+	/* Give back an EDF thread's reservation. */
+	if (cur->t_edf_period != 0) {
+		spinlock_acquire(&edf_admit_lock);
+		cur->t_cpu->c_edfutil -=
+			EDF_UTIL(cur->t_edf_budget, cur->t_edf_period);
+		spinlock_release(&edf_admit_lock);
+	}
+
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
 	/* Interrupts off on this processor */
         splhigh();
-	thread_switch(S_ZOMBIE, NULL);
+	thread_switch(S_ZOMBIE, NULL, NULL);
 	panic("The zombie walks!\n");
 }
 
@@ -814,25 +2550,194 @@ thread_exit(void)
 void
 thread_yield(void)
 {
-	thread_switch(S_READY, NULL);
+	thread_switch(S_READY, NULL, NULL);
+}
+
+/*
+ * Wake up a thread taken off a wait channel; see thread.h.
+ */
+void
+thread_wakeup(struct thread *target)
+{
+	KASSERT(target != curthread);
+	thread_make_runnable(target, false);
+}
+
+/*
+ * Yield the cpu to a particular thread; see thread.h. The current
+ * thread goes to the back of the run queue, so handing something
+ * back and forth between two threads this way doesn't shut out
+ * everyone else.
+ */
+void
+thread_yield_to(struct thread *target)
+{
+	struct proc *p;
+	int spl;
+
+	KASSERT(target != curthread);
+
+	/*
+	 * Not from an interrupt handler, with spinlocks held, or inside
+	 * an RCU reader.
+	 */
+	if (curthread->t_in_interrupt || curthread->t_iplhigh_count > 0 ||
+	    curthread->t_rcu_nesting > 0) {
+		thread_make_runnable(target, false);
+		return;
+	}
+
+	/*
+	 * Only take a thread that last slept on this cpu: one from
+	 * another cpu may still be switching out there (its cpu holds
+	 * its run queue lock until then, which is what makes ordinary
+	 * wakeups safe), and it's cache-warm there anyway.
+	 */
+	spl = splhigh();
+	p = target->t_proc;
+	if (target->t_cpu != curcpu->c_self ||
+	    target->t_edf_period != 0 || (p != NULL && p->p_gang) ||
+	    !CPUMASK_HAS(target->t_affinity, curcpu->c_number)) {
+		/* It has to be scheduled the usual way. */
+		thread_make_runnable(target, false);
+	}
+	else {
+		thread_switch(S_READY, NULL, target);
+	}
+	splx(spl);
 }
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * EDF work for hardclock(): charge the current thread's budget if
+ * it's an EDF thread, and decide whether it has to give up the cpu,
+ * either because it can't run any more this period or because an
+ * eligible EDF thread with an earlier deadline is waiting. Ordinary
+ * threads give way to any eligible EDF thread.
+ */
+bool
+thread_edf_tick(void)
+{
+	struct thread *cur, *t;
+	unsigned now;
+	bool preempt;
+
+	cur = curthread;
+	if (cur->t_edf_period == 0 &&
+	    threadlist_isempty(&curcpu->c_edfqueue)) {
+		return false;
+	}
+
+	preempt = false;
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	now = curcpu->c_hardclocks;
+	if (cur->t_edf_period != 0 && !curcpu->c_isidle) {
+		cur->t_edf_used++;
+		thread_edf_advance(cur, now);
+		if (!thread_edf_eligible(cur, now)) {
+			preempt = true;
+		}
+	}
+	THREADLIST_FORALL(t, curcpu->c_edfqueue) {
+		thread_edf_advance(t, now);
+		if (thread_edf_eligible(t, now) &&
+		    (cur->t_edf_period == 0 ||
+		     EDF_BEFORE(t->t_edf_deadline, cur->t_edf_deadline))) {
+			preempt = true;
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	return preempt;
+}
+
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is called periodically from hardclock(). Under every policy it
+ * charges one slice to the process of the thread it interrupted,
+ * advancing its stride pass; this is also what the achieved shares
+ * printed by proc_printshares are based on. Under SCHED_RR and
+ * SCHED_STRIDE that's all; the thread_yield() at the end of
+ * hardclock() does the rest.
+ *
+ * Under SCHED_MLFQ it charges the interrupted thread one slice and
+ * demotes it if it has used up its allotment at its level. Since
+ * curthread isn't on the run queue, this doesn't disturb the queue
+ * order; it gets requeued at its new level by the thread_yield() at
+ * the end of hardclock(). Periodically it also moves every thread on
+ * this cpu back to the top level; they're taken off best level first,
+ * so they keep their relative order there.
  */
-
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct thread *cur, *t;
+	struct threadlist boosted;
+	struct proc *p;
+
+	cur = curthread;
+	p = cur->t_proc;
+	if (!curcpu->c_isidle && p != NULL) {
+		spinlock_acquire(&p->p_lock);
+		p->p_pass += p->p_stride;
+		p->p_slices++;
+		spinlock_release(&p->p_lock);
+	}
+
+	if (sched_policy != SCHED_MLFQ) {
+		return;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+
+	curcpu->c_schedules++;
+	if (curcpu->c_schedules % MLFQ_BOOST_SCHEDULES == 0) {
+		threadlist_init(&boosted);
+		while ((t = runqueue_remhead(&curcpu->c_runqueue)) != NULL) {
+			t->t_priority = SCHED_TOPPRI;
+			t->t_slices = 0;
+			threadlist_addtail(&boosted, t);
+		}
+		while ((t = threadlist_remhead(&boosted)) != NULL) {
+			runqueue_add(&curcpu->c_runqueue, t,
+				     THREAD_PRIORITY(t));
+		}
+		threadlist_cleanup(&boosted);
+		cur->t_priority = SCHED_TOPPRI;
+		cur->t_slices = 0;
+	}
+	else if (!curcpu->c_isidle) {
+		cur->t_slices++;
+		if (cur->t_slices >= MLFQ_ALLOTMENT(cur->t_priority)) {
+			if (cur->t_priority < SCHED_BOTPRI) {
+				cur->t_priority++;
+			}
+			cur->t_slices = 0;
+		}
+	}
+
+	spinlock_release(&curcpu->c_runqueue_lock);
+}
+
+/*
+ * Estimate how much it would cost to move T off the current cpu: zero
+ * if it last ran elsewhere or at least sched_migrate_coldticks ago;
+ * otherwise its average run length, as a stand-in for the size of
+ * the working set it has been building up in this cpu's cache.
+ */
+static
+unsigned
+thread_migration_cost(struct thread *t)
+{
+	if (t->t_lastcpu != curcpu->c_self) {
+		return 0;
+	}
+	if (curcpu->c_hardclocks - t->t_lastran >= sched_migrate_coldticks) {
+		return 0;
+	}
+	return t->t_runavg;
 }
 
 /*
@@ -842,93 +2747,149 @@ schedule(void)
  * CPU is busy and other CPUs are idle, or less busy, it should move
  * threads across to those other other CPUs.
  *
+ * How busy a cpu is is its load (see "Load tracking" above), not how
+ * long its run queue happens to be right now; a brief burst of
+ * wakeups shouldn't send threads away only for them to come back once
+ * it's over. We shed at most the load we have over the average, and
+ * only send a thread to a cpu whose load would still be lower than
+ * ours was with the thread included. Since no move can make the
+ * destination busier than the source was, threads don't bounce back
+ * and forth.
+ *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
  * which is fairly slow. The tradeoff between this performance loss
  * and the performance loss due to underutilization of some CPUs is
  * something that needs to be tuned and probably is workload-specific.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * So we pick victims by estimated migration cost (see
+ * thread_migration_cost): first threads that are already cold here,
+ * then warm ones whose cost is at most sched_migrate_maxcost. Threads
+ * that cost more than that stay put even if it leaves us over our
+ * share. Within each pass we work from the tail of the run queue (the
+ * worst level, found from the run queue's bitmap), as those threads
+ * would otherwise wait longest, and stop as soon as we have enough.
+ *
+ * Threads are only ever sent to cpus in their affinity mask, and
+ * threads that are here but not allowed to be are always sent away.
  */
 void
 thread_consider_migration(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
+	unsigned my_load, total_load, one_share, excess, picked, sent, load;
+	unsigned i, numcpus, pass, cost, me;
 	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	struct threadlist victims, leftovers;
+	struct thread *t, *prev;
+	bool take, stray;
 
-	my_count = total_count = 0;
+	my_load = total_load = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
 		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		total_load += c->c_load;
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			my_load = c->c_load;
 		}
 		spinlock_release(&c->c_runqueue_lock);
 	}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
-	}
+	one_share = total_load / numcpus;
+	excess = my_load > one_share ? my_load - one_share : 0;
+	me = curcpu->c_number;
 
-	to_send = my_count - one_share;
+	/*
+	 * Pass 0 takes every thread whose affinity mask no longer
+	 * allows this cpu; those go regardless of load. Passes 1 and 2
+	 * pick threads as described above until their load adds up to
+	 * the excess, leaving alone threads that aren't allowed
+	 * anywhere else.
+	 */
 	threadlist_init(&victims);
+	picked = 0;
 	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	for (pass=0; pass<3 && (pass == 0 || picked < excess); pass++) {
+		t = runqueue_last(&curcpu->c_runqueue);
+		while (t != NULL) {
+			if (pass > 0 && picked >= excess) {
+				break;
+			}
+			prev = runqueue_prev(&curcpu->c_runqueue, t);
+			if (pass == 0) {
+				take = !CPUMASK_HAS(t->t_affinity, me);
+			}
+			else if ((t->t_affinity & ~CPUMASK_BIT(me)) == 0) {
+				take = false;
+			}
+			else {
+				cost = thread_migration_cost(t);
+				take = pass == 1 ? cost == 0 :
+					cost <= sched_migrate_maxcost;
+				if (take) {
+					picked += thread_load(t);
+				}
+			}
+			if (take) {
+				runqueue_remove(&curcpu->c_runqueue, t);
+				threadlist_addhead(&victims, t);
+			}
+			t = prev;
+		}
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
+	/*
+	 * Give each victim to the least loaded other cpu it's allowed
+	 * on, taking its load along. Balancing victims only go if they
+	 * leave that cpu less loaded than we are.
+	 */
+	threadlist_init(&leftovers);
+	sent = 0;
+	while ((t = threadlist_remhead(&victims)) != NULL) {
+		/*
+		 * Ordinarily, curthread will not appear on the run
+		 * queue. However, it can under the following
+		 * circumstances:
+		 *   - it went to sleep;
+		 *   - the processor became idle, so it remained
+		 *     curthread;
+		 *   - it was reawakened, so it was put on the run
+		 *     queue;
+		 *   - and the processor hasn't fully unidled yet, so
+		 *     all these things are still true.
+		 *
+		 * If the timer interrupt happens at (almost) exactly
+		 * the proper moment, we can come here while things
+		 * are in this state and see curthread. However,
+		 * *migrating* curthread can cause bad things to
+		 * happen (Exercise: Why? And what?) so skip it. It
+		 * goes back on our own run queue below.
+		 */
+		if (t == curthread) {
+			threadlist_addtail(&leftovers, t);
 			continue;
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
 
+		stray = !CPUMASK_HAS(t->t_affinity, me);
+		c = thread_leastloaded(t->t_affinity, curcpu->c_self);
+		if (c == NULL) {
+			threadlist_addtail(&leftovers, t);
+			continue;
+		}
+
+		load = thread_load(t);
+		spinlock_acquire(&c->c_runqueue_lock);
+		if (stray || c->c_load + load < my_load) {
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			thread_runqueue_add(c, t);
+			c->c_load += load;
+			my_load = my_load > load ? my_load - load : 0;
+			sent += load;
+			curcpu->c_stats.ss_migrations++;
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
 			if (c->c_isidle) {
 				/*
 				 * Other processor is idle; send
@@ -936,25 +2897,185 @@ thread_consider_migration(void)
 				 */
 				ipi_send(c, IPI_UNIDLE);
 			}
+			t = NULL;
 		}
 		spinlock_release(&c->c_runqueue_lock);
+
+		if (t != NULL) {
+			threadlist_addtail(&leftovers, t);
+		}
 	}
+	threadlist_cleanup(&victims);
 
 	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
+	 * Because the code above isn't atomic, things may have changed
+	 * while we were working and we may end up with leftovers.
 	 * Don't panic; just put them back on our own run queue.
 	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	thread_load_remove(curcpu, sent);
+	while ((t = threadlist_remhead(&leftovers)) != NULL) {
+		thread_runqueue_add(curcpu, t);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+	threadlist_cleanup(&leftovers);
+}
+
+/*
+ * Print the label of wait histogram bucket B, in microseconds, padded
+ * to line up in a column if PAD is true.
+ */
+static
+void
+schedstat_printbucket(unsigned b, bool pad)
+{
+	if (b == 0) {
+		kprintf(pad ? "%13s" : "%s", "<1");
+	}
+	else if (b == SCHEDSTAT_BUCKETS - 1) {
+		kprintf(pad ? "%6s%7u" : "%s%u", ">=", 1U << (b - 1));
+	}
+	else {
+		kprintf(pad ? "%6u-%-6u" : "%u-%u", 1U << (b - 1), 1U << b);
+	}
+}
+
+/*
+ * Print each cpu's scheduler statistics since the last reset, then
+ * the run queue wait histogram of all cpus together, with the buckets
+ * the median and 99th percentile fall in. If RESET is true, start a
+ * new interval.
+ *
+ * The counters are read without locking while their cpus may be
+ * updating them, so the numbers are only approximately consistent.
+ * Resetting just moves the baselines; the counters are untouched.
+ */
+void
+thread_printstats(bool reset)
+{
+	struct cpu *c;
+	struct schedstat snap, *base;
+	unsigned hist[SCHEDSTAT_BUCKETS];
+	unsigned i, b, first, last, max, total, sum, p50, p99, scale;
+
+	for (b=0; b<SCHEDSTAT_BUCKETS; b++) {
+		hist[b] = 0;
+	}
+
+	kprintf("%4s %8s %8s %8s %8s %8s %8s %8s %8s\n", "cpu", "switches",
+		"sleeps", "wakeups", "remote", "idles", "idle ms", "steals",
+		"migrated");
+	for (i=0; (c = cpu_get(i)) != NULL; i++) {
+		snap = c->c_stats;
+		base = &schedstat_base[c->c_number];
+		kprintf("%4u %8u %8u %8u %8u %8u %8u %8u %8u\n", c->c_number,
+			snap.ss_switches - base->ss_switches,
+			snap.ss_sleeps - base->ss_sleeps,
+			snap.ss_wakeups - base->ss_wakeups,
+			snap.ss_remotewakeups - base->ss_remotewakeups,
+			snap.ss_idles - base->ss_idles,
+			(snap.ss_idleusecs - base->ss_idleusecs) / 1000,
+			snap.ss_steals - base->ss_steals,
+			snap.ss_migrations - base->ss_migrations);
+		for (b=0; b<SCHEDSTAT_BUCKETS; b++) {
+			hist[b] += snap.ss_waithist[b] - base->ss_waithist[b];
+		}
+		if (reset) {
+			*base = snap;
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
 	}
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	first = SCHEDSTAT_BUCKETS;
+	last = max = total = 0;
+	for (b=0; b<SCHEDSTAT_BUCKETS; b++) {
+		if (hist[b] == 0) {
+			continue;
+		}
+		if (first == SCHEDSTAT_BUCKETS) {
+			first = b;
+		}
+		last = b;
+		if (hist[b] > max) {
+			max = hist[b];
+		}
+		total += hist[b];
+	}
+	if (total == 0) {
+		kprintf("No run queue waits recorded%s\n",
+			schedstat_timing ? "" : " (schedstat_timing is off)");
+		return;
+	}
+
+	kprintf("\nRun queue wait, us:\n");
+	scale = DIVROUNDUP(max, 40);
+	sum = 0;
+	p50 = p99 = SCHEDSTAT_BUCKETS;
+	for (b=first; b<=last; b++) {
+		schedstat_printbucket(b, true);
+		kprintf(" %10u ", hist[b]);
+		for (i=0; i<hist[b] / scale; i++) {
+			kprintf("#");
+		}
+		kprintf("\n");
+
+		sum += hist[b];
+		if (p50 == SCHEDSTAT_BUCKETS && sum >= total - total / 2) {
+			p50 = b;
+		}
+		if (p99 == SCHEDSTAT_BUCKETS && sum >= total - total / 100) {
+			p99 = b;
+		}
+	}
+	kprintf("%u waits; median ", total);
+	schedstat_printbucket(p50, false);
+	kprintf(" us, 99th percentile ");
+	schedstat_printbucket(p99, false);
+	kprintf(" us\n");
+}
+
+/*
+ * Print each cpu's load, its run queue length, and the thread running
+ * on it with that thread's load. Loads are in threads, to two places.
+ *
+ * c_curthread only changes with the run queue locked, and the thread
+ * can't go away while it's running, so it's safe to look at with the
+ * lock held; but kprintf can't be called then, so copy what we need.
+ */
+void
+thread_printload(void)
+{
+	struct cpu *c;
+	struct thread *t;
+	char name[THREAD_NAMEBUF];
+	unsigned i, j, load, curload, queued;
+	bool idle;
+
+	kprintf("%4s %8s %6s  %s\n", "cpu", "load", "queued", "running");
+	for (i=0; (c = cpu_get(i)) != NULL; i++) {
+		spinlock_acquire(&c->c_runqueue_lock);
+		load = c->c_load;
+		queued = c->c_runqueue.rq_count + c->c_edfqueue.tl_count;
+		idle = c->c_isidle;
+		t = c->c_curthread;
+		for (j=0; j<sizeof(name) - 1 && t->t_name[j] != 0; j++) {
+			name[j] = t->t_name[j];
+		}
+		name[j] = 0;
+		curload = thread_load(t);
+		spinlock_release(&c->c_runqueue_lock);
+
+		load = load * 100 / LOAD_SCALE;
+		curload = curload * 100 / LOAD_SCALE;
+		kprintf("%4u %5u.%u%u %6u  ", c->c_number, load / 100,
+			load / 10 % 10, load % 10, queued);
+		if (idle) {
+			kprintf("(idle)\n");
+		}
+		else {
+			kprintf("%s (%u.%u%u)\n", name, curload / 100,
+				curload / 10 % 10, curload % 10);
+		}
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -1025,7 +3146,7 @@ wchan_sleep(struct wchan *wc)
 	/* may not sleep in an interrupt handler */
 	KASSERT(!curthread->t_in_interrupt);
 
-	thread_switch(S_SLEEP, wc);
+	thread_switch(S_SLEEP, wc, NULL);
 }
 
 /*
@@ -1053,6 +3174,46 @@ wchan_wakeone(struct wchan *wc)
 	thread_make_runnable(target, false);
 }
 
+/*
+ * Take one thread off a wait channel without waking it up.
+ */
+struct thread *
+wchan_takeone(struct wchan *wc)
+{
+	struct thread *target;
+
+	spinlock_acquire(&wc->wc_lock);
+	target = threadlist_remhead(&wc->wc_threads);
+	spinlock_release(&wc->wc_lock);
+	return target;
+}
+
+/*
+ * Wake up one particular thread sleeping on a wait channel.
+ */
+void
+wchan_wakethread(struct wchan *wc, struct thread *target)
+{
+	spinlock_acquire(&wc->wc_lock);
+	threadlist_remove(&wc->wc_threads, target);
+	spinlock_release(&wc->wc_lock);
+
+	thread_make_runnable(target, false);
+}
+
+/*
+ * Put a thread taken off another wait channel with wchan_takeone
+ * onto this one, still asleep.
+ */
+void
+wchan_enqueue(struct wchan *wc, struct thread *target)
+{
+	spinlock_acquire(&wc->wc_lock);
+	target->t_wchan_name = wc->wc_name;
+	threadlist_addtail(&wc->wc_threads, target);
+	spinlock_release(&wc->wc_lock);
+}
+
 /*
  * Wake up all threads sleeping on a wait channel.
  */
@@ -1206,4 +3367,13 @@ interprocessor_interrupt(void)
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
+
+	/*
+	 * A gang slot started (see thread_gang_tick) or a thread of the
+	 * current gang woke up (see thread_gang_kick). Get out of the
+	 * way if need be; not while holding the IPI lock, though.
+	 */
+	if ((bits & (1U << IPI_GANG)) && thread_gang_wantswitch(curthread)) {
+		thread_yield();
+	}
 }
@@ -238,3 +238,181 @@ threadlist_remove(struct threadlist *tl, struct thread *t)
 	DEBUGASSERT(tl->tl_count > 0);
 	tl->tl_count--;
 }
+
+////////////////////////////////////////////////////////////
+// run queue
+
+/*
+ * Bit index of the lowest set bit of a nonzero mask, in constant
+ * time: isolating the bit and multiplying by a de Bruijn sequence
+ * leaves a distinct 5-bit pattern at the top for each position.
+ */
+static
+unsigned
+runqueue_lowbit(uint32_t mask)
+{
+	static const unsigned char positions[32] = {
+		0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+		31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9,
+	};
+
+	DEBUGASSERT(mask != 0);
+	return positions[((mask & -mask) * 0x077CB531U) >> 27];
+}
+
+/*
+ * Bit index of the highest set bit of a nonzero mask. Smearing it
+ * down through all the lower bits leaves one bit to find once the
+ * rest are shifted back out.
+ */
+static
+unsigned
+runqueue_highbit(uint32_t mask)
+{
+	DEBUGASSERT(mask != 0);
+	mask |= mask >> 1;
+	mask |= mask >> 2;
+	mask |= mask >> 4;
+	mask |= mask >> 8;
+	mask |= mask >> 16;
+	return runqueue_lowbit(mask ^ (mask >> 1));
+}
+
+void
+runqueue_init(struct runqueue *rq)
+{
+	unsigned i;
+
+	DEBUGASSERT(rq != NULL);
+
+	for (i=0; i<RUNQUEUE_LEVELS; i++) {
+		threadlist_init(&rq->rq_levels[i]);
+	}
+	rq->rq_nonempty = 0;
+	rq->rq_count = 0;
+}
+
+void
+runqueue_cleanup(struct runqueue *rq)
+{
+	unsigned i;
+
+	DEBUGASSERT(rq != NULL);
+
+	KASSERT(rq->rq_nonempty == 0);
+	KASSERT(rq->rq_count == 0);
+	for (i=0; i<RUNQUEUE_LEVELS; i++) {
+		threadlist_cleanup(&rq->rq_levels[i]);
+	}
+}
+
+bool
+runqueue_isempty(struct runqueue *rq)
+{
+	DEBUGASSERT(rq != NULL);
+
+	return (rq->rq_count == 0);
+}
+
+void
+runqueue_add(struct runqueue *rq, struct thread *t, unsigned level)
+{
+	DEBUGASSERT(rq != NULL);
+	KASSERT(level < RUNQUEUE_LEVELS);
+
+	threadlist_addtail(&rq->rq_levels[level], t);
+	t->t_runlevel = level;
+	rq->rq_nonempty |= (uint32_t)1 << level;
+	rq->rq_count++;
+}
+
+struct thread *
+runqueue_remhead(struct runqueue *rq)
+{
+	struct threadlist *tl;
+	struct thread *t;
+
+	DEBUGASSERT(rq != NULL);
+
+	if (rq->rq_nonempty == 0) {
+		return NULL;
+	}
+	tl = &rq->rq_levels[runqueue_lowbit(rq->rq_nonempty)];
+	t = threadlist_remhead(tl);
+	DEBUGASSERT(t != NULL);
+	if (threadlist_isempty(tl)) {
+		rq->rq_nonempty &= ~((uint32_t)1 << t->t_runlevel);
+	}
+	DEBUGASSERT(rq->rq_count > 0);
+	rq->rq_count--;
+	return t;
+}
+
+void
+runqueue_remove(struct runqueue *rq, struct thread *t)
+{
+	struct threadlist *tl;
+
+	DEBUGASSERT(rq != NULL);
+
+	tl = &rq->rq_levels[t->t_runlevel];
+	threadlist_remove(tl, t);
+	if (threadlist_isempty(tl)) {
+		rq->rq_nonempty &= ~((uint32_t)1 << t->t_runlevel);
+	}
+	DEBUGASSERT(rq->rq_count > 0);
+	rq->rq_count--;
+}
+
+struct thread *
+runqueue_first(struct runqueue *rq)
+{
+	if (rq->rq_nonempty == 0) {
+		return NULL;
+	}
+	return rq->rq_levels[runqueue_lowbit(rq->rq_nonempty)]
+		.tl_head.tln_next->tln_self;
+}
+
+struct thread *
+runqueue_last(struct runqueue *rq)
+{
+	if (rq->rq_nonempty == 0) {
+		return NULL;
+	}
+	return rq->rq_levels[runqueue_highbit(rq->rq_nonempty)]
+		.tl_tail.tln_prev->tln_self;
+}
+
+struct thread *
+runqueue_next(struct runqueue *rq, struct thread *t)
+{
+	uint32_t later;
+
+	if (t->t_listnode.tln_next->tln_next != NULL) {
+		return t->t_listnode.tln_next->tln_self;
+	}
+	/* Levels after T's. (Shifting 2 rather than 1 is safe at 31.) */
+	later = rq->rq_nonempty & ~(((uint32_t)2 << t->t_runlevel) - 1);
+	if (later == 0) {
+		return NULL;
+	}
+	return rq->rq_levels[runqueue_lowbit(later)]
+		.tl_head.tln_next->tln_self;
+}
+
+struct thread *
+runqueue_prev(struct runqueue *rq, struct thread *t)
+{
+	uint32_t earlier;
+
+	if (t->t_listnode.tln_prev->tln_prev != NULL) {
+		return t->t_listnode.tln_prev->tln_self;
+	}
+	earlier = rq->rq_nonempty & (((uint32_t)1 << t->t_runlevel) - 1);
+	if (earlier == 0) {
+		return NULL;
+	}
+	return rq->rq_levels[runqueue_highbit(earlier)]
+		.tl_tail.tln_prev->tln_self;
+}